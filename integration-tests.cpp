@@ -1,15 +1,190 @@
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+#include <chrono>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <mutex>
+#include <new>
+#include <thread>
 
 #include <curl/curl.h>
 
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
+#include "mkcurl.h"
 #include "mkcurl.hpp"
 
+// allocations counts the calls to operator new made by the current thread,
+// such that we can check that mkcurl does not allocate in the steady state
+// without counting the allocations of the LoopbackServer threads.
+static thread_local int64_t allocations = 0;
+
+void *operator new(size_t size) {
+  allocations += 1;
+  void *ptr = malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+#ifndef _WIN32
+// LoopbackServer is a minimal HTTP/1.1 server listening on 127.0.0.1 (and
+// optionally also on ::1) that allows us to test features without depending
+// on the network. For every request, it passes the request head to the
+// handler and writes back the raw response returned by the handler.
+// Connections are kept alive and each of them is served by its own thread.
+class LoopbackServer {
+ public:
+  using Handler = std::function<std::string(const std::string &)>;
+
+  explicit LoopbackServer(Handler handler, bool with_ipv6 = false)
+      : handler_{std::move(handler)} {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    REQUIRE(listener_ != -1);
+    int on = 1;
+    (void)setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in sin{};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(listener_, (sockaddr *)&sin, sizeof(sin)) == 0);
+    socklen_t len = sizeof(sin);
+    REQUIRE(getsockname(listener_, (sockaddr *)&sin, &len) == 0);
+    port_ = ntohs(sin.sin_port);
+    REQUIRE(listen(listener_, 64) == 0);
+    acceptor_ = std::thread{[this]() { accept_loop(listener_); }};
+    if (with_ipv6) {
+      // Also listen on ::1 using the same port, so that a host resolving
+      // to both ::1 and 127.0.0.1 is reachable using both families.
+      listener6_ = socket(AF_INET6, SOCK_STREAM, 0);
+      REQUIRE(listener6_ != -1);
+      (void)setsockopt(listener6_, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+      sockaddr_in6 sin6{};
+      sin6.sin6_family = AF_INET6;
+      sin6.sin6_addr = in6addr_loopback;
+      sin6.sin6_port = htons(port_);
+      REQUIRE(bind(listener6_, (sockaddr *)&sin6, sizeof(sin6)) == 0);
+      REQUIRE(listen(listener6_, 64) == 0);
+      acceptor6_ = std::thread{[this]() { accept_loop(listener6_); }};
+    }
+  }
+
+  ~LoopbackServer() {
+    for (auto fd : {listener_, listener6_, listener_unix_}) {
+      if (fd == -1) continue;
+      (void)shutdown(fd, SHUT_RDWR);
+      (void)close(fd);
+    }
+    acceptor_.join();
+    if (acceptor6_.joinable()) acceptor6_.join();
+    if (acceptor_unix_.joinable()) acceptor_unix_.join();
+    {
+      std::unique_lock<std::mutex> _{mutex_};
+      for (auto fd : conns_) (void)shutdown(fd, SHUT_RDWR);
+    }
+    for (auto &t : workers_) t.join();
+  }
+
+  // listen_unix makes this server also listen on the Unix domain socket
+  // @p path, which is a name in the abstract namespace if @p abstract.
+  void listen_unix(const std::string &path, bool abstract) {
+    listener_unix_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(listener_unix_ != -1);
+    sockaddr_un sun{};
+    sun.sun_family = AF_UNIX;
+    size_t offset = abstract ? 1 : 0;  // abstract names start with a zero
+    REQUIRE(offset + path.size() < sizeof(sun.sun_path));
+    memcpy(sun.sun_path + offset, path.data(), path.size());
+    auto len = (socklen_t)(offsetof(sockaddr_un, sun_path) + offset +
+                           path.size());
+    if (!abstract) (void)unlink(path.c_str());
+    REQUIRE(bind(listener_unix_, (sockaddr *)&sun, len) == 0);
+    REQUIRE(listen(listener_unix_, 64) == 0);
+    acceptor_unix_ = std::thread{[this]() { accept_loop(listener_unix_); }};
+  }
+
+  // connections returns the number of connections we accepted.
+  size_t connections() {
+    std::unique_lock<std::mutex> _{mutex_};
+    return conns_.size();
+  }
+
+  // url returns the URL to fetch @p path from this server.
+  std::string url(const std::string &path) const {
+    return "http://127.0.0.1:" + std::to_string((int)port_) + path;
+  }
+
+ private:
+  void accept_loop(int listener) {
+    for (;;) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd == -1) return;
+      std::unique_lock<std::mutex> _{mutex_};
+      conns_.push_back(fd);
+      workers_.push_back(std::thread{[this, fd]() { serve(fd); }});
+    }
+  }
+
+  void serve(int fd) {
+    std::string buffer;
+    for (;;) {
+      auto end = buffer.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        char data[4096];
+        auto n = recv(fd, data, sizeof(data), 0);
+        if (n <= 0) break;
+        buffer.append(data, (size_t)n);
+        continue;
+      }
+      std::string head = buffer.substr(0, end + 4);
+      buffer = buffer.substr(end + 4);
+      auto cl = head.find("Content-Length: ");
+      if (cl != std::string::npos) {
+        auto length = (size_t)atoll(head.c_str() + cl + 16);
+        while (buffer.size() < length) {
+          char data[4096];
+          auto n = recv(fd, data, sizeof(data), 0);
+          if (n <= 0) break;
+          buffer.append(data, (size_t)n);
+        }
+        buffer = buffer.substr(std::min(length, buffer.size()));
+      }
+      std::string reply = handler_(head);
+      if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) !=
+          (ssize_t)reply.size()) {
+        break;
+      }
+    }
+    (void)close(fd);
+  }
+
+  Handler handler_;
+  int listener_ = -1;
+  int listener6_ = -1;
+  int listener_unix_ = -1;
+  uint16_t port_ = 0;
+  std::thread acceptor_;
+  std::thread acceptor6_;
+  std::thread acceptor_unix_;
+  std::mutex mutex_;
+  std::vector<int> conns_;
+  std::vector<std::thread> workers_;
+};
+#endif  // _WIN32
+
 static void run(mk::curl::Response res, bool tolerate_failure) {
   std::clog << "=== BEGIN SUMMARY ==="
             << std::endl << "CURL error code: " << res.error << std::endl
@@ -32,6 +207,9 @@ static void run(mk::curl::Response res, bool tolerate_failure) {
             << std::endl << res.certs
             << "=== END CERTIFICATE CHAIN ==="
             << std::endl << std::endl;
+  for (auto &cert : res.cert_chain) {
+    std::clog << "SHA-256 fingerprint: " << cert.sha256 << std::endl;
+  }
   std::clog << "=== BEGIN LOGS ===" << std::endl;
   for (auto &log : res.logs) {
     std::clog << "[" << log.msec << "] " << log.line << std::endl;
@@ -45,6 +223,42 @@ static void run(mk::curl::Response res, bool tolerate_failure) {
   }
 }
 
+#ifndef _WIN32
+// curl_allocations counts the allocations made by libcurl.
+static std::atomic<int64_t> curl_allocations{0};
+
+static void *counting_malloc(size_t size) {
+  curl_allocations += 1;
+  return malloc(size);
+}
+
+// This test must run first, because global_init only works before libcurl
+// has been initialized by other tests.
+TEST_CASE("libcurl allocates using the Allocator passed to global_init") {
+  mk::curl::Allocator allocator;
+  allocator.malloc_fn = counting_malloc;
+  allocator.free_fn = free;
+  allocator.realloc_fn = realloc;
+  allocator.strdup_fn = strdup;
+  allocator.calloc_fn = calloc;
+  REQUIRE(mk::curl::global_init(allocator) == 0);
+  REQUIRE(mk::curl::global_init(allocator) == CURLE_FAILED_INIT);
+  LoopbackServer server{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 5\r\n\r\nhello";
+  }};
+  auto before = curl_allocations.load();
+  mk::curl::Client client;
+  mk::curl::Request req;
+  req.url = server.url("/");
+  auto res = client.perform(req);
+  REQUIRE(res.error == 0);
+  REQUIRE(curl_allocations > before);
+  REQUIRE(res.memory.curl_allocations > 0);
+  REQUIRE(res.memory.curl_bytes > 0);
+  REQUIRE(res.memory.response_bytes > 0);
+}
+#endif
+
 TEST_CASE("TCP fastopen works") {
   // Windows does not support TCP fastopen currently.
 #ifdef _WIN32
@@ -55,6 +269,7 @@ TEST_CASE("TCP fastopen works") {
   mk::curl::Request req;
   req.enable_fastopen = true;
   req.url = "https://www.kernel.org";
+  req.cert_capture = mk::curl::CertCapture::pem;
   run(mk::curl::perform(req), tolerate_failure);
 }
 
@@ -89,3 +304,1076 @@ TEST_CASE("We retry a request") {
     REQUIRE(resp.error != CURLE_OK);
   }
 }
+
+#ifndef _WIN32
+TEST_CASE("The cache avoids refetching and revalidates responses") {
+  std::atomic<int> fetches{0};
+  std::atomic<int> revalidations{0};
+  LoopbackServer server{[&](const std::string &head) -> std::string {
+    if (head.find("If-None-Match: \"v1\"") != std::string::npos) {
+      revalidations += 1;
+      return "HTTP/1.1 304 Not Modified\r\n"
+             "ETag: \"v1\"\r\n"
+             "Content-Length: 0\r\n\r\n";
+    }
+    fetches += 1;
+    std::string cache_control = "max-age=3600";
+    if (head.find("GET /stale") == 0) cache_control = "no-cache";
+    if (head.find("GET /aged") == 0) {
+      cache_control = "max-age=3600\r\nAge: 7200";  // already stale
+    }
+    return "HTTP/1.1 200 Ok\r\n"
+           "Cache-Control: " + cache_control + "\r\n"
+           "ETag: \"v1\"\r\n"
+           "Content-Type: text/plain\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  mk::curl::Client client;
+  client.set_cache(std::make_shared<mk::curl::Cache>());
+  mk::curl::Request req;
+  SECTION("for fresh responses") {
+    req.url = server.url("/fresh");
+    auto first = client.perform(req);
+    REQUIRE(first.error == 0);
+    REQUIRE(first.cache_status == "miss");
+    auto second = client.perform(req);
+    REQUIRE(second.error == 0);
+    REQUIRE(second.status_code == 200);
+    REQUIRE(second.body == "hello");
+    REQUIRE(second.cache_status == "hit");
+    REQUIRE(fetches == 1);
+  }
+  SECTION("for responses that need revalidation") {
+    req.url = server.url("/stale");
+    auto first = client.perform(req);
+    REQUIRE(first.error == 0);
+    REQUIRE(first.cache_status == "miss");
+    auto second = client.perform(req);
+    REQUIRE(second.error == 0);
+    REQUIRE(second.status_code == 200);
+    REQUIRE(second.body == "hello");
+    REQUIRE(second.content_type == "text/plain");
+    REQUIRE(second.cache_status == "revalidated");
+    REQUIRE(mk::curl::header_value(second, "content-type") == "text/plain");
+    REQUIRE(fetches == 1);
+    REQUIRE(revalidations == 1);
+  }
+  SECTION("when a 304 response has no freshness information") {
+    req.url = server.url("/aged");
+    auto first = client.perform(req);
+    REQUIRE(first.error == 0);
+    REQUIRE(first.cache_status == "miss");
+    auto second = client.perform(req);
+    REQUIRE(second.error == 0);
+    REQUIRE(second.cache_status == "revalidated");
+    REQUIRE(second.body == "hello");
+    auto third = client.perform(req);
+    REQUIRE(third.error == 0);
+    REQUIRE(third.cache_status == "hit");
+    REQUIRE(fetches == 1);
+    REQUIRE(revalidations == 1);
+  }
+  SECTION("when the response is reloaded from disk") {
+    // Note: a cache with zero entries in memory must always go to disk.
+    mk::curl::Client other;
+    other.set_cache(std::make_shared<mk::curl::Cache>(0, "."));
+    req.url = server.url("/fresh-on-disk");
+    auto first = other.perform(req);
+    REQUIRE(first.error == 0);
+    REQUIRE(first.cache_status == "miss");
+    auto second = other.perform(req);
+    REQUIRE(second.error == 0);
+    REQUIRE(second.body == "hello");
+    REQUIRE(second.cache_status == "hit");
+    REQUIRE(fetches == 1);
+  }
+}
+
+TEST_CASE("SingleFlight coalesces identical concurrent requests") {
+  std::atomic<int> fetches{0};
+  LoopbackServer server{[&](const std::string &) -> std::string {
+    fetches += 1;
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    return "HTTP/1.1 200 Ok\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  mk::curl::SingleFlight single_flight;
+  mk::curl::Request req;
+  req.url = server.url("/");
+  constexpr size_t count = 8;
+  std::vector<std::shared_ptr<const mk::curl::Response>> responses(count);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < count; ++i) {
+    threads.push_back(std::thread{[&, i]() {
+      mk::curl::Client client;
+      responses[i] = single_flight.perform(client, req);
+    }});
+  }
+  for (auto &t : threads) t.join();
+  auto stats = single_flight.stats();
+  REQUIRE(stats.transfers == fetches);
+  REQUIRE(stats.transfers + stats.collapsed == (int64_t)count);
+  REQUIRE(stats.collapsed > 0);
+  for (auto &res : responses) {
+    REQUIRE(res->error == 0);
+    REQUIRE(res->body == "hello");
+  }
+}
+
+TEST_CASE("SingleFlight only coalesces requests with the same token") {
+  LoopbackServer server{[&](const std::string &) -> std::string {
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    return "HTTP/1.1 200 Ok\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  mk::curl::SingleFlight single_flight;
+  mk::curl::Request req;
+  req.url = server.url("/");
+  auto token = std::make_shared<mk::curl::CancellationToken>();
+  std::vector<std::shared_ptr<const mk::curl::Response>> responses(3);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < responses.size(); ++i) {
+    // The first two requests share the token, the third one has none.
+    threads.push_back(std::thread{[&, i]() {
+      mk::curl::Client client;
+      mk::curl::Request r = req;
+      if (i < 2) r.cancellation = token;
+      responses[i] = single_flight.perform(client, r);
+    }});
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  token->cancel();
+  for (auto &t : threads) t.join();
+  auto stats = single_flight.stats();
+  REQUIRE(stats.transfers == 2);
+  REQUIRE(stats.collapsed == 1);
+  REQUIRE(responses[0]->error == mk::curl::error_cancelled);
+  REQUIRE(responses[1]->error == mk::curl::error_cancelled);
+  REQUIRE(responses[2]->error == 0);
+  REQUIRE(responses[2]->body == "hello");
+}
+
+TEST_CASE("The C API returns views into the response") {
+  const std::string body{"\x00\x01\x02\x03", 4};
+  LoopbackServer server{[&](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\n"
+           "Content-Type: application/octet-stream\r\n"
+           "Content-Length: 4\r\n\r\n" + body;
+  }};
+  auto req = mkcurl_request_new_nonnull();
+  auto url = server.url("/");
+  mkcurl_request_set_url(req, url.c_str());
+  mkcurl_request_add_header(req, "Accept: */*");
+  auto client = mkcurl_client_new_nonnull();
+  auto res = mkcurl_client_perform_nonnull(client, req);
+  REQUIRE(mkcurl_response_get_error(res) == 0);
+  REQUIRE(mkcurl_response_get_status_code(res) == 200);
+  {
+    const uint8_t *base = nullptr;
+    size_t count = 0;
+    mkcurl_response_get_body(res, &base, &count);
+    REQUIRE(count == 4);
+    REQUIRE(memcmp(base, body.data(), count) == 0);
+  }
+  {
+    const char *base = nullptr;
+    size_t count = 0;
+    mkcurl_response_get_content_type(res, &base, &count);
+    REQUIRE(std::string(base, count) == "application/octet-stream");
+  }
+  REQUIRE(mkcurl_response_get_logs_size(res) > 0);
+  mkcurl_response_delete(res);
+  mkcurl_client_delete(client);
+  mkcurl_request_delete(req);
+}
+
+TEST_CASE("SessionStore records and preloads addresses") {
+  LoopbackServer server{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  std::string path = "mkcurl-session-store.txt";
+  auto port = server.url("").substr(strlen("http://127.0.0.1:"));
+  {
+    auto store = std::make_shared<mk::curl::SessionStore>();
+    mk::curl::Client client;
+    client.set_session_store(store);
+    mk::curl::Request req;
+    req.url = "http://localhost:" + port + "/";
+    req.connect_to = "::127.0.0.1:";  // Don't depend on /etc/hosts
+    auto res = client.perform(req);
+    REQUIRE(res.error == 0);
+    // Note: with connect_to we don't know whether the address we used
+    // belongs to the host, hence we must not record it.
+    req.connect_to = "";
+    req.url = "http://127.0.0.1:" + port + "/";
+    res = client.perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(store->save(path));
+  }
+  {
+    std::ifstream in{path};
+    std::stringstream ss;
+    ss << in.rdbuf();
+    REQUIRE(ss.str().find("dns 127.0.0.1:" + port + " 127.0.0.1 ") !=
+            std::string::npos);
+    REQUIRE(ss.str().find("dns localhost") == std::string::npos);
+  }
+  {
+    std::ofstream out{path, std::ios::app};
+    out << "dns mkcurl.invalid:" << port << " 127.0.0.1 " << INT64_MAX
+        << "\n";
+  }
+  auto store = std::make_shared<mk::curl::SessionStore>();
+  REQUIRE(store->load(path));
+  REQUIRE(remove(path.c_str()) == 0);
+  mk::curl::Client client;
+  client.set_session_store(store);
+  mk::curl::Request req;
+  req.url = "http://mkcurl.invalid:" + port + "/";
+  auto res = client.perform(req);
+  REQUIRE(res.error == 0);
+  REQUIRE(res.body == "hello");
+}
+
+TEST_CASE("Client::set_resolve remembers the address that worked") {
+  LoopbackServer server{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\n"
+           "Connection: close\r\n"  // Force reconnecting
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  auto port = server.url("").substr(strlen("http://127.0.0.1:"));
+  mk::curl::ResolveEntry entry;
+  entry.host = "mkcurl.invalid";
+  entry.port = std::stoll(port);
+  entry.addresses = {"127.0.0.2", "127.0.0.1"};  // Only the latter works
+  mk::curl::Client client;
+  client.set_resolve({entry});
+  mk::curl::Request req;
+  req.url = "http://mkcurl.invalid:" + port + "/";
+  auto tried = [](const mk::curl::Response &res, const std::string &addr) {
+    for (auto &log : res.logs) {
+      if (log.line.find("Trying " + addr) != std::string::npos) return true;
+    }
+    return false;
+  };
+  auto res = client.perform(req);
+  REQUIRE(res.error == 0);
+  REQUIRE(res.body == "hello");
+  REQUIRE(tried(res, "127.0.0.2"));
+  res = client.perform(req);
+  REQUIRE(res.error == 0);
+  REQUIRE(res.body == "hello");
+  REQUIRE(!tried(res, "127.0.0.2"));
+}
+
+TEST_CASE("Response reports the address family we connected with") {
+  auto handler = [](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\n"
+           "Connection: close\r\n"  // Force reconnecting
+           "Content-Length: 5\r\n\r\nhello";
+  };
+  auto request = [](const std::string &url) {
+    mk::curl::Request req;
+    req.url = url;
+    req.retries = 0;
+    mk::curl::ResolveEntry entry;
+    entry.host = "mkcurl.invalid";
+    entry.port = std::stoll(url.substr(strlen("http://mkcurl.invalid:")));
+    entry.addresses = {"::1", "127.0.0.1"};
+    req.resolve.push_back(entry);
+    return req;
+  };
+
+  SECTION("when both families work we use the first one") {
+    LoopbackServer server{handler, true};
+    auto port = server.url("").substr(strlen("http://127.0.0.1:"));
+    auto req = request("http://mkcurl.invalid:" + port + "/");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.ip_family == "ipv6");
+    REQUIRE(res.primary_ip == "::1");
+    REQUIRE(res.primary_port == std::stoll(port));
+    REQUIRE(res.local_ip == "::1");
+    REQUIRE(res.local_port > 0);
+    REQUIRE(res.ipv6_connects == 1);
+    REQUIRE(res.ipv4_connects == 0);
+    REQUIRE(!res.family_fallback);
+  }
+
+  SECTION("we honour the IP version restriction") {
+    LoopbackServer server{handler, true};
+    auto port = server.url("").substr(strlen("http://127.0.0.1:"));
+    auto req = request("http://mkcurl.invalid:" + port + "/");
+    req.ip_version = mk::curl::IPVersion::v4;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.ip_family == "ipv4");
+    REQUIRE(res.primary_ip == "127.0.0.1");
+    REQUIRE(res.ipv6_connects == 0);
+  }
+
+  SECTION("we fall back to the other family when the first one fails") {
+    LoopbackServer server{handler};  // Only IPv4
+    auto port = server.url("").substr(strlen("http://127.0.0.1:"));
+    auto req = request("http://mkcurl.invalid:" + port + "/");
+    req.happy_eyeballs_timeout_ms = 50;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.ip_family == "ipv4");
+    REQUIRE(res.ipv6_connects == 1);
+    REQUIRE(res.ipv4_connects == 1);
+    REQUIRE(res.family_fallback);
+  }
+}
+
+#ifdef __linux__
+TEST_CASE("Response contains the TCP_INFO of the connection") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    std::string reply = "HTTP/1.1 200 Ok\r\n";
+    if (head.find("GET /close") == 0) reply += "Connection: close\r\n";
+    return reply + "Content-Length: 65536\r\n\r\n" + std::string(65536, 'x');
+  }};
+  mk::curl::Client client;
+  mk::curl::Request req;
+  req.enable_tcp_info = true;
+  req.so_rcvbuf = 1 << 18;
+  req.tcp_notsent_lowat = 1 << 14;
+  auto check = [](const mk::curl::Response &res) {
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body.size() == 65536);
+    REQUIRE(res.tcp_info_connect.valid);
+    REQUIRE(res.tcp_info_connect.rtt_us > 0);
+    REQUIRE(res.tcp_info_connect.snd_cwnd > 0);
+    REQUIRE(res.tcp_info_end.valid);
+    REQUIRE(res.tcp_info_end.bytes_acked > res.tcp_info_connect.bytes_acked);
+  };
+
+  SECTION("when the connection is kept alive") {
+    req.url = server.url("/");
+    auto res = client.perform(req);
+    check(res);
+    res = client.perform(req);  // Reusing the connection
+    check(res);
+    REQUIRE(res.ipv4_connects == 0);
+  }
+
+  SECTION("when the server closes the connection") {
+    req.url = server.url("/close");
+    auto res = client.perform(req);
+    check(res);
+  }
+
+  SECTION("when TCP_INFO is not enabled") {
+    req.enable_tcp_info = false;
+    req.url = server.url("/");
+    auto res = client.perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(!res.tcp_info_connect.valid);
+    REQUIRE(!res.tcp_info_end.valid);
+  }
+}
+#endif  // __linux__
+
+TEST_CASE("Response contains the progress samples") {
+  const size_t size = 1 << 24;
+  LoopbackServer server{[&](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Length: " + std::to_string(size) +
+           "\r\n\r\n" + std::string(size, 'x');
+  }};
+  mk::curl::Request req;
+  req.url = server.url("/");
+
+  SECTION("when sampling is enabled") {
+    std::vector<mk::curl::ProgressSample> seen;
+    req.progress_interval_ms = 1;
+    req.on_progress = [&](const mk::curl::ProgressSample &sample) {
+      seen.push_back(sample);
+    };
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body.size() == size);
+    REQUIRE(res.progress.size() >= 2);
+    REQUIRE(seen.size() == res.progress.size());
+    for (size_t i = 1; i < res.progress.size(); ++i) {
+      REQUIRE(res.progress[i].elapsed_us > res.progress[i - 1].elapsed_us);
+      REQUIRE(res.progress[i].bytes_down >= res.progress[i - 1].bytes_down);
+    }
+    REQUIRE(res.progress.back().bytes_down == (int64_t)size);
+    REQUIRE(res.progress.back().bytes_up == 0);
+  }
+
+  SECTION("when sampling is not enabled") {
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.progress.empty());
+  }
+}
+
+TEST_CASE("CancellationToken stops a request from another thread") {
+  std::atomic<bool> done{false};  // Must outlive the server
+  LoopbackServer server{[&](const std::string &) -> std::string {
+    while (!done) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 0\r\n\r\n";
+  }};
+  mk::curl::Request req;
+  req.url = server.url("/");
+  req.timeout = 30;
+  req.cancellation = std::make_shared<mk::curl::CancellationToken>();
+  auto token = req.cancellation;
+  std::thread canceller{[token]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    token->cancel();
+  }};
+  auto begin = std::chrono::steady_clock::now();
+  auto res = mk::curl::perform(req);
+  auto elapsed = std::chrono::steady_clock::now() - begin;
+  canceller.join();
+  done = true;
+  REQUIRE(res.error == mk::curl::error_cancelled);
+  REQUIRE(elapsed < std::chrono::seconds(3));
+}
+
+TEST_CASE("We enforce the maximum body and header sizes") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    std::string body(4096, 'x');
+    if (head.find("GET /chunked") == 0) {
+      // Without Content-Length we can only notice while reading.
+      return "HTTP/1.1 200 Ok\r\nTransfer-Encoding: chunked\r\n\r\n"
+             "1000\r\n" + body + "\r\n0\r\n\r\n";
+    }
+    return "HTTP/1.1 200 Ok\r\nX-Padding: " + std::string(512, 'y') +
+           "\r\nContent-Length: 4096\r\n\r\n" + body;
+  }};
+  mk::curl::Request req;
+  req.url = server.url("/");
+
+  SECTION("we reject a large Content-Length before reading the body") {
+    req.max_body_size = 1024;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_FILESIZE_EXCEEDED);
+    REQUIRE(res.body.empty());
+  }
+
+  SECTION("we stop reading a large chunked body") {
+    req.url = server.url("/chunked");
+    req.max_body_size = 1024;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_FILESIZE_EXCEEDED);
+    REQUIRE(res.body_truncated);
+    REQUIRE(res.body.empty());
+  }
+
+  SECTION("we can keep the truncated body") {
+    req.max_body_size = 1024;
+    req.keep_truncated_body = true;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.status_code == 200);
+    REQUIRE(res.body_truncated);
+    REQUIRE(res.body == std::string(1024, 'x'));
+  }
+
+  SECTION("we accept a body as large as the maximum") {
+    req.max_body_size = 4096;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(!res.body_truncated);
+    REQUIRE(res.body.size() == 4096);
+  }
+
+  SECTION("we reject large headers") {
+    req.max_header_bytes = 256;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == mk::curl::error_headers_too_large);
+    REQUIRE(res.response_headers.size() <= 256);
+  }
+}
+
+TEST_CASE("Response indexes the headers of each redirect hop") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    if (head.find("GET /redirect") == 0) {
+      return "HTTP/1.1 302 Found\r\nLocation: /final\r\n"
+             "Set-Cookie: a=1\r\nContent-Length: 0\r\n\r\n";
+    }
+    return "HTTP/1.1 200 Ok\r\nSet-Cookie: b=2\r\nset-cookie: c=3\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  mk::curl::Client client;
+  mk::curl::Request req;
+  req.url = server.url("/redirect");
+  req.follow_redir = true;
+  auto res = client.perform(req);
+  REQUIRE(res.error == 0);
+  REQUIRE(res.header_hops.size() == 2);
+  REQUIRE(mk::curl::header_value(res, "location", 0) == "/final");
+  REQUIRE(mk::curl::header_value(res, "content-length") == "5");
+  REQUIRE(mk::curl::header_values(res, "set-cookie") ==
+          std::vector<std::string>{"b=2", "c=3"});
+}
+
+TEST_CASE("We can send requests over a Unix domain socket") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    auto host = head.find("Host: sidecar\r\n") != std::string::npos;
+    return std::string{"HTTP/1.1 200 Ok\r\nContent-Length: 2\r\n\r\n"} +
+           (host ? "ok" : "ko");
+  }};
+  mk::curl::Client client;
+  mk::curl::Request req;
+  req.url = "http://sidecar/report";
+
+  SECTION("when using a path") {
+    req.unix_socket_path = "mkcurl-integration-tests.sock";
+    server.listen_unix(req.unix_socket_path, false);
+    for (int i = 0; i < 3; ++i) {
+      auto res = client.perform(req);
+      REQUIRE(res.error == 0);
+      REQUIRE(res.status_code == 200);
+      REQUIRE(res.body == "ok");
+      REQUIRE(res.ip_family == "unix");
+      REQUIRE(res.ipv4_connects == 0);
+      REQUIRE(res.ipv6_connects == 0);
+    }
+    REQUIRE(server.connections() == 1);  // We reused the connection
+    (void)unlink(req.unix_socket_path.c_str());
+  }
+
+#ifdef __linux__
+  SECTION("when using the abstract namespace") {
+    req.unix_socket_path = "mkcurl-integration-tests";
+    req.abstract_unix_socket = true;
+    server.listen_unix(req.unix_socket_path, true);
+    auto res = client.perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body == "ok");
+  }
+#endif
+
+  SECTION("when nobody is listening") {
+    req.unix_socket_path = "mkcurl-integration-tests-nonexistent.sock";
+    req.retries = 0;
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURLE_COULDNT_CONNECT);
+  }
+}
+
+TEST_CASE("Response tells whether we reused the connection") {
+  LoopbackServer server{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 2\r\n\r\nok";
+  }};
+  mk::curl::Client client;
+  mk::curl::Request req;
+  req.url = server.url("/");
+  auto first = client.perform(req);
+  REQUIRE(first.error == 0);
+  REQUIRE(!first.connection_reused);
+  REQUIRE(first.connection_id > 0);
+
+  SECTION("by default") {
+    auto second = client.perform(req);
+    REQUIRE(second.error == 0);
+    REQUIRE(second.connection_reused);
+    REQUIRE(second.connection_id == first.connection_id);
+    REQUIRE(server.connections() == 1);
+  }
+
+  SECTION("when the connection was idle for too long") {
+    mk::curl::ConnectionPoolSettings settings;
+    settings.max_idle_seconds = 1;
+    client.set_connection_pool(settings);
+    // cURL truncates the idle time to seconds before comparing.
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    auto second = client.perform(req);
+    REQUIRE(second.error == 0);
+    REQUIRE(!second.connection_reused);
+    REQUIRE(second.connection_id > first.connection_id);
+    REQUIRE(server.connections() == 2);
+  }
+}
+
+TEST_CASE("Reusing a Response avoids allocations in the steady state") {
+  LoopbackServer server{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Type: text/plain\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  mk::curl::Client client;
+  mk::curl::Request req;
+  req.url = server.url("/");
+  req.headers.push_back("Accept: text/plain");
+  mk::curl::Response res;
+  client.perform(req, res);  // warm up, including the connection pool
+  client.perform(req, res);
+  auto before = allocations;
+  auto fresh_res = client.perform(req);
+  auto fresh = allocations - before;
+  before = allocations;
+  client.perform(req, res);
+  auto reused = allocations - before;
+  INFO("fresh: " << fresh << "; reused: " << reused);
+  REQUIRE(fresh_res.error == 0);
+  REQUIRE(res.error == 0);
+  REQUIRE(res.connection_reused);
+  REQUIRE(res.body == "hello");
+  REQUIRE(res.content_type == "text/plain");
+#ifndef MKCURL_NO_LOGS
+  REQUIRE(res.logs.size() > 0);
+#endif
+  REQUIRE(fresh > 0);
+  REQUIRE(reused == 0);
+}
+
+TEST_CASE("We can record and replay requests") {
+  std::string path = "mkcurl-integration-tests-recording.txt";
+  std::vector<mk::curl::Response> recorded;
+  mk::curl::Request redirect;
+  mk::curl::Request post;
+  {
+    LoopbackServer server{[](const std::string &head) -> std::string {
+      if (head.find("GET /redirect") == 0) {
+        return "HTTP/1.1 302 Found\r\nLocation: /final\r\n"
+               "Content-Length: 0\r\n\r\n";
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      return "HTTP/1.1 200 Ok\r\nContent-Type: text/plain\r\n"
+             "Transfer-Encoding: chunked\r\n\r\n"
+             "5\r\nhello\r\n0\r\n\r\n";
+    }};
+    redirect.url = server.url("/redirect");
+    redirect.follow_redir = true;
+    post.url = server.url("/post");
+    post.method = "POST";
+    post.body = "{\"key\":\"value\"}";
+    auto recording = std::make_shared<mk::curl::Recording>();
+    mk::curl::Client client;
+    client.set_recording(recording);
+    recorded.push_back(client.perform(redirect));
+    recorded.push_back(client.perform(post));
+    REQUIRE(recording->size() == 2);
+    REQUIRE(recording->save(path));
+  }  // The server is gone
+
+  auto recording = std::make_shared<mk::curl::Recording>();
+  REQUIRE(recording->load(path));
+  auto replay = [&](mk::curl::RecordingMode mode) {
+    mk::curl::Client client;
+    client.set_recording(recording, mode);
+    recording->rewind();
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<mk::curl::Response> replayed;
+    replayed.push_back(client.perform(redirect));
+    replayed.push_back(client.perform(post));
+    REQUIRE(client.perform(post).error ==
+            mk::curl::error_replay_exhausted);
+    for (size_t i = 0; i < replayed.size(); ++i) {
+      auto &res = replayed[i];
+      REQUIRE(res.error == 0);
+      REQUIRE(res.status_code == recorded[i].status_code);
+      REQUIRE(res.body == recorded[i].body);
+      REQUIRE(res.response_headers == recorded[i].response_headers);
+      REQUIRE(res.request_headers == recorded[i].request_headers);
+      REQUIRE(res.bytes_recv == recorded[i].bytes_recv);
+      for (auto &log : res.logs) {
+        REQUIRE(log.line != "The request differs from the recorded one");
+      }
+    }
+    REQUIRE(replayed[0].body == "hello");
+    REQUIRE(replayed[0].redirect_url == "");
+    return std::chrono::steady_clock::now() - begin;
+  };
+
+  SECTION("as fast as possible") {
+    REQUIRE(replay(mk::curl::RecordingMode::replay) <
+            std::chrono::milliseconds(200));
+  }
+
+  SECTION("using the recorded timing") {
+    REQUIRE(replay(mk::curl::RecordingMode::replay_timed) >=
+            std::chrono::milliseconds(400));
+  }
+  (void)remove(path.c_str());
+}
+
+TEST_CASE("Engine does not let a slow host take all the slots") {
+  LoopbackServer slow{[](const std::string &) -> std::string {
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 4\r\n\r\nslow";
+  }};
+  LoopbackServer fast{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 4\r\n\r\nfast";
+  }};
+  mk::curl::EngineSettings settings;
+  settings.max_host_connections = 2;
+  settings.max_total_connections = 4;
+  std::mutex mutex;
+  std::vector<std::string> bodies;
+  std::chrono::steady_clock::duration fast_done{};
+  auto begin = std::chrono::steady_clock::now();
+  {
+    mk::curl::Engine engine{settings};
+    auto submit = [&](const std::string &url) {
+      mk::curl::Request req;
+      req.url = url;
+      engine.submit(req, [&](mk::curl::Response &&res) {
+        REQUIRE(res.error == 0);
+        std::unique_lock<std::mutex> _{mutex};
+        bodies.push_back(res.body);
+        if (res.body == "fast") {
+          fast_done = std::chrono::steady_clock::now() - begin;
+        }
+      });
+    };
+    for (size_t i = 0; i < 8; ++i) submit(slow.url("/"));
+    for (size_t i = 0; i < 8; ++i) submit(fast.url("/"));
+  }
+  auto elapsed = std::chrono::steady_clock::now() - begin;
+  REQUIRE(bodies.size() == 16);
+  // The slow host can only use two slots at a time, hence its requests
+  // take about 4 * 300 ms, while the fast requests complete immediately.
+  REQUIRE(elapsed >= std::chrono::milliseconds(1200));
+  REQUIRE(fast_done < std::chrono::milliseconds(600));
+  REQUIRE(std::count(bodies.begin(), bodies.begin() + 8, "fast") == 8);
+}
+
+TEST_CASE("Engine serves the priority classes according to their weight") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    if (head.find("GET /first") == 0) {
+      // Give the test time to queue all the other requests.
+      std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 0\r\n\r\n";
+  }};
+  mk::curl::EngineSettings settings;
+  settings.max_total_connections = 1;
+  std::vector<mk::curl::Priority> order;
+  std::vector<int64_t> waits;
+  {
+    mk::curl::Engine engine{settings};
+    auto submit = [&](const std::string &path, mk::curl::Priority prio) {
+      mk::curl::Request req;
+      req.url = server.url(path);
+      req.priority = prio;
+      engine.submit(req, [&, prio](mk::curl::Response &&res) {
+        REQUIRE(res.error == 0);
+        order.push_back(prio);  // Only called from the Engine thread
+        waits.push_back(res.queue_wait_us);
+      });
+    };
+    submit("/first", mk::curl::Priority::background);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (size_t i = 0; i < 4; ++i) {
+      submit("/", mk::curl::Priority::background);
+    }
+    for (size_t i = 0; i < 4; ++i) {
+      submit("/", mk::curl::Priority::interactive);
+    }
+  }
+  REQUIRE(order.size() == 9);
+  REQUIRE(order[0] == mk::curl::Priority::background);
+  for (size_t i = 1; i < 5; ++i) {
+    REQUIRE(order[i] == mk::curl::Priority::interactive);
+  }
+  for (size_t i = 5; i < 9; ++i) {
+    REQUIRE(order[i] == mk::curl::Priority::background);
+  }
+  // All the requests but the first one waited for the first one.
+  for (size_t i = 1; i < 9; ++i) {
+    REQUIRE(waits[i] >= 200000);
+  }
+}
+
+TEST_CASE("Hedger cuts the tail latency") {
+  std::atomic<bool> done{false};  // Must outlive the servers
+  std::atomic<int64_t> count{0};
+  // The slow server only answers after a long delay the first request
+  // of each pair, which is what a slow replica looks like.
+  LoopbackServer slow{[&](const std::string &) -> std::string {
+    if (count++ % 2 == 0) {
+      for (size_t i = 0; i < 500 && !done; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 4\r\n\r\nslow";
+  }};
+  LoopbackServer fast{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 4\r\n\r\nfast";
+  }};
+  mk::curl::Client client;
+
+  SECTION("when the first attempt is slow") {
+    mk::curl::HedgeSettings settings;
+    settings.delay_ms = 50;
+    mk::curl::Hedger hedger{settings};
+    mk::curl::Request req;
+    req.url = slow.url("/");
+    auto begin = std::chrono::steady_clock::now();
+    auto res = hedger.perform(client, req);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body == "slow");
+    REQUIRE(res.hedged);
+    REQUIRE(res.hedge_winner == 1);
+    REQUIRE(elapsed < std::chrono::seconds(2));
+  }
+
+  SECTION("when using an alternate replica") {
+    mk::curl::HedgeSettings settings;
+    settings.delay_ms = 50;
+    auto port = fast.url("").substr(strlen("http://127.0.0.1:"));
+    settings.alternate_connect_to = "::127.0.0.1:" + port;
+    mk::curl::Hedger hedger{settings};
+    mk::curl::Request req;
+    req.url = slow.url("/");
+    auto res = hedger.perform(client, req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body == "fast");
+    REQUIRE(res.hedged);
+    REQUIRE(res.hedge_winner == 1);
+  }
+
+  SECTION("when the server is fast") {
+    mk::curl::HedgeSettings settings;
+    settings.delay_ms = 1000;
+    settings.percentile = 90;
+    settings.min_samples = 4;
+    mk::curl::Hedger hedger{settings};
+    mk::curl::Request req;
+    req.url = fast.url("/");
+    for (size_t i = 0; i < 8; ++i) {
+      auto res = hedger.perform(client, req);
+      REQUIRE(res.error == 0);
+      REQUIRE(res.body == "fast");
+      REQUIRE(!res.hedged);
+      REQUIRE(res.hedge_winner == 0);
+      REQUIRE(res.connection_reused == (i > 0));
+    }
+    REQUIRE(fast.connections() == 1);
+    // The delay now tracks the latency of the fast server.
+    REQUIRE(hedger.delay_ms() < 1000);
+  }
+
+  SECTION("when the circuit is open") {
+    mk::curl::CircuitBreakerSettings breaker_settings;
+    breaker_settings.failure_threshold = 1;
+    auto breaker =
+        std::make_shared<mk::curl::CircuitBreaker>(breaker_settings);
+    client.set_circuit_breaker(breaker);
+    mk::curl::Hedger hedger;
+    mk::curl::Request req;
+    req.url = fast.url("/");
+    auto port = fast.url("").substr(strlen("http://127.0.0.1:"));
+    req.connect_to = "::127.0.0.2:" + port;  // Nobody is listening there
+    auto res = hedger.perform(client, req);
+    REQUIRE(res.error == CURLE_COULDNT_CONNECT);
+    REQUIRE(res.hedged);
+    req.connect_to = "";
+    res = hedger.perform(client, req);
+    REQUIRE(res.error == mk::curl::error_circuit_open);
+    REQUIRE(breaker->stats().fast_failed == 1);
+  }
+
+  done = true;
+}
+TEST_CASE("CircuitBreaker fast fails requests towards a dead host") {
+  LoopbackServer server{[](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\n"
+           "Connection: close\r\n"
+           "Content-Length: 5\r\n\r\nhello";
+  }};
+  auto url = server.url("/");
+  auto port = server.url("").substr(strlen("http://127.0.0.1:"));
+  mk::curl::CircuitBreakerSettings settings;
+  settings.failure_threshold = 2;
+  settings.cooldown_ms = 200;
+  auto breaker = std::make_shared<mk::curl::CircuitBreaker>(settings);
+  mk::curl::Client client;
+  client.set_circuit_breaker(breaker);
+  mk::curl::Request dead;
+  dead.url = url;
+  dead.connect_to = "::127.0.0.2:" + port;  // Nobody is listening there
+  dead.retries = 0;
+  REQUIRE(client.perform(dead).error == CURLE_COULDNT_CONNECT);
+  REQUIRE(client.perform(dead).error == CURLE_COULDNT_CONNECT);
+  mk::curl::Request alive;
+  alive.url = url;
+  REQUIRE(client.perform(alive).error == mk::curl::error_circuit_open);
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  // The probe fails, hence the circuit opens again.
+  REQUIRE(client.perform(dead).error == CURLE_COULDNT_CONNECT);
+  REQUIRE(client.perform(alive).error == mk::curl::error_circuit_open);
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  // The probe succeeds, hence the circuit closes.
+  auto res = client.perform(alive);
+  REQUIRE(res.error == 0);
+  REQUIRE(res.body == "hello");
+  REQUIRE(breaker->state("127.0.0.1", std::stoll(port)) ==
+          mk::curl::CircuitState::closed);
+  auto stats = breaker->stats();
+  REQUIRE(stats.opened == 2);
+  REQUIRE(stats.half_opened == 2);
+  REQUIRE(stats.closed == 1);
+  REQUIRE(stats.fast_failed == 2);
+}
+
+TEST_CASE("RateLimiter limits the bandwidth and the request rate") {
+  std::string body(200000, 'x');
+  LoopbackServer server{[&](const std::string &) -> std::string {
+    return "HTTP/1.1 200 Ok\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\n\r\n" + body;
+  }};
+  mk::curl::RateLimiterSettings settings;
+
+  SECTION("for a Client") {
+    settings.total.download_bytes_per_second = 400000;
+    mk::curl::Client client;
+    client.set_rate_limiter(std::make_shared<mk::curl::RateLimiter>(settings));
+    mk::curl::Request req;
+    req.url = server.url("/");
+    auto begin = std::chrono::steady_clock::now();
+    auto res = client.perform(req);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body == body);
+    // The first 40000 bytes are the burst, the rest takes 400 ms.
+    REQUIRE(elapsed >= std::chrono::milliseconds(350));
+    REQUIRE(res.throttled_us >= 300000);
+  }
+
+  SECTION("for an Engine") {
+    settings.background.download_bytes_per_second = 400000;
+    settings.total.requests_per_second = 5;
+    mk::curl::EngineSettings engine_settings;
+    engine_settings.rate_limiter =
+        std::make_shared<mk::curl::RateLimiter>(settings);
+    std::mutex mutex;
+    std::vector<mk::curl::Response> responses;
+    auto begin = std::chrono::steady_clock::now();
+    {
+      mk::curl::Engine engine{engine_settings};
+      for (size_t i = 0; i < 3; ++i) {
+        mk::curl::Request req;
+        req.url = server.url("/");
+        req.priority = (i == 0) ? mk::curl::Priority::background
+                                : mk::curl::Priority::interactive;
+        engine.submit(req, [&](mk::curl::Response &&res) {
+          std::unique_lock<std::mutex> _{mutex};
+          responses.push_back(std::move(res));
+        });
+      }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    REQUIRE(responses.size() == 3);
+    int64_t throttled_us = 0;
+    for (auto &res : responses) {
+      REQUIRE(res.error == 0);
+      REQUIRE(res.body == body);
+      throttled_us = std::max(throttled_us, res.throttled_us);
+    }
+    // The background request is limited to 400 KB/s and the requests
+    // start at 200 ms intervals.
+    REQUIRE(elapsed >= std::chrono::milliseconds(350));
+    REQUIRE(throttled_us >= 300000);
+  }
+}
+
+TEST_CASE("Metrics aggregates the requests of Clients and Engines") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    if (head.find("GET /missing") == 0) {
+      return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    }
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 5\r\n\r\nhello";
+  }};
+  auto metrics = std::make_shared<mk::curl::Metrics>();
+  {
+    mk::curl::Client client;
+    client.set_metrics(metrics);
+    mk::curl::Request req;
+    req.url = server.url("/");
+    for (size_t i = 0; i < 3; ++i) REQUIRE(client.perform(req).error == 0);
+    req.url = server.url("/missing");
+    REQUIRE(client.perform(req).status_code == 404);
+  }
+  {
+    mk::curl::EngineSettings settings;
+    settings.metrics = metrics;
+    mk::curl::Engine engine{settings};
+    mk::curl::Request req;
+    req.url = server.url("/");
+    engine.submit(req, [](mk::curl::Response &&res) {
+      REQUIRE(res.error == 0);
+    });
+  }
+  auto snap = metrics->snapshot();
+  REQUIRE(snap.requests == 5);
+  REQUIRE(snap.retries == 0);
+  REQUIRE(snap.status_codes[200] == 4);
+  REQUIRE(snap.status_codes[404] == 1);
+  REQUIRE(snap.errors.empty());
+  REQUIRE(snap.connections_opened == 2);
+  REQUIRE(snap.connections_reused == 3);
+  REQUIRE(snap.bytes_recv > 0);
+  REQUIRE(snap.total.count == 5);
+  REQUIRE(snap.connect.count == 2);
+  REQUIRE(snap.tls.count == 0);
+  auto json = mk::curl::metrics_json(snap);
+  REQUIRE(json.find("\"requests\":5,") != std::string::npos);
+  auto prometheus = mk::curl::metrics_prometheus(snap);
+  REQUIRE(prometheus.find("mkcurl_total_seconds_count 5\n") !=
+          std::string::npos);
+}
+
+TEST_CASE("Tracer records the phases of the requests") {
+  LoopbackServer server{[](const std::string &head) -> std::string {
+    if (head.find("GET /redirect") == 0) {
+      return "HTTP/1.1 302 Found\r\nLocation: /final\r\n"
+             "Content-Length: 0\r\n\r\n";
+    }
+    return "HTTP/1.1 200 Ok\r\nContent-Length: 5\r\n\r\nhello";
+  }};
+  auto count = [](const std::string &json, const std::string &name) {
+    size_t n = 0;
+    for (auto pos = json.find("\"name\":\"" + name + "\"");
+         pos != std::string::npos;
+         pos = json.find("\"name\":\"" + name + "\"", pos + 1)) {
+      ++n;
+    }
+    return n;
+  };
+  auto tracer = std::make_shared<mk::curl::Tracer>();
+  mk::curl::Client client;
+  client.set_tracer(tracer);
+
+  SECTION("with redirects") {
+    mk::curl::Request req;
+    req.url = server.url("/redirect");
+    req.follow_redir = true;
+    auto res = client.perform(req);
+    REQUIRE(res.error == 0);
+    REQUIRE(res.body == "hello");
+    auto json = tracer->json();
+    REQUIRE(json.find("{\"traceEvents\":[") == 0);
+    REQUIRE(count(json, "GET " + req.url) == 1);
+    REQUIRE(count(json, "attempt") == 1);
+    REQUIRE(count(json, "hop") == 2);
+    // The second hop reuses the connection.
+    REQUIRE(count(json, "connect") == 1);
+    REQUIRE(count(json, "request") == 2);
+    REQUIRE(count(json, "response") == 2);
+    REQUIRE(json.find("\"reused\":true") != std::string::npos);
+    REQUIRE(json.find(server.url("/final")) != std::string::npos);
+  }
+
+  SECTION("with retries") {
+    mk::curl::Request req;
+    req.url = server.url("/");
+    req.connect_to = "::127.0.0.2:";  // Nobody is listening there
+    req.retries = 1;
+    REQUIRE(client.perform(req).error == CURLE_COULDNT_CONNECT);
+    auto json = tracer->json();
+    REQUIRE(count(json, "attempt") == 2);
+    REQUIRE(count(json, "connect") == 2);
+    REQUIRE(count(json, "hop") == 0);
+  }
+}
+
+#endif  // _WIN32
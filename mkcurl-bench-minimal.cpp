@@ -0,0 +1,6 @@
+// mkcurl-bench-minimal is mkcurl-bench built with MKCURL_MINIMAL. Since
+// MKCURL_MINIMAL changes the layout of Response, we cannot link with the
+// mkcurl library, so we compile the implementation in here.
+#define MKCURL_MINIMAL
+#define MKCURL_INLINE_IMPL
+#include "mkcurl-bench.cpp"
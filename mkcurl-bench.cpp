@@ -0,0 +1,338 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mkcurl.hpp"
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+// LCOV_EXCL_START
+static void usage() {
+  // clang-format off
+  std::clog << "\n";
+  std::clog << "Usage: mkcurl-bench [options] <benchmark> <url>\n";
+  std::clog << "\n";
+  std::clog << "Available benchmarks:\n";
+  std::clog << "\n";
+  std::clog << "  trust-store : compares the latency of the first request of\n";
+  std::clog << "                fresh Clients using Request::ca_path and using\n";
+  std::clog << "                a shared TrustStore (needs --ca-bundle-path)\n";
+  std::clog << "                and is faster when built with MKCURL_OPENSSL\n";
+  std::clog << "\n";
+  std::clog << "  session-store : measures the latency of the first request\n";
+  std::clog << "                  of this process, loading and then saving\n";
+  std::clog << "                  a SessionStore (needs --session-file). Run\n";
+  std::clog << "                  it twice to see the effect of the store\n";
+  std::clog << "\n";
+  std::clog << "  certs : compares the wall clock and CPU time of the first\n";
+  std::clog << "          request of fresh Clients without capturing the\n";
+  std::clog << "          certificates and with each Request::cert_capture\n";
+  std::clog << "\n";
+  std::clog << "  unix-socket : compares the latency of first requests and\n";
+  std::clog << "                of reused connections, as well as the\n";
+  std::clog << "                throughput, of TCP and of a Unix domain\n";
+  std::clog << "                socket (needs --unix-socket). The server\n";
+  std::clog << "                at <url> must also listen on the socket\n";
+  std::clog << "\n";
+  std::clog << "  features : prints sizeof(Response) and measures the\n";
+  std::clog << "             latency and the CPU time of requests reusing\n";
+  std::clog << "             the connection, optionally over --unix-socket\n";
+  std::clog << "             to reduce the noise. Compare mkcurl-bench with\n";
+  std::clog << "             mkcurl-bench-minimal, built with MKCURL_MINIMAL\n";
+  std::clog << "\n";
+  std::clog << "  replay : measures the latency of replaying the request to\n";
+  std::clog << "           <url> saved in a Recording (needs --recording),\n";
+  std::clog << "           which we record first if the file is missing,\n";
+  std::clog << "           such that it runs offline and repeatably\n";
+  std::clog << "\n";
+  std::clog << "Options can start with either a single dash (i.e. -option) or\n";
+  std::clog << "a double dash (i.e. --option). Available options:\n";
+  std::clog << "\n";
+  std::clog << "  --ca-bundle-path <path> : path to OpenSSL CA bundle\n";
+  std::clog << "  --count <n>             : number of iterations (default: 10)\n";
+  std::clog << "  --recording <path>      : path of the Recording file\n";
+  std::clog << "  --session-file <path>   : path of the SessionStore file\n";
+  std::clog << "  --unix-socket <path>    : path of the Unix domain socket\n";
+  std::clog << std::endl;
+  // clang-format on
+}
+// LCOV_EXCL_STOP
+
+// Settings contains the benchmark settings.
+struct Settings {
+  std::string ca_path;
+  size_t count = 10;
+  std::string recording;
+  std::string session_file;
+  std::string unix_socket;
+  std::string url;
+};
+
+// measure runs @p func for @p count times and prints the median and the
+// mean of its running time, as well as the mean CPU time of this process,
+// in milliseconds using @p label. @p func returns false on failure, in
+// which case we exit.
+static void measure(const std::string &label, size_t count,
+                    std::function<bool()> func) {
+  std::vector<double> samples;
+  std::clock_t cpu_begin = std::clock();
+  for (size_t i = 0; i < count; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    if (!func()) {
+      // LCOV_EXCL_START
+      std::clog << "FATAL: " << label << ": the request failed" << std::endl;
+      exit(EXIT_FAILURE);
+      // LCOV_EXCL_STOP
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    samples.push_back(elapsed.count());
+  }
+  double cpu = (double)(std::clock() - cpu_begin) * 1000.0 / CLOCKS_PER_SEC;
+  std::sort(samples.begin(), samples.end());
+  double sum = 0.0;
+  for (auto s : samples) sum += s;
+  std::cout << label << ": median " << samples[samples.size() / 2]
+            << " ms; mean " << sum / (double)samples.size() << " ms; cpu "
+            << cpu / (double)samples.size() << " ms" << std::endl;
+}
+
+static void bench_trust_store(const Settings &settings) {
+  if (settings.ca_path.empty()) {
+    // LCOV_EXCL_START
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  mk::curl::Request req;
+  req.url = settings.url;
+  measure("ca_path", settings.count, [&]() {
+    mk::curl::Request r{req};
+    r.ca_path = settings.ca_path;
+    return mk::curl::Client{}.perform(r).error == 0;
+  });
+  auto store = mk::curl::TrustStore::from_file(settings.ca_path);
+  if (store == nullptr) {
+    // LCOV_EXCL_START
+    std::clog << "FATAL: cannot load: " << settings.ca_path << std::endl;
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  measure("trust_store", settings.count, [&]() {
+    mk::curl::Client client;
+    client.set_trust_store(store);
+    return client.perform(req).error == 0;
+  });
+}
+
+static void bench_session_store(const Settings &settings) {
+  if (settings.session_file.empty()) {
+    // LCOV_EXCL_START
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  auto store = std::make_shared<mk::curl::SessionStore>();
+  if (!store->load(settings.session_file)) {
+    std::clog << "warning: cannot load: " << settings.session_file << std::endl;
+  }
+  mk::curl::Request req;
+  req.ca_path = settings.ca_path;
+  req.url = settings.url;
+  {
+    mk::curl::Client client;
+    client.set_session_store(store);
+    measure("first_request", 1, [&]() {
+      return client.perform(req).error == 0;
+    });
+  }  // The Client gives its TLS sessions to the store when destroyed
+  if (!store->save(settings.session_file)) {
+    // LCOV_EXCL_START
+    std::clog << "FATAL: cannot save: " << settings.session_file << std::endl;
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+}
+
+static void bench_certs(const Settings &settings) {
+  auto store = mk::curl::TrustStore::from_file(settings.ca_path);
+  mk::curl::Request req;
+  req.url = settings.url;
+  if (store == nullptr) req.ca_path = settings.ca_path;
+  struct {
+    const char *label;
+    mk::curl::CertCapture capture;
+  } cases[] = {{"none", mk::curl::CertCapture::none},
+               {"fingerprints", mk::curl::CertCapture::fingerprints},
+               {"chain", mk::curl::CertCapture::chain},
+               {"pem", mk::curl::CertCapture::pem}};
+  for (auto &c : cases) {
+    req.cert_capture = c.capture;
+    measure(c.label, settings.count, [&]() {
+      mk::curl::Client client;
+      if (store != nullptr) client.set_trust_store(store);
+      return client.perform(req).error == 0;
+    });
+  }
+}
+
+static void bench_unix_socket(const Settings &settings) {
+  if (settings.unix_socket.empty()) {
+    // LCOV_EXCL_START
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  mk::curl::Request tcp;
+  tcp.url = settings.url;
+  mk::curl::Request unix_socket{tcp};
+  unix_socket.unix_socket_path = settings.unix_socket;
+  for (auto *req : {&tcp, &unix_socket}) {
+    std::string label = (req == &tcp) ? "tcp" : "unix";
+    measure(label + "_first", settings.count, [&]() {
+      return mk::curl::Client{}.perform(*req).error == 0;
+    });
+    mk::curl::Client client;
+    mk::curl::Response res;
+    int64_t bytes = 0;
+    auto begin = std::chrono::steady_clock::now();
+    measure(label + "_reused", settings.count, [&]() {
+      client.perform(*req, res);
+      bytes += res.bytes_recv;
+      return res.error == 0;
+    });
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    std::cout << label << "_throughput: "
+              << (double)bytes / elapsed.count() / 1e6 << " MB/s"
+              << std::endl;
+  }
+}
+
+static void bench_features(const Settings &settings) {
+  std::cout << "sizeof(Response): " << sizeof(mk::curl::Response) << " bytes"
+            << std::endl;
+  mk::curl::Request req;
+  req.url = settings.url;
+  req.unix_socket_path = settings.unix_socket;
+  mk::curl::Client client;
+  mk::curl::Response res;
+  measure("reused", settings.count, [&]() {
+    client.perform(req, res);
+    return res.error == 0;
+  });
+}
+
+static void bench_replay(const Settings &settings) {
+  if (settings.recording.empty()) {
+    // LCOV_EXCL_START
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  mk::curl::Request req;
+  req.url = settings.url;
+  auto recording = std::make_shared<mk::curl::Recording>();
+  if (!recording->load(settings.recording)) {
+    mk::curl::Client client;
+    client.set_recording(recording);
+    measure("record", 1, [&]() { return client.perform(req).error == 0; });
+    if (!recording->save(settings.recording)) {
+      // LCOV_EXCL_START
+      std::clog << "FATAL: cannot save the recording" << std::endl;
+      exit(EXIT_FAILURE);
+      // LCOV_EXCL_STOP
+    }
+  }
+  for (auto mode : {mk::curl::RecordingMode::replay,
+                    mk::curl::RecordingMode::replay_timed}) {
+    mk::curl::Client client;
+    client.set_recording(recording, mode);
+    std::string label = (mode == mk::curl::RecordingMode::replay)
+                            ? "replay" : "replay_timed";
+    measure(label, settings.count, [&]() {
+      recording->rewind();
+      return client.perform(req).error == 0;
+    });
+  }
+}
+
+int main(int, char **argv) {
+  Settings settings;
+  argh::parser cmdline;
+  cmdline.add_param("ca-bundle-path");
+  cmdline.add_param("count");
+  cmdline.add_param("recording");
+  cmdline.add_param("session-file");
+  cmdline.add_param("unix-socket");
+  cmdline.parse(argv);
+  for (auto &flag : cmdline.flags()) {
+    // LCOV_EXCL_START
+    std::clog << "fatal: unrecognized flag: " << flag << std::endl;
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  for (auto &param : cmdline.params()) {
+    if (param.first == "ca-bundle-path") {
+      settings.ca_path = param.second;
+    } else if (param.first == "count") {
+      // Implementation note: like mkcurl-client, we don't bother with
+      // properly validating numbers passed on the command line.
+      settings.count = (size_t)std::max(atoi(param.second.c_str()), 1);
+    } else if (param.first == "recording") {
+      settings.recording = param.second;
+    } else if (param.first == "session-file") {
+      settings.session_file = param.second;
+    } else if (param.first == "unix-socket") {
+      settings.unix_socket = param.second;
+    } else {
+      // LCOV_EXCL_START
+      std::clog << "fatal: unrecognized param: " << param.first << std::endl;
+      usage();
+      exit(EXIT_FAILURE);
+      // LCOV_EXCL_STOP
+    }
+  }
+  if (cmdline.pos_args().size() != 3) {
+    // LCOV_EXCL_START
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+  settings.url = cmdline.pos_args()[2];
+  auto benchmark = cmdline.pos_args()[1];
+  if (benchmark == "trust-store") {
+    bench_trust_store(settings);
+  } else if (benchmark == "session-store") {
+    bench_session_store(settings);
+  } else if (benchmark == "certs") {
+    bench_certs(settings);
+  } else if (benchmark == "unix-socket") {
+    bench_unix_socket(settings);
+  } else if (benchmark == "features") {
+    bench_features(settings);
+  } else if (benchmark == "replay") {
+    bench_replay(settings);
+  } else {
+    // LCOV_EXCL_START
+    std::clog << "fatal: unknown benchmark: " << benchmark << std::endl;
+    usage();
+    exit(EXIT_FAILURE);
+    // LCOV_EXCL_STOP
+  }
+}
@@ -0,0 +1,246 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "mkcurl.h"
+
+#include <stdlib.h>
+
+#include <utility>
+
+#include "mkcurl.hpp"
+
+struct mkcurl_request {
+  mk::curl::Request req;
+};
+
+struct mkcurl_response {
+  mk::curl::Response res;
+};
+
+struct mkcurl_client {
+  mk::curl::Client client;
+};
+
+// mkcurl_nothrow calls @p func and aborts if it throws, e.g. std::bad_alloc,
+// because exceptions must not cross the C frames of the callers, and because
+// the functions whose name ends in `_nonnull` must never return null. We
+// abort for the same reason for which we abort when passed null pointers.
+template <typename Func>
+static auto mkcurl_nothrow(Func func) noexcept -> decltype(func()) {
+  try {
+    return func();
+  } catch (...) {
+    abort();
+  }
+}
+
+// mkcurl_view returns a view of @p s through @p base and @p count.
+template <typename Type>
+static void mkcurl_view(const std::string &s, const Type **base,
+                        size_t *count) {
+  if (base == nullptr || count == nullptr) abort();
+  *base = reinterpret_cast<const Type *>(s.data());
+  *count = s.size();
+}
+
+mkcurl_request_t *mkcurl_request_new_nonnull() {
+  return mkcurl_nothrow([]() { return new mkcurl_request; });
+}
+
+void mkcurl_request_set_ca_path(mkcurl_request_t *req, const char *path) {
+  if (req == nullptr || path == nullptr) abort();
+  mkcurl_nothrow([&]() { req->req.ca_path = path; });
+}
+
+void mkcurl_request_enable_http2(mkcurl_request_t *req) {
+  if (req == nullptr) abort();
+  req->req.enable_http2 = true;
+}
+
+void mkcurl_request_set_method(mkcurl_request_t *req, const char *method) {
+  if (req == nullptr || method == nullptr) abort();
+  mkcurl_nothrow([&]() { req->req.method = method; });
+}
+
+void mkcurl_request_set_url(mkcurl_request_t *req, const char *url) {
+  if (req == nullptr || url == nullptr) abort();
+  mkcurl_nothrow([&]() { req->req.url = url; });
+}
+
+void mkcurl_request_add_header(mkcurl_request_t *req, const char *header) {
+  if (req == nullptr || header == nullptr) abort();
+  mkcurl_nothrow([&]() { req->req.headers.push_back(header); });
+}
+
+void mkcurl_request_set_body(
+    mkcurl_request_t *req, const uint8_t *base, size_t count) {
+  if (req == nullptr || (base == nullptr && count > 0)) abort();
+  mkcurl_nothrow([&]() {
+    req->req.body.assign(reinterpret_cast<const char *>(base), count);
+  });
+}
+
+void mkcurl_request_set_timeout(mkcurl_request_t *req, int64_t timeout) {
+  if (req == nullptr) abort();
+  req->req.timeout = timeout;
+}
+
+void mkcurl_request_set_proxy_url(mkcurl_request_t *req, const char *url) {
+  if (req == nullptr || url == nullptr) abort();
+  mkcurl_nothrow([&]() { req->req.proxy_url = url; });
+}
+
+void mkcurl_request_enable_fastopen(mkcurl_request_t *req) {
+  if (req == nullptr) abort();
+  req->req.enable_fastopen = true;
+}
+
+void mkcurl_request_enable_follow_redirect(mkcurl_request_t *req) {
+  if (req == nullptr) abort();
+  req->req.follow_redir = true;
+}
+
+void mkcurl_request_enable_certs(mkcurl_request_t *req) {
+  if (req == nullptr) abort();
+  req->req.cert_capture = mk::curl::CertCapture::pem;
+}
+
+void mkcurl_request_set_connect_to(
+    mkcurl_request_t *req, const char *connect_to) {
+  if (req == nullptr || connect_to == nullptr) abort();
+  mkcurl_nothrow([&]() { req->req.connect_to = connect_to; });
+}
+
+void mkcurl_request_set_retries(mkcurl_request_t *req, size_t retries) {
+  if (req == nullptr) abort();
+  req->req.retries = retries;
+}
+
+void mkcurl_request_delete(mkcurl_request_t *req) { delete req; }
+
+mkcurl_client_t *mkcurl_client_new_nonnull() {
+  return mkcurl_nothrow([]() { return new mkcurl_client; });
+}
+
+mkcurl_response_t *mkcurl_client_perform_nonnull(
+    mkcurl_client_t *client, const mkcurl_request_t *req) {
+  if (client == nullptr || req == nullptr) abort();
+  return mkcurl_nothrow([&]() {
+    auto res = new mkcurl_response;
+    client->client.perform(req->req, res->res);
+    return res;
+  });
+}
+
+void mkcurl_client_delete(mkcurl_client_t *client) { delete client; }
+
+mkcurl_response_t *mkcurl_perform_nonnull(const mkcurl_request_t *req) {
+  if (req == nullptr) abort();
+  return mkcurl_nothrow([&]() {
+    auto res = new mkcurl_response;
+    res->res = mk::curl::perform(req->req);
+    return res;
+  });
+}
+
+int64_t mkcurl_response_get_error(const mkcurl_response_t *res) {
+  if (res == nullptr) abort();
+  return res->res.error;
+}
+
+int64_t mkcurl_response_get_status_code(const mkcurl_response_t *res) {
+  if (res == nullptr) abort();
+  return res->res.status_code;
+}
+
+int64_t mkcurl_response_get_bytes_sent(const mkcurl_response_t *res) {
+  if (res == nullptr) abort();
+  return res->res.bytes_sent;
+}
+
+int64_t mkcurl_response_get_bytes_recv(const mkcurl_response_t *res) {
+  if (res == nullptr) abort();
+  return res->res.bytes_recv;
+}
+
+void mkcurl_response_get_body(
+    const mkcurl_response_t *res, const uint8_t **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.body, base, count);
+}
+
+void mkcurl_response_get_redirect_url(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.redirect_url, base, count);
+}
+
+void mkcurl_response_get_request_headers(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.request_headers, base, count);
+}
+
+void mkcurl_response_get_response_headers(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.response_headers, base, count);
+}
+
+void mkcurl_response_get_certs(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+#ifndef MKCURL_NO_CERT_CAPTURE
+  mkcurl_view(res->res.certs, base, count);
+#else
+  static const std::string empty;
+  mkcurl_view(empty, base, count);
+#endif
+}
+
+void mkcurl_response_get_content_type(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.content_type, base, count);
+}
+
+void mkcurl_response_get_http_version(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.http_version, base, count);
+}
+
+void mkcurl_response_get_cache_status(
+    const mkcurl_response_t *res, const char **base, size_t *count) {
+  if (res == nullptr) abort();
+  mkcurl_view(res->res.cache_status, base, count);
+}
+
+size_t mkcurl_response_get_logs_size(const mkcurl_response_t *res) {
+  if (res == nullptr) abort();
+  return res->res.logs.size();
+}
+
+int64_t mkcurl_response_get_log_msec(
+    const mkcurl_response_t *res, size_t idx) {
+  if (res == nullptr || idx >= res->res.logs.size()) abort();
+#ifndef MKCURL_NO_LOGS
+  return res->res.logs[idx].msec;
+#else
+  abort();  // the logs are always empty
+#endif
+}
+
+void mkcurl_response_get_log_line(const mkcurl_response_t *res, size_t idx,
+                                  const char **base, size_t *count) {
+  if (res == nullptr || idx >= res->res.logs.size()) abort();
+#ifndef MKCURL_NO_LOGS
+  mkcurl_view(res->res.logs[idx].line, base, count);
+#else
+  (void)base, (void)count;
+  abort();  // the logs are always empty
+#endif
+}
+
+void mkcurl_response_delete(mkcurl_response_t *res) { delete res; }
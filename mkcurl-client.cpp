@@ -25,6 +25,9 @@ static void usage() {
   std::clog << "Options can start with either a single dash (i.e. -option) or\n";
   std::clog << "a double dash (i.e. --option). Available options:\n";
   std::clog << "\n";
+  std::clog << "  --abstract-unix-socket <name>\n";
+  std::clog << "                          : like --unix-socket but using the\n";
+  std::clog << "                            abstract namespace (Linux only)\n";
   std::clog << "  --ca-bundle-path <path> : path to OpenSSL CA bundle\n";
   std::clog << "  --connect-to <ip>       : connects to <ip> while using the\n";
   std::clog << "                            host in the URL for TLS SNI, if\n";
@@ -33,11 +36,19 @@ static void usage() {
   std::clog << "  --data <data>           : send <data> as body\n";
   std::clog << "  --enable-http2          : enable HTTP2 support\n";
   std::clog << "  --enable-tcp-fastopen   : enable TCP fastopen support\n";
+  std::clog << "  --expect-reuse          : fail unless all the requests but\n";
+  std::clog << "                            the first reuse the connection\n";
   std::clog << "  --follow-redirect       : enable following redirects\n";
   std::clog << "  --header <header>       : add <header> to headers\n";
   std::clog << "  --post                  : use POST rather than GET\n";
   std::clog << "  --put                   : use PUT rather than GET\n";
   std::clog << "  --timeout <sec>         : set timeout of <sec> seconds\n";
+  std::clog << "  --trace <path>          : write the phases of the requests\n";
+  std::clog << "                            to <path> using the Chrome trace\n";
+  std::clog << "                            format (see chrome://tracing)\n";
+  std::clog << "  --unix-socket <path>    : connect to the Unix domain\n";
+  std::clog << "                            socket <path> rather than to\n";
+  std::clog << "                            the host in the URL\n";
   std::clog << std::endl;
   // clang-format on
 }
@@ -52,6 +63,8 @@ static void summary(mk::curl::Response &res) {
             << "Redirect URL: " << res.redirect_url << std::endl
             << "Content Type: " << res.content_type << std::endl
             << "HTTP version: " << res.http_version << std::endl
+            << "Connection reused: " << res.connection_reused << std::endl
+            << "Connection id: " << res.connection_id << std::endl
             << "=== END SUMMARY ===" << std::endl << std::endl;
   std::clog << "=== BEGIN REQUEST HEADERS ==="
             << std::endl << res.request_headers
@@ -61,10 +74,15 @@ static void summary(mk::curl::Response &res) {
             << std::endl << res.response_headers
             << "=== END RESPONSE HEADERS ==="
             << std::endl << std::endl;
+#ifndef MKCURL_NO_CERT_CAPTURE
   std::clog << "=== BEGIN CERTIFICATE CHAIN ==="
             << std::endl << res.certs
             << "=== END CERTIFICATE CHAIN ==="
             << std::endl << std::endl;
+  for (auto &cert : res.cert_chain) {
+    std::clog << "SHA-256 fingerprint: " << cert.sha256 << std::endl;
+  }
+#endif
   std::clog << "=== BEGIN LOGS ===" << std::endl;
   for (auto &log : res.logs) {
     std::clog << "[" << log.msec << "] " << log.line << std::endl;
@@ -76,19 +94,29 @@ static void summary(mk::curl::Response &res) {
 
 int main(int, char **argv) {
   mk::curl::Request req;
+#ifndef MKCURL_NO_CERT_CAPTURE
+  req.cert_capture = mk::curl::CertCapture::pem;
+#endif
+  std::string trace_path;
+  bool expect_reuse = false;
   argh::parser cmdline;
   {
+    cmdline.add_param("abstract-unix-socket");
     cmdline.add_param("ca-bundle-path");
     cmdline.add_param("connect-to");
     cmdline.add_param("data");
     cmdline.add_param("header");
     cmdline.add_param("timeout");
+    cmdline.add_param("trace");
+    cmdline.add_param("unix-socket");
     cmdline.parse(argv);
     for (auto &flag : cmdline.flags()) {
       if (flag == "enable-http2") {
         req.enable_http2 = true;
       } else if (flag == "enable-tcp-fastopen") {
         req.enable_fastopen = true;
+      } else if (flag == "expect-reuse") {
+        expect_reuse = true;
       } else if (flag == "follow-redirect") {
         req.follow_redir = true;
       } else if (flag == "post") {
@@ -104,7 +132,10 @@ int main(int, char **argv) {
       }
     }
     for (auto &param : cmdline.params()) {
-      if (param.first == "ca-bundle-path") {
+      if (param.first == "abstract-unix-socket") {
+        req.unix_socket_path = param.second;
+        req.abstract_unix_socket = true;
+      } else if (param.first == "ca-bundle-path") {
         req.ca_path = param.second;
       } else if (param.first == "connect-to") {
         std::stringstream ss;
@@ -120,6 +151,10 @@ int main(int, char **argv) {
         // is passed here and we just use atoi(). A really robust client
         // SHOULD instead use strtonum().
         req.timeout = atoi(param.second.c_str());
+      } else if (param.first == "trace") {
+        trace_path = param.second;
+      } else if (param.first == "unix-socket") {
+        req.unix_socket_path = param.second;
       } else {
         // LCOV_EXCL_START
         std::clog << "fatal: unrecognized param: " << param.first << std::endl;
@@ -138,6 +173,11 @@ int main(int, char **argv) {
   }
   auto exitcode = EXIT_SUCCESS;
   mk::curl::Client client;
+  std::shared_ptr<mk::curl::Tracer> tracer;
+  if (!trace_path.empty()) {
+    tracer = std::make_shared<mk::curl::Tracer>();
+    client.set_tracer(tracer);
+  }
   for (size_t sz = 1; sz < cmdline.pos_args().size(); ++sz) {
     mk::curl::Request real_request{req};
     real_request.url = cmdline.pos_args()[sz];
@@ -149,6 +189,19 @@ int main(int, char **argv) {
       exitcode = EXIT_FAILURE;
       // LCOV_EXCL_STOP
     }
+    if (expect_reuse && sz > 1 && !res.connection_reused) {
+      // LCOV_EXCL_START
+      std::clog << "FATAL: the request did not reuse the connection"
+                << std::endl;
+      exitcode = EXIT_FAILURE;
+      // LCOV_EXCL_STOP
+    }
+  }
+  if (tracer != nullptr && !tracer->save(trace_path)) {
+    // LCOV_EXCL_START
+    std::clog << "FATAL: cannot write " << trace_path << std::endl;
+    exitcode = EXIT_FAILURE;
+    // LCOV_EXCL_STOP
   }
   exit(exitcode);
 }
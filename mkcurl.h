@@ -0,0 +1,157 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_MKCURL_H
+#define MEASUREMENT_KIT_MKCURL_H
+
+// This is the C API of mkcurl, meant to write bindings for other languages.
+// All types are opaque. Functions whose name ends in `_nonnull` never return
+// a null pointer, and all functions abort if passed null pointers or if the
+// C++ code throws (e.g. when out of memory), as no exception may cross the C
+// API. Strings passed to setters are copied. Getters return pointer and
+// length of a view into the storage owned by the response, which remains
+// valid until you call mkcurl_response_delete, so you don't need to copy
+// the data.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// mkcurl_request_t is an HTTP request.
+typedef struct mkcurl_request mkcurl_request_t;
+
+/// mkcurl_response_t is an HTTP response.
+typedef struct mkcurl_response mkcurl_response_t;
+
+/// mkcurl_client_t is an HTTP client. A client must be used by at most one
+/// thread at a time, and keeps connections alive across requests.
+typedef struct mkcurl_client mkcurl_client_t;
+
+/// mkcurl_request_new_nonnull creates a new request.
+mkcurl_request_t *mkcurl_request_new_nonnull(void);
+
+/// mkcurl_request_set_ca_path sets the path to the CA bundle.
+void mkcurl_request_set_ca_path(mkcurl_request_t *req, const char *path);
+
+/// mkcurl_request_enable_http2 enables HTTP2.
+void mkcurl_request_enable_http2(mkcurl_request_t *req);
+
+/// mkcurl_request_set_method sets the request method.
+void mkcurl_request_set_method(mkcurl_request_t *req, const char *method);
+
+/// mkcurl_request_set_url sets the request URL.
+void mkcurl_request_set_url(mkcurl_request_t *req, const char *url);
+
+/// mkcurl_request_add_header adds @p header to the request headers.
+void mkcurl_request_add_header(mkcurl_request_t *req, const char *header);
+
+/// mkcurl_request_set_body sets the (possibly binary) request body.
+void mkcurl_request_set_body(
+    mkcurl_request_t *req, const uint8_t *base, size_t count);
+
+/// mkcurl_request_set_timeout sets the request timeout in seconds.
+void mkcurl_request_set_timeout(mkcurl_request_t *req, int64_t timeout);
+
+/// mkcurl_request_set_proxy_url sets the URL of the proxy.
+void mkcurl_request_set_proxy_url(mkcurl_request_t *req, const char *url);
+
+/// mkcurl_request_enable_fastopen enables TCP fastopen.
+void mkcurl_request_enable_fastopen(mkcurl_request_t *req);
+
+/// mkcurl_request_enable_follow_redirect enables following redirects.
+void mkcurl_request_enable_follow_redirect(mkcurl_request_t *req);
+
+/// mkcurl_request_enable_certs enables capturing the PEM certificates.
+void mkcurl_request_enable_certs(mkcurl_request_t *req);
+
+/// mkcurl_request_set_connect_to sets the CURLOPT_CONNECT_TO string.
+void mkcurl_request_set_connect_to(
+    mkcurl_request_t *req, const char *connect_to);
+
+/// mkcurl_request_set_retries sets the number of retries.
+void mkcurl_request_set_retries(mkcurl_request_t *req, size_t retries);
+
+/// mkcurl_request_delete destroys @p req. Passing null is allowed.
+void mkcurl_request_delete(mkcurl_request_t *req);
+
+/// mkcurl_client_new_nonnull creates a new client.
+mkcurl_client_t *mkcurl_client_new_nonnull(void);
+
+/// mkcurl_client_perform_nonnull performs @p req using @p client.
+mkcurl_response_t *mkcurl_client_perform_nonnull(
+    mkcurl_client_t *client, const mkcurl_request_t *req);
+
+/// mkcurl_client_delete destroys @p client. Passing null is allowed.
+void mkcurl_client_delete(mkcurl_client_t *client);
+
+/// mkcurl_perform_nonnull performs @p req using a temporary client.
+mkcurl_response_t *mkcurl_perform_nonnull(const mkcurl_request_t *req);
+
+/// mkcurl_response_get_error returns the cURL error (zero on success).
+int64_t mkcurl_response_get_error(const mkcurl_response_t *res);
+
+/// mkcurl_response_get_status_code returns the HTTP status code.
+int64_t mkcurl_response_get_status_code(const mkcurl_response_t *res);
+
+/// mkcurl_response_get_bytes_sent returns the bytes sent.
+int64_t mkcurl_response_get_bytes_sent(const mkcurl_response_t *res);
+
+/// mkcurl_response_get_bytes_recv returns the bytes received.
+int64_t mkcurl_response_get_bytes_recv(const mkcurl_response_t *res);
+
+/// mkcurl_response_get_body returns the (possibly binary) body.
+void mkcurl_response_get_body(
+    const mkcurl_response_t *res, const uint8_t **base, size_t *count);
+
+/// mkcurl_response_get_redirect_url returns the redirect URL.
+void mkcurl_response_get_redirect_url(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_request_headers returns the request headers.
+void mkcurl_response_get_request_headers(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_response_headers returns the response headers.
+void mkcurl_response_get_response_headers(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_certs returns the PEM certificates, if you called
+/// mkcurl_request_enable_certs, and an empty string otherwise.
+void mkcurl_response_get_certs(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_content_type returns the content type.
+void mkcurl_response_get_content_type(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_http_version returns the HTTP version.
+void mkcurl_response_get_http_version(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_cache_status returns the cache status.
+void mkcurl_response_get_cache_status(
+    const mkcurl_response_t *res, const char **base, size_t *count);
+
+/// mkcurl_response_get_logs_size returns the number of log entries.
+size_t mkcurl_response_get_logs_size(const mkcurl_response_t *res);
+
+/// mkcurl_response_get_log_msec returns the time of the @p idx-th log
+/// entry. It aborts if @p idx is out of bounds.
+int64_t mkcurl_response_get_log_msec(
+    const mkcurl_response_t *res, size_t idx);
+
+/// mkcurl_response_get_log_line returns the (possibly non UTF-8) line
+/// of the @p idx-th log entry. It aborts if @p idx is out of bounds.
+void mkcurl_response_get_log_line(const mkcurl_response_t *res, size_t idx,
+                                  const char **base, size_t *count);
+
+/// mkcurl_response_delete destroys @p res. Passing null is allowed.
+void mkcurl_response_delete(mkcurl_response_t *res);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+#endif  // MEASUREMENT_KIT_MKCURL_H
@@ -6,20 +6,200 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#if __cplusplus >= 201703L
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory_resource>
+#endif
+
+/// MKCURL_NO_LOGS, MKCURL_NO_CERT_CAPTURE and MKCURL_NO_BYTE_COUNTING
+/// compile out, respectively, the logs, the certificate capture and the
+/// counting of the bytes sent and received, for builds that do not need
+/// them. MKCURL_MINIMAL defines all of them. Since they change the layout
+/// of Response, they must be defined in the same way for all the
+/// translation units using this library. Each of them changes the name of
+/// MKCURL_INLINE_NAMESPACE, so that mismatches fail at link time.
+#ifdef MKCURL_MINIMAL
+#ifndef MKCURL_NO_LOGS
+#define MKCURL_NO_LOGS
+#endif
+#ifndef MKCURL_NO_CERT_CAPTURE
+#define MKCURL_NO_CERT_CAPTURE
+#endif
+#ifndef MKCURL_NO_BYTE_COUNTING
+#define MKCURL_NO_BYTE_COUNTING
+#endif
+#endif
+
+// The following helper macros build the name of MKCURL_INLINE_NAMESPACE.
+#ifdef MKCURL_NO_LOGS
+#define MKCURL_INLINE_NAMESPACE_LOGS_ _nologs
+#else
+#define MKCURL_INLINE_NAMESPACE_LOGS_
+#endif
+#ifdef MKCURL_NO_CERT_CAPTURE
+#define MKCURL_INLINE_NAMESPACE_CERTS_ _nocerts
+#else
+#define MKCURL_INLINE_NAMESPACE_CERTS_
+#endif
+#ifdef MKCURL_NO_BYTE_COUNTING
+#define MKCURL_INLINE_NAMESPACE_BYTES_ _nobytes
+#else
+#define MKCURL_INLINE_NAMESPACE_BYTES_
+#endif
+#define MKCURL_INLINE_NAMESPACE_PASTE_(a, b, c, d) a##b##c##d
+#define MKCURL_INLINE_NAMESPACE_NAME_(a, b, c, d) \
+  MKCURL_INLINE_NAMESPACE_PASTE_(a, b, c, d)
+
 /// MKCURL_INLINE_NAMESPACE controls the inline inner namespace in which
-/// public symbols exported by this library are enclosed.
+/// public symbols exported by this library are enclosed. Its name depends
+/// on the version as well as on the switches above.
 ///
 /// See <https://github.com/measurement-kit/measurement-kit/issues/1867#issuecomment-514562622>.
-#define MKCURL_INLINE_NAMESPACE v0_11_2_or_greater
+#define MKCURL_INLINE_NAMESPACE                              \
+  MKCURL_INLINE_NAMESPACE_NAME_(                             \
+      v0_11_2_or_greater, MKCURL_INLINE_NAMESPACE_LOGS_,     \
+      MKCURL_INLINE_NAMESPACE_CERTS_, MKCURL_INLINE_NAMESPACE_BYTES_)
+
+/// MKCURL_OPENSSL tells this library that libcurl uses OpenSSL and that the
+/// program links with the same OpenSSL libraries. In such case, a TrustStore
+/// parses its CA certificates once and all the TLS connections share them.
+/// It only matters for the translation unit containing the implementation.
 
 namespace mk {
 namespace curl {
 inline namespace MKCURL_INLINE_NAMESPACE {
 
+/// ResolveEntry tells mkcurl which addresses to use for a host and port, such
+/// that cURL does not need to resolve the host.
+struct ResolveEntry {
+  /// host is the host name, as it appears in URLs.
+  std::string host;
+
+  /// port is the port, as it appears in URLs (or the default port).
+  int64_t port = 443;
+
+  /// addresses contains the IPv4 and IPv6 addresses of the host in order of
+  /// preference, except that, within a Client, the address that worked last
+  /// time is always tried first.
+  std::vector<std::string> addresses;
+};
+
+/// IPVersion tells cURL which IP versions it may use.
+enum class IPVersion {
+  /// any means that cURL may use both IPv4 and IPv6.
+  any,
+
+  /// v4 means that cURL may only use IPv4.
+  v4,
+
+  /// v6 means that cURL may only use IPv6.
+  v6
+};
+
+/// ProgressSample is a sample of the progress of a transfer.
+struct ProgressSample {
+  /// elapsed_us is the time elapsed since the beginning of the transfer
+  /// in microseconds, measured using C++'s steady clock.
+  int64_t elapsed_us = 0;
+
+  /// bytes_down is the number of body bytes received so far.
+  int64_t bytes_down = 0;
+
+  /// bytes_up is the number of body bytes sent so far.
+  int64_t bytes_up = 0;
+};
+
+/// error_cancelled is the Response::error when the request was cancelled
+/// using a CancellationToken. Negative values are not used by cURL.
+constexpr int64_t error_cancelled = -1;
+
+/// error_headers_too_large is the Response::error when the response headers
+/// are larger than Request::max_header_bytes.
+constexpr int64_t error_headers_too_large = -2;
+
+/// error_circuit_open is the Response::error when the request has not been
+/// performed because the CircuitBreaker of its host is open.
+constexpr int64_t error_circuit_open = -3;
+
+/// error_replay_exhausted is the Response::error when a Client replaying a
+/// Recording has already replayed all its exchanges.
+constexpr int64_t error_replay_exhausted = -4;
+
+/// CancellationToken allows to cancel the requests using it from any
+/// thread. A cancelled request stops within about one second, which is the
+/// interval at which cURL checks whether to continue when the network is
+/// idle, and is not retried. Cancelling is permanent. A CancellationToken
+/// is thread safe and may be shared by several requests.
+class CancellationToken {
+ public:
+  /// CancellationToken creates a token that is not cancelled.
+  CancellationToken() noexcept;
+
+  /// CancellationToken is the deleted copy constructor.
+  CancellationToken(const CancellationToken &) noexcept = delete;
+
+  /// CancellationToken is the deleted copy assignment.
+  CancellationToken &operator=(const CancellationToken &) noexcept = delete;
+
+  /// CancellationToken is the deleted move constructor.
+  CancellationToken(CancellationToken &&) noexcept = delete;
+
+  /// CancellationToken is the deleted move assignment.
+  CancellationToken &operator=(CancellationToken &&) noexcept = delete;
+
+  /// ~CancellationToken is the destructor.
+  ~CancellationToken() noexcept;
+
+  /// cancel cancels the requests using this token.
+  void cancel() noexcept;
+
+  /// cancelled returns whether cancel was called.
+  bool cancelled() const noexcept;
+
+ private:
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// Priority is the priority class of a request performed by an Engine.
+enum class Priority {
+  /// background is for bulk transfers, e.g., uploading results.
+  background,
+
+  /// normal is the default priority.
+  normal,
+
+  /// interactive is for latency sensitive transfers, e.g., control messages.
+  interactive
+};
+
+/// CertCapture tells which certificates of the chain sent by the server
+/// we should capture into the Response.
+enum class CertCapture {
+  /// none does not capture any certificate.
+  none,
+
+  /// fingerprints only captures the SHA-256 fingerprint of each certificate.
+  fingerprints,
+
+  /// chain captures the DER encoding and the fingerprint of each certificate.
+  chain,
+
+  /// pem is like chain but also fills Response::certs.
+  pem
+};
+
 /// Request is an HTTP request.
 struct Request {
   /// ca_path is the path to the CA bundle to use.
@@ -62,6 +242,86 @@ struct Request {
   /// that the number here is the number of times a request will be
   /// _retried_, i.e., it does not count the initial request.
   size_t retries = 2;
+
+  /// resolve contains the addresses to use for some hosts, such that cURL
+  /// does not need to resolve them. These entries take precedence over the
+  /// ones configured with Client::set_resolve.
+  std::vector<ResolveEntry> resolve;
+
+  /// ip_version restricts the IP versions that cURL may use. To prefer
+  /// a version while keeping the other one as a fallback, list the addresses
+  /// of the preferred version first in resolve instead.
+  IPVersion ip_version = IPVersion::any;
+
+  /// happy_eyeballs_timeout_ms is the time after which cURL, while still
+  /// trying to connect using the first IP version, also starts trying the
+  /// other one (in milliseconds). Zero means using cURL's default.
+  int64_t happy_eyeballs_timeout_ms = 0;
+
+  /// unix_socket_path, if not empty, is the path of the Unix domain socket
+  /// to connect to instead of the host in url, e.g., to talk with a local
+  /// sidecar. The url still determines the HTTP semantics (e.g., the Host
+  /// header), and connections are kept alive as usual.
+  std::string unix_socket_path;
+
+  /// abstract_unix_socket indicates that unix_socket_path is a name in the
+  /// abstract socket namespace (Linux only) rather than a path.
+  bool abstract_unix_socket = false;
+
+  /// enable_tcp_info indicates whether we should read the TCP_INFO of the
+  /// connection once connected and at the end of the transfer. See the
+  /// tcp_info_connect and tcp_info_end fields of Response.
+  bool enable_tcp_info = false;
+
+  /// so_rcvbuf, if positive, is the SO_RCVBUF of new sockets.
+  int64_t so_rcvbuf = 0;
+
+  /// so_sndbuf, if positive, is the SO_SNDBUF of new sockets.
+  int64_t so_sndbuf = 0;
+
+  /// tcp_notsent_lowat, if positive, is the TCP_NOTSENT_LOWAT of new sockets,
+  /// where supported. Note that cURL sets TCP_NODELAY by default.
+  int64_t tcp_notsent_lowat = 0;
+
+  /// progress_interval_ms, if positive, is the interval at which we sample
+  /// the progress of the transfer into Response::progress (in milliseconds).
+  int64_t progress_interval_ms = 0;
+
+  /// on_progress, if set, is called with each progress sample, from the
+  /// thread performing the request. It must not throw. It is only called
+  /// when progress_interval_ms is positive.
+  std::function<void(const ProgressSample &)> on_progress;
+
+  /// cancellation, if set, allows to cancel this request from another
+  /// thread. See CancellationToken.
+  std::shared_ptr<CancellationToken> cancellation;
+
+  /// max_body_size, if positive, is the maximum size of the response body. If
+  /// the body is larger, the transfer is stopped and Response::error is
+  /// CURLE_FILESIZE_EXCEEDED. A larger Content-Length is rejected before
+  /// reading the body, unless keep_truncated_body is true.
+  int64_t max_body_size = 0;
+
+  /// keep_truncated_body indicates that, when the body is larger than
+  /// max_body_size, we should keep its first max_body_size bytes and set
+  /// Response::body_truncated, rather than failing.
+  bool keep_truncated_body = false;
+
+  /// max_header_bytes, if positive, is the maximum size of the response
+  /// headers, including the ones of redirects. If the headers are larger, the
+  /// transfer is stopped and Response::error is error_headers_too_large.
+  int64_t max_header_bytes = 0;
+
+  /// priority is the priority class of this request. It is only used when
+  /// the request is performed by an Engine.
+  Priority priority = Priority::normal;
+
+  /// cert_capture tells which certificates we should capture into
+  /// Response::cert_chain and Response::certs. Capturing certificates
+  /// has a CPU cost, hence it is disabled by default. With
+  /// MKCURL_NO_CERT_CAPTURE, any value but CertCapture::none makes the
+  /// request fail with CURLE_NOT_BUILT_IN.
+  CertCapture cert_capture = CertCapture::none;
 };
 
 /// Log is a log entry.
@@ -74,6 +334,101 @@ struct Log {
   std::string line;
 };
 
+#ifndef MKCURL_NO_LOGS
+/// Logs contains the logs of a request.
+using Logs = std::vector<Log>;
+#else
+/// Logs is always empty when compiling with MKCURL_NO_LOGS. It only has
+/// the methods needed to iterate over it, such that code consuming the
+/// logs compiles in both cases.
+struct Logs {
+  /// begin returns the beginning of the logs.
+  const Log *begin() const noexcept { return nullptr; }
+
+  /// end returns the end of the logs.
+  const Log *end() const noexcept { return nullptr; }
+
+  /// empty returns true.
+  bool empty() const noexcept { return true; }
+
+  /// size returns zero.
+  size_t size() const noexcept { return 0; }
+
+  /// clear does nothing.
+  void clear() noexcept {}
+};
+#endif
+
+/// TCPInfo contains statistics read from the kernel using the TCP_INFO
+/// socket option. They are only available on Linux.
+struct TCPInfo {
+  /// valid indicates whether we could read the statistics.
+  bool valid = false;
+
+  /// rtt_us is the smoothed RTT in microseconds.
+  int64_t rtt_us = 0;
+
+  /// rttvar_us is the RTT variance in microseconds.
+  int64_t rttvar_us = 0;
+
+  /// total_retrans is the number of retransmitted segments.
+  int64_t total_retrans = 0;
+
+  /// snd_cwnd is the congestion window in segments.
+  int64_t snd_cwnd = 0;
+
+  /// delivery_rate is the most recent delivery rate in bytes per second.
+  int64_t delivery_rate = 0;
+
+  /// bytes_acked is the number of bytes acknowledged by the peer.
+  int64_t bytes_acked = 0;
+};
+
+/// Certificate is a certificate of the chain sent by the server.
+struct Certificate {
+  /// der is the DER encoding of the certificate. It is empty when using
+  /// CertCapture::fingerprints.
+  std::string der;
+
+  /// sha256 is the SHA-256 fingerprint of the DER encoding, in lowercase
+  /// hexadecimal notation.
+  std::string sha256;
+};
+
+/// HeaderField is a response header. Rather than copying its name and its
+/// value, we store their offsets into Response::response_headers.
+struct HeaderField {
+  /// name is the offset of the header name.
+  size_t name = 0;
+
+  /// name_size is the size of the header name.
+  size_t name_size = 0;
+
+  /// value is the offset of the header value, without leading whitespace.
+  size_t value = 0;
+
+  /// value_size is the size of the value, without trailing whitespace.
+  size_t value_size = 0;
+};
+
+/// MemoryStats tells where the memory used by a request goes.
+struct MemoryStats {
+  /// curl_allocations is the number of allocations made by libcurl while
+  /// a Client performed the request. It is only available after a
+  /// successful global_init. It does not include the allocations made by
+  /// other threads, such as the threaded resolver, nor the ones made while
+  /// an Engine performs the request, because it multiplexes requests.
+  int64_t curl_allocations = 0;
+
+  /// curl_bytes is the number of bytes allocated by libcurl, counted like
+  /// curl_allocations.
+  int64_t curl_bytes = 0;
+
+  /// response_bytes is the heap memory reserved by the strings and the
+  /// vectors of the Response. It drops when reusing a Response.
+  int64_t response_bytes = 0;
+};
+
 /// Response is an HTTP response.
 struct Response {
   /// error is the CURL error that occurred. In CURL this is an enum hence it
@@ -91,686 +446,6001 @@ struct Response {
   /// body is the response body.
   std::string body;
 
-  /// bytes_sent are the bytes sent when sending the request.
+  /// bytes_sent are the bytes sent when sending the request. It is always
+  /// zero with MKCURL_NO_BYTE_COUNTING.
   int64_t bytes_sent = 0;
 
-  /// bytes_recv are the bytes recv when receiving the response.
+  /// bytes_recv are the bytes recv when receiving the response. It is always
+  /// zero with MKCURL_NO_BYTE_COUNTING.
   int64_t bytes_recv = 0;
 
   // logs contains the (possibly non UTF-8) logs.
-  std::vector<Log> logs;
+  Logs logs;
 
-  // request_headers contains the request line and the headers.
+  // request_headers contains the request line and the headers. With both
+  // MKCURL_NO_LOGS and MKCURL_NO_BYTE_COUNTING, it is empty unless we are
+  // tracing or recording, because we do not ask cURL for debug data.
   std::string request_headers;
 
   // response_headers contains the response line and the headers.
   std::string response_headers;
 
-  // certs contains a sequence of newline separated PEM certificates.
+  // header_fields indexes the headers in response_headers, in the order
+  // in which we received them. Use header_value and header_values to
+  // search for a specific header.
+  std::vector<HeaderField> header_fields;
+
+  // header_hops contains, for each response line in response_headers,
+  // i.e., for each redirect hop, the index of its first header in
+  // header_fields. The headers of a hop end where the next hop begins.
+  std::vector<size_t> header_hops;
+
+#ifndef MKCURL_NO_CERT_CAPTURE
+  // certs contains a sequence of newline separated PEM certificates, if
+  // Request::cert_capture is CertCapture::pem.
   std::string certs;
 
+  // cert_chain contains the certificates sent by the server, starting from
+  // the leaf, unless Request::cert_capture is CertCapture::none.
+  std::vector<Certificate> cert_chain;
+#endif
+
   // content_type is the response content type.
   std::string content_type;
 
   // http_version is the HTTP version.
   std::string http_version;
+
+  // cache_status is "hit" when the response was served from the Cache
+  // without contacting the server, "revalidated" when the server told us
+  // that our cached copy was still valid (i.e. 304), "miss" when we had
+  // to fetch the response, and empty when no Cache was used.
+  std::string cache_status;
+
+  // primary_ip is the IP address we were connected to.
+  std::string primary_ip;
+
+  // primary_port is the port we were connected to.
+  int64_t primary_port = 0;
+
+  // local_ip is the local IP address of the connection.
+  std::string local_ip;
+
+  // local_port is the local port of the connection.
+  int64_t local_port = 0;
+
+  // ip_family is "ipv4" or "ipv6" depending on primary_ip, or "unix" when
+  // using Request::unix_socket_path.
+  std::string ip_family;
+
+  // ipv4_connects is the number of IPv4 sockets we opened to connect. It
+  // is zero when we reused an existing connection.
+  int64_t ipv4_connects = 0;
+
+  // ipv6_connects is like ipv4_connects but for IPv6 sockets.
+  int64_t ipv6_connects = 0;
+
+  // connection_reused indicates whether cURL did not open any connection
+  // for the request, i.e., it reused existing connections for all hops.
+  bool connection_reused = false;
+
+  // connection_id identifies the connection used by the last hop among the
+  // connections opened by the same Client, which numbers them from one. It
+  // is zero when unknown, e.g., if the connection was closed by the end of
+  // the request, in which case it cannot be reused anyway.
+  int64_t connection_id = 0;
+
+  // family_fallback indicates whether we tried to connect using both IPv4
+  // and IPv6, meaning that cURL raced the two families (Happy Eyeballs).
+  bool family_fallback = false;
+
+  // tcp_info_connect is the TCP_INFO read once connected, before sending
+  // the request, if Request::enable_tcp_info is true. When we're reusing a
+  // connection, this is the state at the beginning of the transfer.
+  TCPInfo tcp_info_connect;
+
+  // tcp_info_end is the TCP_INFO read at the end of the transfer, or just
+  // before closing the connection, if Request::enable_tcp_info is true.
+  TCPInfo tcp_info_end;
+
+  // progress contains the progress samples, if Request::progress_interval_ms
+  // is positive. The last sample is taken at the end of the transfer.
+  std::vector<ProgressSample> progress;
+
+  // body_truncated indicates that body only contains the first
+  // Request::max_body_size bytes of the response body.
+  bool body_truncated = false;
+
+  // queue_wait_us is the time the request waited in the Engine queue before
+  // starting, in microseconds. It is zero when not using an Engine.
+  int64_t queue_wait_us = 0;
+
+  // hedged indicates whether a Hedger started a second attempt.
+  bool hedged = false;
+
+  // hedge_winner is the attempt that produced this response when using a
+  // Hedger: zero for the first attempt and one for the second attempt.
+  int64_t hedge_winner = 0;
+
+  // throttled_us is the time the transfer has been held back by a
+  // RateLimiter, in microseconds.
+  int64_t throttled_us = 0;
+
+  // memory tells where the memory used by the request goes.
+  MemoryStats memory;
 };
 
-/// Client is an HTTP client. This class is movable but not copyable because
-/// at any give moment we want only a single client instance.
-///
-/// This is because a Client wraps a cURL handle and:
-///
-///   Handles. You must never share the same handle in multiple threads. You
-///   can pass the handles around among threads, but you must never use a single
-///   handle from more than one thread at any given time.
+/// header_last_hop selects the last hop (i.e., the final response) when
+/// passed to header_value or header_values.
+constexpr size_t header_last_hop = SIZE_MAX;
+
+/// header_value returns the value of the first header of @p res called
+/// @p name, using a case insensitive comparison, in the redirect hop @p hop,
+/// or the empty string.
+std::string header_value(const Response &res, const std::string &name,
+                         size_t hop = header_last_hop) noexcept;
+
+/// header_values is like header_value but returns the values of all the
+/// headers called @p name, in the order in which we received them.
+std::vector<std::string> header_values(
+    const Response &res, const std::string &name,
+    size_t hop = header_last_hop) noexcept;
+
+/// Cache is a cache of HTTP responses that honours Cache-Control and Expires
+/// and revalidates stale responses using If-None-Match and If-Modified-Since.
+/// Only successful GET requests are cached. Responses are kept in memory
+/// using a LRU policy and, optionally, also on disk.
 ///
-/// (see <https://curl.haxx.se/libcurl/c/threadsafe.html>) hence having single
-/// ownership in place guarantees that we cannot make such mistakes.
-class Client {
+/// A Cache is thread safe and may be shared by several Clients.
+class Cache {
  public:
-  /// Client creates a new client.
-  Client() noexcept;
-
-  /// Client is the deleted copy constructor.
-  Client(const Client &) noexcept = delete;
+  /// Cache creates a new cache holding at most @p max_entries responses
+  /// in memory. If @p disk_path is not empty, it must be the path of an
+  /// existing directory in which we'll also save responses, such that
+  /// they survive evictions and restarts.
+  explicit Cache(size_t max_entries = 64, std::string disk_path = "") noexcept;
 
-  /// Client is the deleted copy assignment.
-  Client &operator=(const Client &) noexcept = delete;
+  /// Cache is the deleted copy constructor.
+  Cache(const Cache &) noexcept = delete;
 
-  /// Client is the move constructor.
-  Client(Client &&) noexcept;
+  /// Cache is the deleted copy assignment.
+  Cache &operator=(const Cache &) noexcept = delete;
 
-  /// Client is the move assignment.
-  Client &operator=(Client &&) noexcept;
+  /// Cache is the deleted move constructor.
+  Cache(Cache &&) noexcept = delete;
 
-  /// ~Client is the destructor.
-  ~Client() noexcept;
+  /// Cache is the deleted move assignment.
+  Cache &operator=(Cache &&) noexcept = delete;
 
-  /// perform performs @p request and returns the Response.
-  Response perform(const Request &request) noexcept;
+  /// ~Cache is the destructor.
+  ~Cache() noexcept;
 
  private:
-  // Impl is the implementation of a client.
+  friend class Client;
+
+  // Impl is the implementation of a cache.
   class Impl;
 
   // impl_ is a unique pointer to the opaque implementation.
   std::unique_ptr<Impl> impl_;
 };
 
-/// perform performs @p request and returns the Response.
-Response perform(const Request &request) noexcept;
+/// TrustStore is a CA bundle loaded in memory. Loading it once and sharing it
+/// among Clients avoids reading the bundle from disk for every new cURL handle
+/// because we pass the bundle to cURL using CURLOPT_CAINFO_BLOB. The TLS
+/// backend still parses the bundle for every new connection, unless we are
+/// compiled with MKCURL_OPENSSL and libcurl uses OpenSSL at runtime, in
+/// which case we parse the bundle once and share the parsed certificates.
+///
+/// A TrustStore is immutable, thread safe and can be shared by Clients.
+class TrustStore {
+ public:
+  /// from_file returns the TrustStore for the CA bundle at @p path. The
+  /// bundle is read only once per process: if a TrustStore for @p path is
+  /// still alive, we return it rather than reading the file again. @return
+  /// a null pointer if the file cannot be read.
+  static std::shared_ptr<TrustStore> from_file(
+      const std::string &path) noexcept;
 
-}  // inline namespace MKCURL_INLINE_NAMESPACE
-}  // namespace curl
-}  // namespace mk
+  /// from_memory returns a new TrustStore using the PEM encoded
+  /// CA certificates contained in @p bundle.
+  static std::shared_ptr<TrustStore> from_memory(std::string bundle) noexcept;
 
-// If you just want to know about the API, you can stop reading here. What
-// follows is the inline implementation of the library. By default it is not
-// included when you include the header, but you can change this.
-#ifdef MKCURL_INLINE_IMPL
+  /// TrustStore is the deleted copy constructor.
+  TrustStore(const TrustStore &) noexcept = delete;
 
-#include <assert.h>
+  /// TrustStore is the deleted copy assignment.
+  TrustStore &operator=(const TrustStore &) noexcept = delete;
 
-#include <algorithm>
-#include <chrono>
-#include <sstream>
+  /// TrustStore is the deleted move constructor.
+  TrustStore(TrustStore &&) noexcept = delete;
 
-#include <curl/curl.h>
+  /// TrustStore is the deleted move assignment.
+  TrustStore &operator=(TrustStore &&) noexcept = delete;
 
-#include "mkmock.hpp"
+  /// ~TrustStore is the destructor.
+  ~TrustStore() noexcept;
 
-// MKCURL_MOCK controls whether to enable mocking
-#ifdef MKCURL_MOCK
-#define MKCURL_HOOK MKMOCK_HOOK_ENABLED
-#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_ENABLED
-#else
-#define MKCURL_HOOK MKMOCK_HOOK_DISABLED
-#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_DISABLED
-#endif
+  /// size returns the size of the CA bundle in bytes.
+  size_t size() const noexcept;
 
-#ifndef MKCURL_ABORT
-// MKCURL_ABORT allows to mock abort
-#define MKCURL_ABORT abort
-#endif
+  /// Impl is the opaque implementation of a trust store.
+  class Impl;
 
-namespace mk {
-namespace curl {
-inline namespace MKCURL_INLINE_NAMESPACE {
+ private:
+  friend class Client;
 
-// mkcurl_log appends @p line to @p logs. It adds information on the current
-// time in millisecond. It also appends a newline to the end of the line.
-static void mkcurl_log(std::vector<Log> &logs, std::string &&line) {
-  auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
-      std::chrono::steady_clock::now().time_since_epoch());
-  Log log;
-  log.msec = now.count();
-  std::swap(line, log.line);
-  logs.push_back(std::move(log));
-}
+  // TrustStore is the private constructor.
+  TrustStore() noexcept;
 
-// mkcurl_deleter is a custom deleter for a CURL handle.
-struct mkcurl_deleter {
-  void operator()(CURL *handle) { curl_easy_cleanup(handle); }
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
 };
 
-// mkcurl_uptr is a unique pointer to a CURL handle.
-using mkcurl_uptr = std::unique_ptr<CURL, mkcurl_deleter>;
-
-// Client::Impl contains the implementation of a client.
-class Client::Impl {
+/// SessionStore remembers the addresses of the servers we've connected to and
+/// the TLS sessions they gave us. It can be saved to a file when the process
+/// exits and loaded when the next process starts, such that the next process
+/// can skip DNS lookups and resume TLS sessions rather than starting cold.
+///
+/// Addresses are recorded after every successful request and expire after
+/// the configured TTL. TLS sessions are collected from a Client when it is
+/// destroyed, and only if cURL supports exporting sessions (cURL >= 8.12.0
+/// compiled with such support). A SessionStore is thread safe and can be
+/// shared by several Clients.
+class SessionStore {
  public:
-  mkcurl_uptr handle;
-  Impl() noexcept = default;
-  Impl(const Impl &) noexcept = delete;
-  Impl &operator=(const Impl &) noexcept = delete;
-  Impl(Impl &&) noexcept = delete;
-  Impl &operator=(Impl &&) noexcept = delete;
-  ~Impl() noexcept;
+  /// SessionStore creates an empty store where addresses expire after
+  /// @p dns_ttl seconds.
+  explicit SessionStore(int64_t dns_ttl = 300) noexcept;
+
+  /// SessionStore is the deleted copy constructor.
+  SessionStore(const SessionStore &) noexcept = delete;
+
+  /// SessionStore is the deleted copy assignment.
+  SessionStore &operator=(const SessionStore &) noexcept = delete;
+
+  /// SessionStore is the deleted move constructor.
+  SessionStore(SessionStore &&) noexcept = delete;
+
+  /// SessionStore is the deleted move assignment.
+  SessionStore &operator=(SessionStore &&) noexcept = delete;
+
+  /// ~SessionStore is the destructor.
+  ~SessionStore() noexcept;
+
+  /// load adds to the store the non expired entries saved in @p path by a
+  /// previous call to save. @return false on failure.
+  bool load(const std::string &path) noexcept;
+
+  /// save saves the non expired entries into @p path. @return false
+  /// on failure.
+  bool save(const std::string &path) const noexcept;
+
+  /// Impl is the opaque implementation of a session store.
+  class Impl;
+
+ private:
+  friend class Client;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
 };
-Client::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
 
-// mkcurl_slist is a curl_slist with RAII semantic.
-struct mkcurl_slist {
-  // mkcurl_slist is the default constructor.
-  mkcurl_slist() = default;
-  // mkcurl_slist is the deleted copy constructor.
-  mkcurl_slist(const mkcurl_slist &) = delete;
-  // operator= is the deleted copy assignment.
-  mkcurl_slist &operator=(const mkcurl_slist &) = delete;
-  // mkcurl_slist is the deleted move constructor.
-  mkcurl_slist(mkcurl_slist &&) = delete;
-  // operator= is the deleted move assignment.
-  mkcurl_slist &operator=(mkcurl_slist &&) = delete;
-  // ~mkcurl_slist is the destructor.
-  ~mkcurl_slist() { curl_slist_free_all(p); }
-  // p is the pointer to the wrapped slist.
-  curl_slist *p = nullptr;
+/// CircuitState is the state of the circuit of a host.
+enum class CircuitState {
+  closed,     ///< requests are performed
+  open,       ///< requests fail immediately
+  half_open,  ///< a single probe request is performed
 };
 
-}  // inline namespace MKCURL_INLINE_NAMESPACE
-}  // namespace curl
-}  // namespace mk
+/// CircuitBreakerSettings contains the settings of a CircuitBreaker.
+struct CircuitBreakerSettings {
+  /// failure_threshold is the number of consecutive DNS or connect failures
+  /// after which the circuit of a host opens.
+  int64_t failure_threshold = 5;
 
-extern "C" {
+  /// cooldown_ms is the time after which an open circuit lets a single probe
+  /// request through (in milliseconds).
+  int64_t cooldown_ms = 30000;
+};
 
-static size_t mkcurl_body_cb_(
-    char *ptr, size_t size, size_t nmemb, void *userdata) {
-  if (nmemb <= 0) {
+/// CircuitBreakerStats contains the state transitions counted by a
+/// CircuitBreaker, summed over all hosts.
+struct CircuitBreakerStats {
+  /// opened is the number of times a circuit has opened.
+  int64_t opened = 0;
+
+  /// half_opened is the number of times a circuit has let a probe through.
+  int64_t half_opened = 0;
+
+  /// closed is the number of times a probe succeeded and closed a circuit.
+  int64_t closed = 0;
+
+  /// fast_failed is the number of requests failed with error_circuit_open.
+  int64_t fast_failed = 0;
+};
+
+/// CircuitBreaker stops performing requests towards a `host:port` that is
+/// failing, such that we don't pay DNS, connect timeouts and retries for each
+/// request during an outage. After failure_threshold consecutive DNS or
+/// connect failures the circuit opens and requests fail immediately with
+/// error_circuit_open. After cooldown_ms the circuit becomes half open and
+/// lets a single probe request through: if it connects, the circuit closes,
+/// otherwise it opens again. A CircuitBreaker is thread safe and can be
+/// shared by several Clients.
+class CircuitBreaker {
+ public:
+  /// CircuitBreaker creates a new CircuitBreaker using @p settings.
+  explicit CircuitBreaker(
+      CircuitBreakerSettings settings = CircuitBreakerSettings{}) noexcept;
+
+  /// CircuitBreaker is the deleted copy constructor.
+  CircuitBreaker(const CircuitBreaker &) noexcept = delete;
+
+  /// CircuitBreaker is the deleted copy assignment.
+  CircuitBreaker &operator=(const CircuitBreaker &) noexcept = delete;
+
+  /// CircuitBreaker is the deleted move constructor.
+  CircuitBreaker(CircuitBreaker &&) noexcept = delete;
+
+  /// CircuitBreaker is the deleted move assignment.
+  CircuitBreaker &operator=(CircuitBreaker &&) noexcept = delete;
+
+  /// ~CircuitBreaker is the destructor.
+  ~CircuitBreaker() noexcept;
+
+  /// state returns the state of the circuit of @p host and @p port.
+  CircuitState state(const std::string &host, int64_t port) const noexcept;
+
+  /// stats returns the state transitions counted so far.
+  CircuitBreakerStats stats() const noexcept;
+
+  /// Impl is the opaque implementation of a circuit breaker.
+  class Impl;
+
+ private:
+  friend class Client;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// RateLimits contains the limits enforced by a RateLimiter. A limit that is
+/// zero or negative means no limit.
+struct RateLimits {
+  /// download_bytes_per_second limits the received body bytes.
+  int64_t download_bytes_per_second = 0;
+
+  /// upload_bytes_per_second limits the sent body bytes.
+  int64_t upload_bytes_per_second = 0;
+
+  /// requests_per_second limits the number of started requests.
+  int64_t requests_per_second = 0;
+};
+
+/// RateLimiterSettings contains the settings of a RateLimiter.
+struct RateLimiterSettings {
+  /// total contains the limits shared by all the requests.
+  RateLimits total;
+
+  /// background contains the limits of the Priority::background requests,
+  /// which apply in addition to the total limits.
+  RateLimits background;
+
+  /// normal contains the limits of the Priority::normal requests.
+  RateLimits normal;
+
+  /// interactive contains the limits of the Priority::interactive requests.
+  RateLimits interactive;
+
+  /// burst_ms is how much unused budget we keep, in milliseconds of the
+  /// rate, such that short bursts are not throttled.
+  int64_t burst_ms = 100;
+};
+
+/// RateLimiter limits the bandwidth and the request rate of all the Clients
+/// and Engines using it, such that, e.g., background uploads do not saturate
+/// the link while other transfers are running. It is a set of token buckets,
+/// one for the total limits and one for each priority class. A Client waits
+/// inside the cURL callbacks when over budget, while an Engine pauses the
+/// transfer and resumes it later. The time spent waiting is reported in
+/// Response::throttled_us. A RateLimiter is thread safe.
+class RateLimiter {
+ public:
+  /// RateLimiter creates a new RateLimiter using @p settings.
+  explicit RateLimiter(
+      RateLimiterSettings settings = RateLimiterSettings{}) noexcept;
+
+  /// RateLimiter is the deleted copy constructor.
+  RateLimiter(const RateLimiter &) noexcept = delete;
+
+  /// RateLimiter is the deleted copy assignment.
+  RateLimiter &operator=(const RateLimiter &) noexcept = delete;
+
+  /// RateLimiter is the deleted move constructor.
+  RateLimiter(RateLimiter &&) noexcept = delete;
+
+  /// RateLimiter is the deleted move assignment.
+  RateLimiter &operator=(RateLimiter &&) noexcept = delete;
+
+  /// ~RateLimiter is the destructor.
+  ~RateLimiter() noexcept;
+
+  /// Impl is the opaque implementation of a rate limiter.
+  class Impl;
+
+ private:
+  friend class Client;
+  friend class Engine;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// MetricsHistogram is a log-linear histogram of durations, where each power
+/// of two is split into four buckets of equal width.
+struct MetricsHistogram {
+  /// bounds contains the inclusive upper bound of each bucket, in
+  /// microseconds, except for the last bucket, which has no bound.
+  std::vector<int64_t> bounds;
+
+  /// counts contains the number of samples of each bucket, including the
+  /// last one, hence it has one more element than bounds.
+  std::vector<int64_t> counts;
+
+  /// count is the number of samples.
+  int64_t count = 0;
+
+  /// sum_us is the sum of the samples, in microseconds.
+  int64_t sum_us = 0;
+};
+
+/// MetricsSnapshot contains the metrics collected by a Metrics.
+struct MetricsSnapshot {
+  /// requests is the number of performed requests.
+  int64_t requests = 0;
+
+  /// retries is the number of retries after DNS or connect failures.
+  int64_t retries = 0;
+
+  /// bytes_sent is the sum of Response::bytes_sent.
+  int64_t bytes_sent = 0;
+
+  /// bytes_recv is the sum of Response::bytes_recv.
+  int64_t bytes_recv = 0;
+
+  /// connections_opened is the number of new connections.
+  int64_t connections_opened = 0;
+
+  /// connections_reused is the number of requests that reused a connection.
+  int64_t connections_reused = 0;
+
+  /// errors maps each nonzero Response::error to its number of occurrences.
+  std::map<int64_t, int64_t> errors;
+
+  /// status_codes maps each HTTP status code to its number of occurrences.
+  std::map<int64_t, int64_t> status_codes;
+
+  /// total is the histogram of the duration of the transfers.
+  MetricsHistogram total;
+
+  /// first_byte is the histogram of the time to first byte.
+  MetricsHistogram first_byte;
+
+  /// connect is the histogram of the time to connect, for new connections.
+  MetricsHistogram connect;
+
+  /// tls is the histogram of the TLS handshake time, for new connections.
+  MetricsHistogram tls;
+};
+
+/// Metrics aggregates the metrics of all the requests performed by the Clients
+/// and Engines using it. Each Client and Engine records into its own set of
+/// counters, which are only merged when taking a snapshot, such that the cost
+/// of recording is small and there is no contention. A Metrics is thread safe.
+class Metrics {
+ public:
+  /// Metrics creates a new Metrics.
+  Metrics() noexcept;
+
+  /// Metrics is the deleted copy constructor.
+  Metrics(const Metrics &) noexcept = delete;
+
+  /// Metrics is the deleted copy assignment.
+  Metrics &operator=(const Metrics &) noexcept = delete;
+
+  /// Metrics is the deleted move constructor.
+  Metrics(Metrics &&) noexcept = delete;
+
+  /// Metrics is the deleted move assignment.
+  Metrics &operator=(Metrics &&) noexcept = delete;
+
+  /// ~Metrics is the destructor.
+  ~Metrics() noexcept;
+
+  /// snapshot returns the metrics collected so far.
+  MetricsSnapshot snapshot() const noexcept;
+
+  /// Impl is the opaque implementation of Metrics.
+  class Impl;
+
+ private:
+  friend class Client;
+  friend class Engine;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// metrics_prometheus formats @p snapshot using the Prometheus text format.
+std::string metrics_prometheus(const MetricsSnapshot &snapshot) noexcept;
+
+/// metrics_json formats @p snapshot as a JSON object.
+std::string metrics_json(const MetricsSnapshot &snapshot) noexcept;
+
+/// Tracer records the phases of the requests performed by the Clients and
+/// Engines using it, such that they can be viewed on a timeline. Each request
+/// is a row containing a span for each attempt, including the retries, and,
+/// within each attempt, a span for each redirect hop. Each hop contains the
+/// dns, connect, tls, request and response phases, where request is the time
+/// from sending the request to receiving the first byte. Hops have attributes
+/// such as the URL, the connection, whether it was reused and the bytes sent
+/// and received. A Tracer is thread safe.
+class Tracer {
+ public:
+  /// Tracer creates a new Tracer. Times are relative to its creation.
+  Tracer() noexcept;
+
+  /// Tracer is the deleted copy constructor.
+  Tracer(const Tracer &) noexcept = delete;
+
+  /// Tracer is the deleted copy assignment.
+  Tracer &operator=(const Tracer &) noexcept = delete;
+
+  /// Tracer is the deleted move constructor.
+  Tracer(Tracer &&) noexcept = delete;
+
+  /// Tracer is the deleted move assignment.
+  Tracer &operator=(Tracer &&) noexcept = delete;
+
+  /// ~Tracer is the destructor.
+  ~Tracer() noexcept;
+
+  /// json returns the spans recorded so far using the Chrome trace event
+  /// format, which can be opened with chrome://tracing or with Perfetto.
+  std::string json() const noexcept;
+
+  /// save writes json() into @p path. @return false on failure.
+  bool save(const std::string &path) const noexcept;
+
+  /// Impl is the opaque implementation of a Tracer.
+  class Impl;
+
+ private:
+  friend class Client;
+  friend class Engine;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// RecordingMode tells a Client what to do with its Recording.
+enum class RecordingMode {
+  /// record appends the exchange of each request to the Recording.
+  record,
+
+  /// replay serves each request using the next exchange of the Recording,
+  /// as fast as possible and without using the network.
+  replay,
+
+  /// replay_timed is like replay but respects the recorded timing.
+  replay_timed
+};
+
+/// Recording contains the raw HTTP/1.1 exchanges of the requests performed
+/// by a Client, such that we can replay them later, bit for bit, to run
+/// benchmarks and regression tests offline. When recording we capture what
+/// cURL writes to and reads from the connection, after TLS. When replaying
+/// we redirect cURL to a loopback listener private to the request, and serve
+/// the next exchange over it from a background thread. Hence, replayed
+/// requests use plaintext HTTP/1.1 and do not reuse connections, and https
+/// URLs are only supported for the initial request. A Recording is thread
+/// safe.
+class Recording {
+ public:
+  /// Recording creates an empty Recording.
+  Recording() noexcept;
+
+  /// Recording is the deleted copy constructor.
+  Recording(const Recording &) noexcept = delete;
+
+  /// Recording is the deleted copy assignment.
+  Recording &operator=(const Recording &) noexcept = delete;
+
+  /// Recording is the deleted move constructor.
+  Recording(Recording &&) noexcept = delete;
+
+  /// Recording is the deleted move assignment.
+  Recording &operator=(Recording &&) noexcept = delete;
+
+  /// ~Recording is the destructor.
+  ~Recording() noexcept;
+
+  /// size returns the number of recorded exchanges.
+  size_t size() const noexcept;
+
+  /// rewind makes the next replayed request use the first exchange again.
+  void rewind() noexcept;
+
+  /// load adds to this Recording the exchanges saved in @p path by a
+  /// previous call to save. @return false on failure.
+  bool load(const std::string &path) noexcept;
+
+  /// save saves the exchanges into @p path. @return false on failure.
+  bool save(const std::string &path) const noexcept;
+
+  /// Impl is the opaque implementation of a Recording.
+  class Impl;
+
+ private:
+  friend class Client;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// ConnectionPoolSettings configures how a Client keeps the connections
+/// open to reuse them. The zero value of each field means using the cURL
+/// default.
+struct ConnectionPoolSettings {
+  /// max_connections is the maximum number of connections kept open. When
+  /// it needs room for a new connection, cURL closes the oldest idle one.
+  int64_t max_connections = 0;
+
+  /// max_idle_seconds is the maximum time a connection can stay idle and
+  /// still be reused (requires cURL >= 7.65.0). The cURL default is 118
+  /// seconds.
+  int64_t max_idle_seconds = 0;
+
+  /// max_age_seconds is the maximum time since a connection was opened
+  /// after which we do not reuse it anymore (requires cURL >= 7.80.0).
+  int64_t max_age_seconds = 0;
+};
+
+/// Client is an HTTP client. This class is movable but not copyable because
+/// at any give moment we want only a single client instance.
+///
+/// This is because a Client wraps a cURL handle and:
+///
+///   Handles. You must never share the same handle in multiple threads. You
+///   can pass the handles around among threads, but you must never use a single
+///   handle from more than one thread at any given time.
+///
+/// (see <https://curl.haxx.se/libcurl/c/threadsafe.html>) hence having single
+/// ownership in place guarantees that we cannot make such mistakes.
+class Client {
+ public:
+  /// Client creates a new client.
+  Client() noexcept;
+
+  /// Client is the deleted copy constructor.
+  Client(const Client &) noexcept = delete;
+
+  /// Client is the deleted copy assignment.
+  Client &operator=(const Client &) noexcept = delete;
+
+  /// Client is the move constructor.
+  Client(Client &&) noexcept;
+
+  /// Client is the move assignment.
+  Client &operator=(Client &&) noexcept;
+
+  /// ~Client is the destructor.
+  ~Client() noexcept;
+
+  /// perform performs @p request and returns the Response.
+  Response perform(const Request &request) noexcept;
+
+  /// perform is like perform(const Request &) except that it takes ownership
+  /// of @p request, such that it can be modified rather than copied if we
+  /// need to add headers, e.g., to revalidate a cached response.
+  Response perform(Request &&request) noexcept;
+
+  /// perform performs @p request and writes the result into @p response. This
+  /// is meant to be used in loops, to avoid reallocating memory for every
+  /// response: the existing content of @p response is cleared, but the memory
+  /// already allocated by its strings and vectors is reused.
+  void perform(const Request &request, Response &response) noexcept;
+
+  /// set_cache configures the client to use @p cache for GET requests. Pass
+  /// a null pointer to stop using a cache.
+  void set_cache(std::shared_ptr<Cache> cache) noexcept;
+
+  /// set_trust_store configures the client to use @p trust_store to verify
+  /// the server certificates, unless Request::ca_path is set. Pass a null
+  /// pointer to stop using a TrustStore.
+  void set_trust_store(std::shared_ptr<TrustStore> trust_store) noexcept;
+
+  /// set_session_store configures the client to use and update @p store. Pass
+  /// a null pointer to stop using a SessionStore.
+  void set_session_store(std::shared_ptr<SessionStore> store) noexcept;
+
+  /// set_resolve sets the addresses to use for some hosts in all the requests
+  /// performed by this client, replacing the previously set entries.
+  void set_resolve(std::vector<ResolveEntry> entries) noexcept;
+
+  /// set_circuit_breaker configures the client to use @p breaker. Pass a
+  /// null pointer to stop using a CircuitBreaker.
+  void set_circuit_breaker(std::shared_ptr<CircuitBreaker> breaker) noexcept;
+
+  /// set_rate_limiter configures the client to use @p limiter. Pass a null
+  /// pointer to stop using a RateLimiter.
+  void set_rate_limiter(std::shared_ptr<RateLimiter> limiter) noexcept;
+
+  /// set_metrics configures the client to record into @p metrics. Pass a null
+  /// pointer to stop recording.
+  void set_metrics(std::shared_ptr<Metrics> metrics) noexcept;
+
+  /// set_tracer configures the client to record spans into @p tracer. Pass a
+  /// null pointer to stop tracing.
+  void set_tracer(std::shared_ptr<Tracer> tracer) noexcept;
+
+  /// set_connection_pool configures how the client reuses connections. The
+  /// new settings apply starting from the next request.
+  void set_connection_pool(ConnectionPoolSettings settings) noexcept;
+
+  /// set_recording configures the client to record the requests into, or
+  /// to replay them from, @p recording, depending on @p mode. Pass a null
+  /// pointer to go back to using the network normally.
+  void set_recording(std::shared_ptr<Recording> recording,
+                     RecordingMode mode = RecordingMode::record) noexcept;
+
+ private:
+  friend class Hedger;
+  friend class SingleFlight;
+
+  // Impl is the implementation of a client.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// SingleFlightStats contains statistics collected by a SingleFlight.
+struct SingleFlightStats {
+  /// transfers is the number of transfers that were actually performed.
+  int64_t transfers = 0;
+
+  /// collapsed is the number of requests that did not perform any transfer
+  /// because they shared the transfer of an identical request.
+  int64_t collapsed = 0;
+};
+
+/// SingleFlight coalesces identical concurrent GET requests, such that only
+/// one of them actually performs the transfer and all the others wait for it
+/// and share its Response. Two requests are identical when they have the same
+/// URL, headers, connect_to and any other setting that could change the
+/// returned response. Requests other than GET are always performed.
+///
+/// Requests coalesce only when they use the same CancellationToken, or none,
+/// such that cancelling a request does not cancel unrelated requests. A
+/// request waiting for another one stops waiting once it is cancelled.
+/// Likewise, requests coalesce only when their Clients use the same resolve
+/// overrides, TrustStore, SessionStore, Cache and Recording.
+///
+/// A SingleFlight is thread safe and it is meant to be shared by several
+/// threads, each of which is using its own Client.
+class SingleFlight {
+ public:
+  /// SingleFlight creates a new SingleFlight.
+  SingleFlight() noexcept;
+
+  /// SingleFlight is the deleted copy constructor.
+  SingleFlight(const SingleFlight &) noexcept = delete;
+
+  /// SingleFlight is the deleted copy assignment.
+  SingleFlight &operator=(const SingleFlight &) noexcept = delete;
+
+  /// SingleFlight is the deleted move constructor.
+  SingleFlight(SingleFlight &&) noexcept = delete;
+
+  /// SingleFlight is the deleted move assignment.
+  SingleFlight &operator=(SingleFlight &&) noexcept = delete;
+
+  /// ~SingleFlight is the destructor.
+  ~SingleFlight() noexcept;
+
+  /// perform performs @p request using @p client, unless an identical request
+  /// is already in flight, in which case it waits for such request to finish
+  /// and returns the same Response, without copying it.
+  std::shared_ptr<const Response> perform(
+      Client &client, const Request &request) noexcept;
+
+  /// stats returns the statistics collected so far.
+  SingleFlightStats stats() const noexcept;
+
+ private:
+  // Impl is the implementation of a SingleFlight.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// HedgeSettings contains the settings of a Hedger.
+struct HedgeSettings {
+  /// delay_ms is the time after which, if the first attempt has not received
+  /// any byte yet, we start a second attempt (in milliseconds).
+  int64_t delay_ms = 100;
+
+  /// percentile, if positive, means that the delay is the given percentile
+  /// (e.g. 95) of the time to first byte of recent requests, rather than
+  /// delay_ms. We use delay_ms until we have collected min_samples.
+  int64_t percentile = 0;
+
+  /// window is the number of recent requests we remember.
+  size_t window = 128;
+
+  /// min_samples is the number of samples needed to use percentile.
+  size_t min_samples = 16;
+
+  /// min_delay_ms is the minimum delay when using percentile, such that we
+  /// don't hedge most requests when the latency is very low.
+  int64_t min_delay_ms = 10;
+
+  /// alternate_connect_to, if not empty, is the Request::connect_to to use
+  /// for the second attempt, e.g., to reach another replica.
+  std::string alternate_connect_to;
+};
+
+/// Hedger performs GET requests and, if the server is slow to respond,
+/// starts a second identical request (i.e. it hedges), returns the response
+/// of the attempt that completes first and cancels the other one. Other
+/// methods are performed normally. When the first attempt fails before the
+/// delay expires, we start the second attempt immediately. Request::retries
+/// is ignored, because the second attempt takes the place of a retry. The
+/// Client's RateLimiter accounts both attempts, while its CircuitBreaker is
+/// checked once and sees the outcome of the winner. The Client's Cache is
+/// not used. The Client keeps the connections opened by the Hedger, which
+/// later calls of Hedger::perform with the same Client reuse, but they are
+/// distinct from the connections used by Client::perform.
+///
+/// A Hedger is thread safe and it is meant to be shared by several
+/// threads, each of which is using its own Client.
+class Hedger {
+ public:
+  /// Hedger creates a Hedger using @p settings.
+  explicit Hedger(HedgeSettings settings = HedgeSettings{}) noexcept;
+
+  /// Hedger is the deleted copy constructor.
+  Hedger(const Hedger &) noexcept = delete;
+
+  /// Hedger is the deleted copy assignment.
+  Hedger &operator=(const Hedger &) noexcept = delete;
+
+  /// Hedger is the deleted move constructor.
+  Hedger(Hedger &&) noexcept = delete;
+
+  /// Hedger is the deleted move assignment.
+  Hedger &operator=(Hedger &&) noexcept = delete;
+
+  /// ~Hedger is the destructor.
+  ~Hedger() noexcept;
+
+  /// perform performs @p request using @p client, possibly hedging.
+  Response perform(Client &client, const Request &request) noexcept;
+
+  /// delay_ms returns the current hedging delay in milliseconds.
+  int64_t delay_ms() const noexcept;
+
+ private:
+  // Impl is the implementation of a Hedger.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// EngineSettings contains the settings of an Engine.
+struct EngineSettings {
+  /// max_host_connections is the maximum number of concurrent transfers,
+  /// and of connections, for each host and port.
+  int64_t max_host_connections = 6;
+
+  /// max_total_connections is the maximum number of concurrent transfers,
+  /// and of connections, overall.
+  int64_t max_total_connections = 32;
+
+  /// background_weight is the weight of Priority::background.
+  int64_t background_weight = 1;
+
+  /// normal_weight is the weight of Priority::normal.
+  int64_t normal_weight = 4;
+
+  /// interactive_weight is the weight of Priority::interactive.
+  int64_t interactive_weight = 16;
+
+  /// rate_limiter, if set, limits the bandwidth and the request rate.
+  std::shared_ptr<RateLimiter> rate_limiter;
+
+  /// metrics, if set, is where we record the metrics of the requests.
+  std::shared_ptr<Metrics> metrics;
+
+  /// tracer, if set, is where we record the phases of the requests.
+  std::shared_ptr<Tracer> tracer;
+};
+
+/// Engine performs many requests concurrently using a background thread and
+/// a cURL multi handle. Requests are queued and started when there are free
+/// slots, both overall and for their host and port, such that a slow host
+/// cannot take all the slots. When several priority classes have requests
+/// ready to start, each class gets a share of the free slots proportional to
+/// its weight (i.e. weighted fair queueing). An Engine is thread safe.
+class Engine {
+ public:
+  /// Callback is called with the Response of a submitted request. It is
+  /// called from the Engine thread, hence it must not throw and it should
+  /// not block for long, since that would delay all the other transfers.
+  using Callback = std::function<void(Response &&)>;
+
+  /// Engine creates an Engine and starts its thread.
+  explicit Engine(EngineSettings settings = EngineSettings{}) noexcept;
+
+  /// Engine is the deleted copy constructor.
+  Engine(const Engine &) noexcept = delete;
+
+  /// Engine is the deleted copy assignment.
+  Engine &operator=(const Engine &) noexcept = delete;
+
+  /// Engine is the deleted move constructor.
+  Engine(Engine &&) noexcept = delete;
+
+  /// Engine is the deleted move assignment.
+  Engine &operator=(Engine &&) noexcept = delete;
+
+  /// ~Engine waits for all the submitted requests to complete and then
+  /// stops the Engine thread. Use a CancellationToken to stop them early.
+  ~Engine() noexcept;
+
+  /// submit queues @p request and calls @p callback with its Response. If
+  /// the Engine could not be initialised, @p callback is called immediately
+  /// from the calling thread with a Response describing the error.
+  void submit(Request request, Callback callback) noexcept;
+
+ private:
+  // Impl is the implementation of an Engine.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// Allocator contains the functions libcurl should use to manage memory,
+/// which must behave like the C functions with the same names, and must
+/// be thread safe. For example, they may allocate from per-thread pools.
+struct Allocator {
+  /// malloc_fn is the replacement of malloc.
+  void *(*malloc_fn)(size_t) = nullptr;
+
+  /// free_fn is the replacement of free.
+  void (*free_fn)(void *) = nullptr;
+
+  /// realloc_fn is the replacement of realloc.
+  void *(*realloc_fn)(void *, size_t) = nullptr;
+
+  /// strdup_fn is the replacement of strdup.
+  char *(*strdup_fn)(const char *) = nullptr;
+
+  /// calloc_fn is the replacement of calloc.
+  void *(*calloc_fn)(size_t, size_t) = nullptr;
+};
+
+/// global_init initializes libcurl such that it manages memory using
+/// @p allocator (see curl_global_init_mem) and such that we count its
+/// allocations into Response::memory. Call it once, before using libcurl
+/// or this library, while the program has a single thread. @return zero
+/// on success, or the cURL error, which is CURLE_FAILED_INIT if libcurl
+/// was already initialized or if global_init was already called.
+int64_t global_init(const Allocator &allocator) noexcept;
+
+#if __cplusplus >= 201703L
+// The following functions adapt the std::pmr::memory_resource passed to
+// global_init to an Allocator. They are inline in this header, rather than
+// with the implementation, because the library may be compiled as C++11,
+// where std::pmr does not exist, so the caller's translation unit must
+// compile them.
+
+// mkcurl_resource is the memory resource passed to global_init.
+inline std::pmr::memory_resource *mkcurl_resource = nullptr;
+
+// mkcurl_pmr_header is the size of the header where we store the size of an
+// allocation, which we need to return the memory to mkcurl_resource.
+constexpr size_t mkcurl_pmr_header = alignof(std::max_align_t);
+
+inline void *mkcurl_pmr_malloc(size_t size) {
+  if (size > SIZE_MAX - mkcurl_pmr_header) return nullptr;
+  void *base = nullptr;
+  // The C allocation functions report failures by returning null.
+  try {
+    base = mkcurl_resource->allocate(size + mkcurl_pmr_header,
+                                     mkcurl_pmr_header);
+  } catch (...) {
+    return nullptr;
+  }
+  memcpy(base, &size, sizeof(size));
+  return (char *)base + mkcurl_pmr_header;
+}
+
+inline void mkcurl_pmr_free(void *ptr) {
+  if (ptr == nullptr) return;
+  char *base = (char *)ptr - mkcurl_pmr_header;
+  size_t size = 0;
+  memcpy(&size, base, sizeof(size));
+  mkcurl_resource->deallocate(base, size + mkcurl_pmr_header,
+                              mkcurl_pmr_header);
+}
+
+inline void *mkcurl_pmr_realloc(void *ptr, size_t size) {
+  if (ptr == nullptr) return mkcurl_pmr_malloc(size);
+  size_t old_size = 0;
+  memcpy(&old_size, (char *)ptr - mkcurl_pmr_header, sizeof(old_size));
+  void *p = mkcurl_pmr_malloc(size);
+  if (p == nullptr) return nullptr;
+  memcpy(p, ptr, std::min(old_size, size));
+  mkcurl_pmr_free(ptr);
+  return p;
+}
+
+inline char *mkcurl_pmr_strdup(const char *str) {
+  size_t size = strlen(str) + 1;
+  auto p = (char *)mkcurl_pmr_malloc(size);
+  if (p != nullptr) memcpy(p, str, size);
+  return p;
+}
+
+inline void *mkcurl_pmr_calloc(size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) return nullptr;
+  void *p = mkcurl_pmr_malloc(count * size);
+  if (p != nullptr) memset(p, 0, count * size);
+  return p;
+}
+
+/// global_init is like global_init(const Allocator &) except that libcurl
+/// allocates from @p resource, which must be thread safe, e.g. a
+/// std::pmr::synchronized_pool_resource, and must outlive libcurl. It is
+/// only available when compiling as C++17 or later.
+inline int64_t global_init(std::pmr::memory_resource *resource) noexcept {
+  Allocator allocator;  // Incomplete, hence rejected, if resource is null
+  if (resource != nullptr) {
+    // Only the first call passing a complete Allocator counts, hence we must
+    // not replace the resource that libcurl may already be using.
+    if (mkcurl_resource == nullptr) mkcurl_resource = resource;
+    allocator.malloc_fn = mkcurl_pmr_malloc;
+    allocator.free_fn = mkcurl_pmr_free;
+    allocator.realloc_fn = mkcurl_pmr_realloc;
+    allocator.strdup_fn = mkcurl_pmr_strdup;
+    allocator.calloc_fn = mkcurl_pmr_calloc;
+  }
+  return global_init(allocator);
+}
+#endif
+
+/// perform performs @p request and returns the Response.
+Response perform(const Request &request) noexcept;
+
+/// perform is like perform(const Request &) except that it takes ownership
+/// of @p request, such that it can be modified rather than copied.
+Response perform(Request &&request) noexcept;
+
+}  // inline namespace MKCURL_INLINE_NAMESPACE
+}  // namespace curl
+}  // namespace mk
+
+// If you just want to know about the API, you can stop reading here. What
+// follows is the inline implementation of the library. By default it is not
+// included when you include the header, but you can change this.
+#ifdef MKCURL_INLINE_IMPL
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <curl/curl.h>
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/tcp.h>
+#endif
+
+#ifdef MKCURL_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
+#include "mkmock.hpp"
+
+// MKCURL_MOCK controls whether to enable mocking
+#ifdef MKCURL_MOCK
+#define MKCURL_HOOK MKMOCK_HOOK_ENABLED
+#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_ENABLED
+#else
+#define MKCURL_HOOK MKMOCK_HOOK_DISABLED
+#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_DISABLED
+#endif
+
+#ifndef MKCURL_ABORT
+// MKCURL_ABORT allows to mock abort
+#define MKCURL_ABORT abort
+#endif
+
+namespace mk {
+namespace curl {
+inline namespace MKCURL_INLINE_NAMESPACE {
+
+#ifndef MKCURL_NO_LOGS
+// mkcurl_log appends @p line to @p logs. It adds information on the current
+// time in millisecond. It also appends a newline to the end of the line.
+static void mkcurl_log(Logs &logs, std::string &&line) {
+  auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch());
+  Log log;
+  log.msec = now.count();
+  std::swap(line, log.line);
+  logs.push_back(std::move(log));
+}
+#else
+// mkcurl_log does nothing. It is a template such that string literals are
+// not converted to std::string, which could allocate.
+template <typename Line>
+static void mkcurl_log(Logs &, Line &&) noexcept {}
+#endif
+
+#ifndef MKCURL_NO_LOGS
+// mkcurl_logs_recycle moves the entries of @p logs into @p spare. We push them
+// in reverse order, such that we take them back in the original order and
+// hence likely overwrite each line with one of similar length.
+static void mkcurl_logs_recycle(Logs &logs, Logs &spare) {
+  for (auto it = logs.rbegin(); it != logs.rend(); ++it) {
+    spare.push_back(std::move(*it));
+  }
+  logs.clear();
+}
+#endif
+
+// MemoryCounters counts the memory allocated by libcurl on a thread.
+struct MemoryCounters {
+  int64_t allocations = 0;
+  int64_t bytes = 0;
+};
+
+// mkcurl_memory counts the memory allocated by libcurl on this thread.
+static thread_local MemoryCounters mkcurl_memory;
+
+// mkcurl_allocator is the Allocator passed to global_init. Since libcurl may
+// use it as soon as we pass it, we never change it afterwards.
+static Allocator mkcurl_allocator;
+
+// mkcurl_allocator_passed indicates whether global_init has been called.
+static std::atomic<bool> mkcurl_allocator_passed{false};
+
+// mkcurl_now returns the current UNIX time in seconds. We use the system
+// clock because cache entries may be saved on disk and reloaded later.
+static int64_t mkcurl_now() noexcept {
+  return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// mkcurl_tolower returns @p s converted to lowercase (ASCII only).
+static std::string mkcurl_tolower(std::string s) {
+  for (auto &c : s) {
+    if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+  }
+  return s;
+}
+
+// mkcurl_header_index_line indexes the line of res.response_headers that
+// starts at @p begin and ends at @p end, including its line terminator,
+// into res.header_fields and res.header_hops.
+static void mkcurl_header_index_line(
+    Response &res, size_t begin, size_t end) noexcept {
+  const char *base = res.response_headers.data();
+  auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+  while (end > begin && (base[end - 1] == '\n' || base[end - 1] == '\r' ||
+                         is_space(base[end - 1]))) {
+    --end;
+  }
+  if (end == begin) return;  // The empty line ending a block
+  if (end - begin >= 5 && memcmp(base + begin, "HTTP/", 5) == 0) {
+    res.header_hops.push_back(res.header_fields.size());
+    return;
+  }
+  if (res.header_hops.empty()) res.header_hops.push_back(0);
+  if (is_space(base[begin])) {
+    // This is an obsolete folded line continuing the previous value.
+    size_t first = res.header_hops.back();
+    if (res.header_fields.size() > first) {
+      auto &field = res.header_fields.back();
+      field.value_size = end - field.value;
+    }
+    return;
+  }
+  auto colon = (const char *)memchr(base + begin, ':', end - begin);
+  if (colon == nullptr) return;
+  HeaderField field;
+  field.name = begin;
+  field.name_size = (size_t)(colon - base) - begin;
+  field.value = (size_t)(colon - base) + 1;
+  while (field.value < end && is_space(base[field.value])) ++field.value;
+  field.value_size = end - field.value;
+  res.header_fields.push_back(field);
+}
+
+// mkcurl_header_index rebuilds the index of res.response_headers. We only
+// need it when we do not fill res.response_headers while receiving, e.g.,
+// when serving a response from the Cache. We use memchr to find the end of
+// each line because it is usually vectorized by the C library.
+static void mkcurl_header_index(Response &res) noexcept {
+  res.header_fields.clear();
+  res.header_hops.clear();
+  size_t begin = 0;
+  size_t size = res.response_headers.size();
+  while (begin < size) {
+    auto base = res.response_headers.data();
+    auto newline = (const char *)memchr(base + begin, '\n', size - begin);
+    size_t end = (newline != nullptr) ? (size_t)(newline - base) + 1 : size;
+    mkcurl_header_index_line(res, begin, end);
+    begin = end;
+  }
+}
+
+// mkcurl_header_find calls @p func with the index in res.header_fields of
+// each header called @p name in @p hop until @p func returns false.
+template <typename Func>
+static void mkcurl_header_find(const Response &res, const std::string &name,
+                               size_t hop, Func func) noexcept {
+  if (res.header_hops.empty()) return;
+  if (hop >= res.header_hops.size()) hop = res.header_hops.size() - 1;
+  size_t end = (hop + 1 < res.header_hops.size()) ? res.header_hops[hop + 1]
+                                                  : res.header_fields.size();
+  auto lower = [](char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+  };
+  const char *base = res.response_headers.data();
+  for (size_t i = res.header_hops[hop]; i < end; ++i) {
+    auto &field = res.header_fields[i];
+    if (field.name_size != name.size()) continue;
+    size_t j = 0;
+    while (j < name.size() && lower(base[field.name + j]) == lower(name[j])) {
+      ++j;
+    }
+    if (j == name.size() && !func(i)) return;
+  }
+}
+
+std::string header_value(const Response &res, const std::string &name,
+                         size_t hop) noexcept {
+  std::string value;
+  mkcurl_header_find(res, name, hop, [&](size_t i) {
+    auto &field = res.header_fields[i];
+    value = res.response_headers.substr(field.value, field.value_size);
+    return false;
+  });
+  return value;
+}
+
+std::vector<std::string> header_values(
+    const Response &res, const std::string &name, size_t hop) noexcept {
+  std::vector<std::string> values;
+  mkcurl_header_find(res, name, hop, [&](size_t i) {
+    auto &field = res.header_fields[i];
+    values.push_back(
+        res.response_headers.substr(field.value, field.value_size));
+    return true;
+  });
+  return values;
+}
+
+// mkcurl_trim returns @p s without leading and trailing whitespace.
+static std::string mkcurl_trim(const std::string &s) {
+  auto begin = s.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) return "";
+  auto end = s.find_last_not_of(" \t\r\n");
+  return s.substr(begin, end - begin + 1);
+}
+
+// mkcurl_url_host_port extracts the lowercase @p host and the @p port from
+// the http or https @p url. We don't use cURL's URL API because it's not
+// available in all the cURL versions we support. @return false on failure.
+static bool mkcurl_url_host_port(
+    const std::string &url, std::string &host, int64_t &port) {
+  auto sep = url.find("://");
+  if (sep == std::string::npos) return false;
+  auto scheme = mkcurl_tolower(url.substr(0, sep));
+  if (scheme == "http") {
+    port = 80;
+  } else if (scheme == "https") {
+    port = 443;
+  } else {
+    return false;
+  }
+  auto begin = sep + 3;
+  auto end = url.find_first_of("/?#", begin);
+  if (end == std::string::npos) end = url.size();
+  auto authority = url.substr(begin, end - begin);
+  auto at = authority.rfind('@');
+  if (at != std::string::npos) authority = authority.substr(at + 1);
+  std::string rest;
+  if (!authority.empty() && authority[0] == '[') {
+    auto close = authority.find(']');
+    if (close == std::string::npos) return false;
+    host = authority.substr(1, close - 1);
+    rest = authority.substr(close + 1);
+  } else {
+    auto colon = authority.find(':');
+    host = authority.substr(0, colon);
+    if (colon != std::string::npos) rest = authority.substr(colon);
+  }
+  if (!rest.empty()) {
+    if (rest[0] != ':') return false;
+    if (rest.size() > 1) port = atoll(rest.c_str() + 1);
+  }
+  host = mkcurl_tolower(host);
+  return !host.empty() && port > 0 && port <= 65535;
+}
+
+// mkcurl_resolve_key returns the `host:port` key used to identify the
+// entries passed to CURLOPT_RESOLVE.
+static std::string mkcurl_resolve_key(const std::string &host, int64_t port) {
+  return mkcurl_tolower(host) + ":" + std::to_string(port);
+}
+
+// mkcurl_resolve_format formats the CURLOPT_RESOLVE entry for @p key
+// (i.e. `host:port`) and @p addresses.
+static std::string mkcurl_resolve_format(
+    const std::string &key, const std::vector<std::string> &addresses) {
+  std::string entry = key + ":";
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    if (i > 0) entry += ",";
+    if (addresses[i].find(':') != std::string::npos) {
+      entry += "[" + addresses[i] + "]";  // IPv6
+    } else {
+      entry += addresses[i];
+    }
+  }
+  return entry;
+}
+
+// mkcurl_deleter is a custom deleter for a CURL handle.
+struct mkcurl_deleter {
+  void operator()(CURL *handle) { curl_easy_cleanup(handle); }
+};
+
+// mkcurl_uptr is a unique pointer to a CURL handle.
+using mkcurl_uptr = std::unique_ptr<CURL, mkcurl_deleter>;
+
+// mkcurl_multi_deleter is a custom deleter for a CURLM handle.
+struct mkcurl_multi_deleter {
+  void operator()(CURLM *handle) { curl_multi_cleanup(handle); }
+};
+
+// mkcurl_multi_uptr is a unique pointer to a CURLM handle.
+using mkcurl_multi_uptr = std::unique_ptr<CURLM, mkcurl_multi_deleter>;
+
+// TrustStore::Impl contains the implementation of a trust store.
+class TrustStore::Impl {
+ public:
+  // path is the path from which we loaded the bundle, if any.
+  std::string path;
+  // bundle contains the PEM encoded CA certificates.
+  std::string bundle;
+  // digest is the FNV-1a hash of bundle, which identifies it.
+  uint64_t digest = 0;
+#ifdef MKCURL_OPENSSL
+  // store contains the parsed certificates, if libcurl uses OpenSSL.
+  X509_STORE *store = nullptr;
+
+  ~Impl() noexcept { X509_STORE_free(store); }
+#endif
+};
+
+#ifdef MKCURL_OPENSSL
+// mkcurl_trust_store_parse parses the bundle of @p impl into impl.store,
+// when libcurl uses OpenSSL. Otherwise, or if the bundle contains no
+// certificates, impl.store remains null and we pass the bundle to cURL.
+static void mkcurl_trust_store_parse(TrustStore::Impl &impl) noexcept {
+  auto info = curl_version_info(CURLVERSION_NOW);
+  if (info == nullptr || info->ssl_version == nullptr ||
+      strncmp(info->ssl_version, "OpenSSL/", 8) != 0 ||
+      impl.bundle.size() > INT_MAX) {
+    return;
+  }
+  BIO *bio = BIO_new_mem_buf(impl.bundle.data(), (int)impl.bundle.size());
+  if (bio == nullptr) return;
+  STACK_OF(X509_INFO) *infos =
+      PEM_X509_INFO_read_bio(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  if (infos == nullptr) return;
+  X509_STORE *store = X509_STORE_new();
+  int count = 0;
+  for (int i = 0; store != nullptr && i < sk_X509_INFO_num(infos); ++i) {
+    X509_INFO *item = sk_X509_INFO_value(infos, i);
+    if (item->x509 != nullptr && X509_STORE_add_cert(store, item->x509)) {
+      count += 1;
+    }
+    if (item->crl != nullptr) (void)X509_STORE_add_crl(store, item->crl);
+  }
+  sk_X509_INFO_pop_free(infos, X509_INFO_free);
+  if (store == nullptr || count <= 0) {
+    X509_STORE_free(store);
+    return;
+  }
+  // Like cURL does by default, also trust intermediate CAs in the bundle.
+  (void)X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+  impl.store = store;
+}
+#endif
+
+// mkcurl_hex_encode returns the hexadecimal encoding of @p s.
+static std::string mkcurl_hex_encode(const std::string &s) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(s.size() * 2);
+  for (auto c : s) {
+    out += digits[((unsigned char)c) >> 4];
+    out += digits[((unsigned char)c) & 0x0f];
+  }
+  return out;
+}
+
+// mkcurl_hex_decode decodes @p s into @p out. @return false on failure.
+static bool mkcurl_hex_decode(const std::string &s, std::string &out) {
+  auto value = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+  };
+  if (s.size() % 2 != 0) return false;
+  out.clear();
+  out.reserve(s.size() / 2);
+  for (size_t i = 0; i < s.size(); i += 2) {
+    int hi = value(s[i]), lo = value(s[i + 1]);
+    if (hi < 0 || lo < 0) return false;
+    out += (char)((hi << 4) | lo);
+  }
+  return true;
+}
+
+// SessionStoreAddress is an address saved into the SessionStore.
+struct SessionStoreAddress {
+  std::string address;
+  int64_t expires = 0;
+};
+
+// SessionStoreTicket is a TLS session saved into the SessionStore. We
+// only save the salted hash of the session key, not the key itself, which
+// would reveal the name of the servers.
+struct SessionStoreTicket {
+  std::string shmac;
+  std::string sdata;
+  int64_t expires = 0;
+};
+
+// SessionStore::Impl contains the implementation of a session store.
+class SessionStore::Impl {
+ public:
+  int64_t dns_ttl = 0;
+  mutable std::mutex mutex;
+  // addresses maps `host:port` to the address we connected to.
+  std::map<std::string, SessionStoreAddress> addresses;
+  // tickets maps the hash of the session key to the TLS session.
+  std::map<std::string, SessionStoreTicket> tickets;
+
+  // lookup returns in @p address the address of the host and port in @p
+  // key (i.e. `host:port`). @return false if we don't know any valid address.
+  bool lookup(const std::string &key, std::string &address) const {
+    std::unique_lock<std::mutex> _{mutex};
+    auto it = addresses.find(key);
+    if (it == addresses.end() || it->second.expires <= mkcurl_now()) {
+      return false;
+    }
+    address = it->second.address;
+    return true;
+  }
+
+  // record records that @p address is the address of the host and port in
+  // @p key (i.e. `host:port`).
+  void record(const std::string &key, const std::string &address) {
+    SessionStoreAddress entry;
+    entry.address = address;
+    entry.expires = mkcurl_now() + dns_ttl;
+    std::unique_lock<std::mutex> _{mutex};
+    addresses[key] = entry;
+  }
+
+  // import_tickets adds the saved TLS sessions to the cache of @p handle.
+  void import_tickets(CURL *handle) const {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    std::unique_lock<std::mutex> _{mutex};
+    auto now = mkcurl_now();
+    for (auto &pair : tickets) {
+      auto &ticket = pair.second;
+      if (ticket.expires <= now) continue;
+      // Implementation note: this fails if cURL has not been compiled
+      // with support for exporting sessions, and we don't care.
+      (void)curl_easy_ssls_import(
+          handle, nullptr, (const unsigned char *)ticket.shmac.data(),
+          ticket.shmac.size(), (const unsigned char *)ticket.sdata.data(),
+          ticket.sdata.size());
+    }
+#else
+    (void)handle;
+#endif
+  }
+
+  // export_tickets saves the TLS sessions cached by @p handle.
+  void export_tickets(CURL *handle) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    (void)curl_easy_ssls_export(handle, mkcurl_ssls_export_cb_, this);
+#else
+    (void)handle;
+#endif
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  static CURLcode mkcurl_ssls_export_cb_(
+      CURL *, void *userptr, const char *, const unsigned char *shmac,
+      size_t shmac_len, const unsigned char *sdata, size_t sdata_len,
+      curl_off_t valid_until, int, const char *, size_t) {
+    if (userptr == nullptr || shmac == nullptr || sdata == nullptr) {
+      return CURLE_OK;
+    }
+    auto self = static_cast<SessionStore::Impl *>(userptr);
+    SessionStoreTicket ticket;
+    ticket.shmac = std::string{(const char *)shmac, shmac_len};
+    ticket.sdata = std::string{(const char *)sdata, sdata_len};
+    ticket.expires = (int64_t)valid_until;
+    std::unique_lock<std::mutex> _{self->mutex};
+    self->tickets[ticket.shmac] = ticket;
+    return CURLE_OK;
+  }
+#endif
+};
+
+SessionStore::SessionStore(int64_t dns_ttl) noexcept {
+  impl_.reset(new SessionStore::Impl);
+  impl_->dns_ttl = dns_ttl;
+}
+SessionStore::~SessionStore() noexcept = default;
+
+bool SessionStore::load(const std::string &path) noexcept {
+  std::ifstream in{path};
+  std::string line;
+  if (!std::getline(in, line) || line != "mkcurl-session-store-v1") {
+    return false;
+  }
+  auto now = mkcurl_now();
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  while (std::getline(in, line)) {
+    std::stringstream ss{line};
+    std::string kind;
+    ss >> kind;
+    if (kind == "dns") {
+      std::string key;
+      SessionStoreAddress address;
+      if ((ss >> key >> address.address >> address.expires) &&
+          address.expires > now) {
+        impl_->addresses[key] = address;
+      }
+    } else if (kind == "tls") {
+      std::string shmac, sdata;
+      SessionStoreTicket ticket;
+      if ((ss >> ticket.expires >> shmac >> sdata) && ticket.expires > now &&
+          mkcurl_hex_decode(shmac, ticket.shmac) &&
+          mkcurl_hex_decode(sdata, ticket.sdata)) {
+        impl_->tickets[ticket.shmac] = ticket;
+      }
+    }
+  }
+  return true;
+}
+
+bool SessionStore::save(const std::string &path) const noexcept {
+  std::ofstream out{path, std::ios::trunc};
+  out << "mkcurl-session-store-v1\n";
+  auto now = mkcurl_now();
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  for (auto &pair : impl_->addresses) {
+    if (pair.second.expires <= now) continue;
+    out << "dns " << pair.first << " " << pair.second.address << " "
+        << pair.second.expires << "\n";
+  }
+  for (auto &pair : impl_->tickets) {
+    if (pair.second.expires <= now) continue;
+    out << "tls " << pair.second.expires << " "
+        << mkcurl_hex_encode(pair.second.shmac) << " "
+        << mkcurl_hex_encode(pair.second.sdata) << "\n";
+  }
+  return (bool)out.flush();
+}
+
+// CircuitOutcome is the outcome of a request as seen by a CircuitBreaker.
+enum class CircuitOutcome {
+  connected,  // we connected to the server
+  failed,     // DNS or connect failure
+  unknown,    // e.g. cancelled before connecting
+};
+
+// Circuit is the circuit of a `host:port`.
+struct Circuit {
+  CircuitState state = CircuitState::closed;
+  int64_t failures = 0;
+  std::chrono::steady_clock::time_point opened_at;
+  // probing is true when the half open circuit let a probe through.
+  bool probing = false;
+};
+
+// CircuitBreaker::Impl contains the implementation of a circuit breaker.
+class CircuitBreaker::Impl {
+ public:
+  CircuitBreakerSettings settings;
+  mutable std::mutex mutex;
+  // circuits maps `host:port` to its circuit. We only keep the circuits
+  // of the hosts that are failing, such that the map doesn't grow.
+  std::map<std::string, Circuit> circuits;
+  CircuitBreakerStats stats;
+
+  // allow returns whether we should perform a request towards @p key.
+  bool allow(const std::string &key) {
+    std::unique_lock<std::mutex> _{mutex};
+    auto it = circuits.find(key);
+    if (it == circuits.end()) return true;
+    auto &c = it->second;
+    if (c.state == CircuitState::open &&
+        std::chrono::steady_clock::now() - c.opened_at >=
+            std::chrono::milliseconds(settings.cooldown_ms)) {
+      c.state = CircuitState::half_open;
+      c.probing = false;
+      stats.half_opened += 1;
+    }
+    if (c.state == CircuitState::closed) return true;
+    if (c.state == CircuitState::half_open && !c.probing) {
+      c.probing = true;
+      return true;
+    }
+    stats.fast_failed += 1;
+    return false;
+  }
+
+  // report reports the @p outcome of a request towards @p key that
+  // allow has let through.
+  void report(const std::string &key, CircuitOutcome outcome) {
+    std::unique_lock<std::mutex> _{mutex};
+    auto it = circuits.find(key);
+    if (outcome == CircuitOutcome::connected) {
+      if (it == circuits.end()) return;
+      if (it->second.state != CircuitState::closed) stats.closed += 1;
+      circuits.erase(it);
+      return;
+    }
+    if (outcome == CircuitOutcome::unknown) {
+      if (it != circuits.end()) it->second.probing = false;
+      return;
+    }
+    auto &c = circuits[key];
+    c.failures += 1;
+    if (c.state == CircuitState::half_open ||
+        (c.state == CircuitState::closed &&
+         c.failures >= settings.failure_threshold)) {
+      c.state = CircuitState::open;
+      c.opened_at = std::chrono::steady_clock::now();
+      c.probing = false;
+      stats.opened += 1;
+    }
+  }
+};
+
+CircuitBreaker::CircuitBreaker(CircuitBreakerSettings settings) noexcept {
+  impl_.reset(new CircuitBreaker::Impl);
+  impl_->settings = settings;
+}
+
+CircuitBreaker::~CircuitBreaker() noexcept = default;
+
+CircuitState CircuitBreaker::state(
+    const std::string &host, int64_t port) const noexcept {
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  auto it = impl_->circuits.find(mkcurl_resolve_key(host, port));
+  return (it != impl_->circuits.end()) ? it->second.state
+                                       : CircuitState::closed;
+}
+
+CircuitBreakerStats CircuitBreaker::stats() const noexcept {
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  return impl_->stats;
+}
+
+// mkcurl_priority_classes is the number of priority classes.
+constexpr size_t mkcurl_priority_classes = 3;
+
+// mkcurl_priority_class returns the index of the priority class of @p req.
+static size_t mkcurl_priority_class(const Request &req) noexcept {
+  size_t klass = (size_t)req.priority;
+  return (klass < mkcurl_priority_classes) ? klass : (size_t)Priority::normal;
+}
+
+// RateDirection is what a RateLimiter budget is for.
+enum class RateDirection { down, up, requests };
+
+// mkcurl_rate_directions is the number of RateDirection values.
+constexpr size_t mkcurl_rate_directions = 3;
+
+// TokenBucket is a token bucket that may go into debt, such that a caller
+// taking more tokens than available knows how long it should wait.
+struct TokenBucket {
+  // rate is the number of tokens per second, or zero for no limit.
+  double rate = 0.0;
+  // capacity is the maximum number of tokens.
+  double capacity = 0.0;
+  double tokens = 0.0;
+  std::chrono::steady_clock::time_point last;
+
+  // take takes @p amount tokens at @p now and returns when the caller is
+  // allowed to continue.
+  std::chrono::steady_clock::time_point take(
+      double amount, std::chrono::steady_clock::time_point now) noexcept {
+    if (rate <= 0.0) return now;
+    std::chrono::duration<double> elapsed = now - last;
+    last = now;
+    tokens = std::min(tokens + elapsed.count() * rate, capacity) - amount;
+    if (tokens >= 0.0) return now;
+    using duration = std::chrono::steady_clock::duration;
+    return now + std::chrono::duration_cast<duration>(
+                     std::chrono::duration<double>{-tokens / rate});
+  }
+};
+
+// RateLimiter::Impl contains the implementation of a rate limiter.
+class RateLimiter::Impl {
+ public:
+  std::mutex mutex;
+  // buckets contains the total buckets followed by the buckets of each
+  // priority class, indexed by RateDirection.
+  TokenBucket buckets[1 + mkcurl_priority_classes][mkcurl_rate_directions];
+
+  // configure sets the rates of the buckets of @p index to @p limits.
+  void configure(size_t index, const RateLimits &limits, int64_t burst_ms) {
+    int64_t rates[mkcurl_rate_directions] = {};
+    rates[(size_t)RateDirection::down] = limits.download_bytes_per_second;
+    rates[(size_t)RateDirection::up] = limits.upload_bytes_per_second;
+    rates[(size_t)RateDirection::requests] = limits.requests_per_second;
+    for (size_t dir = 0; dir < mkcurl_rate_directions; ++dir) {
+      auto &bucket = buckets[index][dir];
+      bucket.rate = (rates[dir] > 0) ? (double)rates[dir] : 0.0;
+      // Always allow at least one request.
+      bucket.capacity = std::max(
+          bucket.rate * (double)std::max(burst_ms, (int64_t)0) / 1000.0,
+          (dir == (size_t)RateDirection::requests) ? 1.0 : 0.0);
+      bucket.tokens = bucket.capacity;
+      bucket.last = std::chrono::steady_clock::now();
+    }
+  }
+
+  // take accounts @p amount for @p req in @p dir at @p now and returns
+  // when the transfer is allowed to continue.
+  std::chrono::steady_clock::time_point take(
+      const Request &req, RateDirection dir, int64_t amount,
+      std::chrono::steady_clock::time_point now) {
+    std::unique_lock<std::mutex> _{mutex};
+    auto total = buckets[0][(size_t)dir].take((double)amount, now);
+    auto klass = buckets[1 + mkcurl_priority_class(req)][(size_t)dir].take(
+        (double)amount, now);
+    return std::max(total, klass);
+  }
+};
+
+RateLimiter::RateLimiter(RateLimiterSettings settings) noexcept {
+  impl_.reset(new RateLimiter::Impl);
+  impl_->configure(0, settings.total, settings.burst_ms);
+  impl_->configure(1 + (size_t)Priority::background, settings.background,
+                   settings.burst_ms);
+  impl_->configure(1 + (size_t)Priority::normal, settings.normal,
+                   settings.burst_ms);
+  impl_->configure(1 + (size_t)Priority::interactive, settings.interactive,
+                   settings.burst_ms);
+}
+
+RateLimiter::~RateLimiter() noexcept = default;
+
+// mkcurl_histogram_buckets is the number of buckets of a histogram: four for
+// the values below four microseconds, four for each power of two up to 2^28
+// microseconds (about four and a half minutes), and one for larger values.
+constexpr size_t mkcurl_histogram_buckets = 4 + 26 * 4 + 1;
+
+// mkcurl_histogram_index returns the index of the bucket of @p us.
+static size_t mkcurl_histogram_index(int64_t us) noexcept {
+  if (us < 4) return (size_t)std::max(us, (int64_t)0);
+  size_t exp = 2;
+  while (exp < 28 && (us >> (exp + 1)) != 0) ++exp;
+  if (exp >= 28) return mkcurl_histogram_buckets - 1;
+  return 4 + (exp - 2) * 4 + (size_t)((us >> (exp - 2)) - 4);
+}
+
+// mkcurl_histogram_bound returns the inclusive upper bound of the bucket
+// with index @p index, which must not be the last bucket.
+static int64_t mkcurl_histogram_bound(size_t index) noexcept {
+  if (index < 4) return (int64_t)index;
+  size_t exp = (index - 4) / 4 + 2;
+  int64_t sub = (int64_t)((index - 4) % 4);
+  return ((sub + 5) << (exp - 2)) - 1;
+}
+
+// mkcurl_metrics_add adds @p value to @p counter. Each counter has a single
+// writer, the owner of its shard, so we don't need an atomic read-modify-
+// write, which would be a locked instruction (e.g., lock xadd on x86). A
+// relaxed load followed by a relaxed store compiles to plain moves, while
+// still allowing the snapshot to read a recent value without data races.
+static void mkcurl_metrics_add(
+    std::atomic<int64_t> &counter, int64_t value) noexcept {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+// MetricsHistogramShard is a histogram of a MetricsShard.
+struct MetricsHistogramShard {
+  std::atomic<int64_t> counts[mkcurl_histogram_buckets];
+  std::atomic<int64_t> sum_us;
+
+  MetricsHistogramShard() noexcept {
+    for (auto &c : counts) c = 0;
+    sum_us = 0;
+  }
+
+  // record records a sample of @p us microseconds.
+  void record(int64_t us) noexcept {
+    mkcurl_metrics_add(counts[mkcurl_histogram_index(us)], 1);
+    mkcurl_metrics_add(sum_us, us);
+  }
+
+  // merge adds the content of this histogram to @p h.
+  void merge(MetricsHistogram &h) const noexcept {
+    for (size_t i = 0; i < mkcurl_histogram_buckets; ++i) {
+      auto count = counts[i].load(std::memory_order_relaxed);
+      h.counts[i] += count;
+      h.count += count;
+    }
+    h.sum_us += sum_us.load(std::memory_order_relaxed);
+  }
+};
+
+// mkcurl_metrics_errors is the number of Response::error values we count
+// separately, starting from -mkcurl_metrics_errors_offset. The other
+// values are counted as CURL_LAST.
+constexpr int64_t mkcurl_metrics_errors = 128;
+constexpr int64_t mkcurl_metrics_errors_offset = 16;
+
+// mkcurl_metrics_statuses is the number of HTTP status codes we count.
+// The other values are counted as zero.
+constexpr int64_t mkcurl_metrics_statuses = 600;
+
+// MetricsShard contains the counters of a Client or Engine.
+struct MetricsShard {
+  std::atomic<int64_t> requests;
+  std::atomic<int64_t> retries;
+  std::atomic<int64_t> bytes_sent;
+  std::atomic<int64_t> bytes_recv;
+  std::atomic<int64_t> connections_opened;
+  std::atomic<int64_t> connections_reused;
+  std::atomic<int64_t> errors[mkcurl_metrics_errors];
+  std::atomic<int64_t> statuses[mkcurl_metrics_statuses];
+  MetricsHistogramShard total;
+  MetricsHistogramShard first_byte;
+  MetricsHistogramShard connect;
+  MetricsHistogramShard tls;
+
+  MetricsShard() noexcept {
+    requests = retries = bytes_sent = bytes_recv = 0;
+    connections_opened = connections_reused = 0;
+    for (auto &c : errors) c = 0;
+    for (auto &c : statuses) c = 0;
+  }
+};
+
+// Metrics::Impl contains the implementation of Metrics.
+class Metrics::Impl {
+ public:
+  mutable std::mutex mutex;
+  // shards contains all the shards, including the free ones, which
+  // still contain the counts recorded by their previous owners.
+  std::vector<std::unique_ptr<MetricsShard>> shards;
+  std::vector<MetricsShard *> free_shards;
+
+  // acquire returns a shard for the exclusive use of the caller.
+  MetricsShard *acquire() {
+    std::unique_lock<std::mutex> _{mutex};
+    if (!free_shards.empty()) {
+      auto shard = free_shards.back();
+      free_shards.pop_back();
+      return shard;
+    }
+    shards.push_back(std::unique_ptr<MetricsShard>{new MetricsShard});
+    return shards.back().get();
+  }
+
+  // release returns @p shard, obtained using acquire, to the pool.
+  void release(MetricsShard *shard) {
+    std::unique_lock<std::mutex> _{mutex};
+    free_shards.push_back(shard);
+  }
+};
+
+Metrics::Metrics() noexcept { impl_.reset(new Metrics::Impl); }
+
+Metrics::~Metrics() noexcept = default;
+
+MetricsSnapshot Metrics::snapshot() const noexcept {
+  MetricsSnapshot snap;
+  for (auto h : {&snap.total, &snap.first_byte, &snap.connect, &snap.tls}) {
+    for (size_t i = 0; i + 1 < mkcurl_histogram_buckets; ++i) {
+      h->bounds.push_back(mkcurl_histogram_bound(i));
+    }
+    h->counts.resize(mkcurl_histogram_buckets);
+  }
+  auto load = [](const std::atomic<int64_t> &c) {
+    return c.load(std::memory_order_relaxed);
+  };
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  for (auto &shard : impl_->shards) {
+    snap.requests += load(shard->requests);
+    snap.retries += load(shard->retries);
+    snap.bytes_sent += load(shard->bytes_sent);
+    snap.bytes_recv += load(shard->bytes_recv);
+    snap.connections_opened += load(shard->connections_opened);
+    snap.connections_reused += load(shard->connections_reused);
+    for (int64_t i = 0; i < mkcurl_metrics_errors; ++i) {
+      auto count = load(shard->errors[i]);
+      if (count > 0) {
+        snap.errors[i - mkcurl_metrics_errors_offset] += count;
+      }
+    }
+    for (int64_t i = 0; i < mkcurl_metrics_statuses; ++i) {
+      auto count = load(shard->statuses[i]);
+      if (count > 0) snap.status_codes[i] += count;
+    }
+    shard->total.merge(snap.total);
+    shard->first_byte.merge(snap.first_byte);
+    shard->connect.merge(snap.connect);
+    shard->tls.merge(snap.tls);
+  }
+  return snap;
+}
+
+// mkcurl_metrics_seconds formats @p us microseconds as seconds.
+static std::string mkcurl_metrics_seconds(int64_t us) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld.%06lld", (long long)(us / 1000000),
+           (long long)(us % 1000000));
+  return buf;
+}
+
+std::string metrics_prometheus(const MetricsSnapshot &snap) noexcept {
+  std::stringstream ss;
+  auto counter = [&](const char *name, const char *help, int64_t value) {
+    ss << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " counter\n"
+       << name << " " << value << "\n";
+  };
+  counter("mkcurl_requests_total", "Requests performed.", snap.requests);
+  counter("mkcurl_retries_total", "Retries after DNS or connect failures.",
+          snap.retries);
+  counter("mkcurl_sent_bytes_total", "Bytes sent.", snap.bytes_sent);
+  counter("mkcurl_received_bytes_total", "Bytes received.", snap.bytes_recv);
+  ss << "# HELP mkcurl_connections_total Connections opened or reused.\n"
+     << "# TYPE mkcurl_connections_total counter\n"
+     << "mkcurl_connections_total{reused=\"false\"} "
+     << snap.connections_opened << "\n"
+     << "mkcurl_connections_total{reused=\"true\"} "
+     << snap.connections_reused << "\n";
+  ss << "# HELP mkcurl_errors_total Failed requests by error.\n"
+     << "# TYPE mkcurl_errors_total counter\n";
+  for (auto &pair : snap.errors) {
+    ss << "mkcurl_errors_total{error=\"" << pair.first << "\"} "
+       << pair.second << "\n";
+  }
+  ss << "# HELP mkcurl_responses_total Responses by HTTP status code.\n"
+     << "# TYPE mkcurl_responses_total counter\n";
+  for (auto &pair : snap.status_codes) {
+    ss << "mkcurl_responses_total{code=\"" << pair.first << "\"} "
+       << pair.second << "\n";
+  }
+  auto histogram = [&](const char *name, const char *help,
+                       const MetricsHistogram &h) {
+    ss << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " histogram\n";
+    int64_t cumulative = 0;
+    for (size_t i = 0; i < h.counts.size(); ++i) {
+      cumulative += h.counts[i];
+      ss << name << "_bucket{le=\""
+         << ((i < h.bounds.size()) ? mkcurl_metrics_seconds(h.bounds[i])
+                                   : "+Inf")
+         << "\"} " << cumulative << "\n";
+    }
+    ss << name << "_sum " << mkcurl_metrics_seconds(h.sum_us) << "\n"
+       << name << "_count " << h.count << "\n";
+  };
+  histogram("mkcurl_total_seconds", "Duration of the transfers.", snap.total);
+  histogram("mkcurl_first_byte_seconds", "Time to first byte.",
+            snap.first_byte);
+  histogram("mkcurl_connect_seconds", "Time to connect.", snap.connect);
+  histogram("mkcurl_tls_seconds", "Duration of the TLS handshakes.", snap.tls);
+  return ss.str();
+}
+
+std::string metrics_json(const MetricsSnapshot &snap) noexcept {
+  std::stringstream ss;
+  auto map = [&](const std::map<int64_t, int64_t> &m) {
+    ss << "{";
+    for (auto it = m.begin(); it != m.end(); ++it) {
+      if (it != m.begin()) ss << ",";
+      ss << "\"" << it->first << "\":" << it->second;
+    }
+    ss << "}";
+  };
+  // We only include the nonempty buckets, and null is the bound of the
+  // last bucket, which has no upper bound.
+  auto histogram = [&](const MetricsHistogram &h) {
+    ss << "{\"count\":" << h.count << ",\"sum_us\":" << h.sum_us
+       << ",\"buckets\":[";
+    bool first = true;
+    for (size_t i = 0; i < h.counts.size(); ++i) {
+      if (h.counts[i] == 0) continue;
+      if (!first) ss << ",";
+      first = false;
+      ss << "{\"le_us\":";
+      if (i < h.bounds.size()) {
+        ss << h.bounds[i];
+      } else {
+        ss << "null";
+      }
+      ss << ",\"count\":" << h.counts[i] << "}";
+    }
+    ss << "]}";
+  };
+  ss << "{\"requests\":" << snap.requests << ",\"retries\":" << snap.retries
+     << ",\"bytes_sent\":" << snap.bytes_sent
+     << ",\"bytes_recv\":" << snap.bytes_recv
+     << ",\"connections_opened\":" << snap.connections_opened
+     << ",\"connections_reused\":" << snap.connections_reused
+     << ",\"errors\":";
+  map(snap.errors);
+  ss << ",\"status_codes\":";
+  map(snap.status_codes);
+  ss << ",\"total\":";
+  histogram(snap.total);
+  ss << ",\"first_byte\":";
+  histogram(snap.first_byte);
+  ss << ",\"connect\":";
+  histogram(snap.connect);
+  ss << ",\"tls\":";
+  histogram(snap.tls);
+  ss << "}";
+  return ss.str();
+}
+
+// mkcurl_json_quote returns @p s as a quoted JSON string.
+static std::string mkcurl_json_quote(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+// TraceSpan is a span recorded by a transfer.
+struct TraceSpan {
+  std::string name;
+  std::chrono::steady_clock::time_point begin;
+  std::chrono::steady_clock::time_point end;
+  // args contains the members of the JSON object of the attributes.
+  std::string args;
+};
+
+// Tracer::Impl contains the implementation of a Tracer.
+class Tracer::Impl {
+ public:
+  std::chrono::steady_clock::time_point origin =
+      std::chrono::steady_clock::now();
+  mutable std::mutex mutex;
+  // events contains the formatted Chrome trace events.
+  std::vector<std::string> events;
+  // next_tid is the row of the next transfer.
+  int64_t next_tid = 1;
+
+  // add adds the @p spans of a transfer as a new row.
+  void add(const std::vector<TraceSpan> &spans) {
+    std::vector<std::string> formatted;
+    formatted.reserve(spans.size());
+    std::unique_lock<std::mutex> _{mutex};
+    int64_t tid = next_tid++;
+    for (auto &span : spans) {
+      auto us = [&](std::chrono::steady_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d)
+            .count();
+      };
+      std::stringstream ss;
+      ss << "{\"name\":" << mkcurl_json_quote(span.name)
+         << ",\"cat\":\"mkcurl\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+         << ",\"ts\":" << us(span.begin - origin)
+         << ",\"dur\":" << us(span.end - span.begin) << ",\"args\":{"
+         << span.args << "}}";
+      events.push_back(ss.str());
+    }
+  }
+};
+
+Tracer::Tracer() noexcept { impl_.reset(new Tracer::Impl); }
+
+Tracer::~Tracer() noexcept = default;
+
+std::string Tracer::json() const noexcept {
+  std::string out = "{\"traceEvents\":[";
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  for (size_t i = 0; i < impl_->events.size(); ++i) {
+    if (i > 0) out += ",\n";
+    out += impl_->events[i];
+  }
+  return out + "],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+bool Tracer::save(const std::string &path) const noexcept {
+  std::ofstream out{path, std::ios::trunc};
+  out << json();
+  return (bool)out.flush();
+}
+
+// mkcurl_slist is a curl_slist with RAII semantic.
+struct mkcurl_slist {
+  // mkcurl_slist is the default constructor.
+  mkcurl_slist() = default;
+  // mkcurl_slist is the deleted copy constructor.
+  mkcurl_slist(const mkcurl_slist &) = delete;
+  // operator= is the deleted copy assignment.
+  mkcurl_slist &operator=(const mkcurl_slist &) = delete;
+  // mkcurl_slist is the deleted move constructor.
+  mkcurl_slist(mkcurl_slist &&) = delete;
+  // operator= is the deleted move assignment.
+  mkcurl_slist &operator=(mkcurl_slist &&) = delete;
+  // ~mkcurl_slist is the destructor.
+  ~mkcurl_slist() { curl_slist_free_all(p); }
+  // p is the pointer to the wrapped slist.
+  curl_slist *p = nullptr;
+};
+
+// RecordingChunk is a chunk of bytes of a recorded exchange.
+struct RecordingChunk {
+  // Type is the type of a chunk.
+  enum Type : char {
+    connect = '+',   // cURL opened a new connection
+    sent = '>',      // cURL sent data
+    received = '<',  // cURL received data
+  };
+  Type type = connect;
+  // t_us is when the chunk was sent or received relative to the beginning
+  // of the transfer, in microseconds.
+  int64_t t_us = 0;
+  std::string data;
+};
+
+// RecordingExchange is the exchange of a request, including all the hops.
+using RecordingExchange = std::vector<RecordingChunk>;
+
+// Recording::Impl contains the implementation of a Recording.
+class Recording::Impl {
+ public:
+  mutable std::mutex mutex;
+  std::vector<std::shared_ptr<const RecordingExchange>> exchanges;
+  // next is the index of the next exchange to replay.
+  size_t next = 0;
+
+  // add adds @p exchange to the recorded exchanges.
+  void add(RecordingExchange &&exchange) noexcept {
+    std::shared_ptr<RecordingExchange> p{new RecordingExchange};
+    std::swap(*p, exchange);
+    std::unique_lock<std::mutex> _{mutex};
+    exchanges.push_back(std::move(p));
+  }
+
+  // replay returns the next exchange to replay or a null pointer.
+  std::shared_ptr<const RecordingExchange> replay() noexcept {
+    std::unique_lock<std::mutex> _{mutex};
+    if (next >= exchanges.size()) return nullptr;
+    return exchanges[next++];
+  }
+};
+
+Recording::Recording() noexcept { impl_.reset(new Recording::Impl); }
+
+Recording::~Recording() noexcept = default;
+
+size_t Recording::size() const noexcept {
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  return impl_->exchanges.size();
+}
+
+void Recording::rewind() noexcept {
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  impl_->next = 0;
+}
+
+// The file contains, after the version line, an `exchange <count>` line for
+// each exchange followed by its chunks. Each chunk is a `<type> <t_us>
+// <size>` line followed by the data and by a newline.
+bool Recording::load(const std::string &path) noexcept {
+  std::ifstream in{path, std::ios::binary};
+  std::string line;
+  if (!std::getline(in, line) || line != "mkcurl-recording-v1") {
+    return false;
+  }
+  std::vector<RecordingExchange> exchanges;
+  while (std::getline(in, line)) {
+    std::stringstream ss{line};
+    std::string kind;
+    size_t count = 0;
+    if (!(ss >> kind >> count) || kind != "exchange") return false;
+    RecordingExchange exchange;
+    for (size_t i = 0; i < count; ++i) {
+      RecordingChunk chunk;
+      char type = 0;
+      size_t size = 0;
+      if (!std::getline(in, line)) return false;
+      std::stringstream cs{line};
+      if (!(cs >> type >> chunk.t_us >> size) ||
+          (type != RecordingChunk::connect && type != RecordingChunk::sent &&
+           type != RecordingChunk::received)) {
+        return false;
+      }
+      chunk.type = (RecordingChunk::Type)type;
+      chunk.data.resize(size);
+      if (size > 0 && !in.read(&chunk.data[0], (std::streamsize)size)) {
+        return false;
+      }
+      if (in.get() != '\n') return false;
+      exchange.push_back(std::move(chunk));
+    }
+    exchanges.push_back(std::move(exchange));
+  }
+  for (auto &exchange : exchanges) impl_->add(std::move(exchange));
+  return true;
+}
+
+bool Recording::save(const std::string &path) const noexcept {
+  std::ofstream out{path, std::ios::trunc | std::ios::binary};
+  out << "mkcurl-recording-v1\n";
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  for (auto &exchange : impl_->exchanges) {
+    out << "exchange " << exchange->size() << "\n";
+    for (auto &chunk : *exchange) {
+      out << (char)chunk.type << " " << chunk.t_us << " "
+          << chunk.data.size() << "\n" << chunk.data << "\n";
+    }
+  }
+  return (bool)out.flush();
+}
+
+#ifndef _WIN32
+// ReplaySession serves a recorded exchange to cURL. We listen on a random
+// loopback port, to which we redirect cURL, and serve the exchange using a
+// background thread that accepts each connection opened by cURL. We read
+// from cURL what it sent when recording, checking whether it is the same,
+// and we write back what it received. (We would rather give cURL one end
+// of a socketpair, but older cURL versions ignore the sockopt callback
+// telling them that a socket is already connected.)
+class ReplaySession {
+ public:
+  ReplaySession(std::shared_ptr<const RecordingExchange> exchange,
+                bool timed) noexcept
+      : exchange_{std::move(exchange)}, timed_{timed} {}
+
+  ReplaySession(const ReplaySession &) = delete;
+  ReplaySession &operator=(const ReplaySession &) = delete;
+  ReplaySession(ReplaySession &&) = delete;
+  ReplaySession &operator=(ReplaySession &&) = delete;
+
+  ~ReplaySession() noexcept { stop(); }
+
+  // start starts listening and serving. @return the port on which we are
+  // listening, or zero on failure.
+  uint16_t start() noexcept {
+    sockaddr_in sin{};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sin);
+    if ((listener_ = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        bind(listener_, (sockaddr *)&sin, len) != 0 ||
+        listen(listener_, 8) != 0 ||
+        getsockname(listener_, (sockaddr *)&sin, &len) != 0) {
+      return 0;
+    }
+    begin_ = std::chrono::steady_clock::now();
+    thread_ = std::thread{[this]() { run(); }};
+    return ntohs(sin.sin_port);
+  }
+
+  // stop waits for the background thread to finish.
+  void stop() noexcept {
+    {
+      std::unique_lock<std::mutex> _{mutex_};
+      stopping_ = true;
+      cond_.notify_all();
+    }
+    if (thread_.joinable()) thread_.join();
+    if (listener_ != -1) (void)close(listener_);
+    listener_ = -1;
+  }
+
+  // diverged indicates that cURL did not send what it sent when recording.
+  std::atomic<bool> diverged{false};
+
+ private:
+  // stopped returns whether stop has been called.
+  bool stopped() noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    return stopping_;
+  }
+
+  // next_socket returns our end of the next connection opened by cURL, or
+  // -1 if we have been stopped or we cannot accept connections.
+  int next_socket() noexcept {
+    while (!stopped()) {
+      pollfd pfd{};
+      pfd.fd = listener_;
+      pfd.events = POLLIN;
+      int rv = poll(&pfd, 1, 100);
+      if (rv < 0) return -1;
+      if (rv > 0) return accept(listener_, nullptr, nullptr);
+    }
+    return -1;
+  }
+
+  // receive reads from @p fd what cURL sends, which should be @p expected.
+  // @return false if cURL closed the connection before sending anything.
+  bool receive(int fd, const std::string &expected) noexcept {
+    // If cURL sends less than expected, we eventually give up waiting.
+    const std::chrono::milliseconds idle{250};
+    size_t count = 0;
+    auto last = std::chrono::steady_clock::now();
+    while (count < expected.size()) {
+      pollfd pfd{};
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 100) <= 0) {
+        if (stopped()) return true;
+        if (count > 0 && std::chrono::steady_clock::now() - last > idle) {
+          diverged = true;
+          return true;
+        }
+        continue;
+      }
+      char data[4096];
+      auto n = recv(fd, data, std::min(sizeof(data), expected.size() - count),
+                    0);
+      if (n <= 0) {
+        if (count > 0) diverged = true;
+        return count > 0;
+      }
+      if (memcmp(data, expected.data() + count, (size_t)n) != 0) {
+        diverged = true;
+      }
+      count += (size_t)n;
+      last = std::chrono::steady_clock::now();
+    }
+    return true;
+  }
+
+  // transmit writes @p data into @p fd. @return false on failure.
+  bool transmit(int fd, const std::string &data) noexcept {
+    size_t count = 0;
+    while (count < data.size()) {
+      auto n = send(fd, data.data() + count, data.size() - count,
+                    MSG_NOSIGNAL);
+      if (n <= 0) return false;
+      count += (size_t)n;
+    }
+    return true;
+  }
+
+  void run() noexcept {
+    int fd = -1;
+    auto close_fd = [&fd]() {
+      if (fd != -1) (void)close(fd);
+      fd = -1;
+    };
+    for (auto &chunk : *exchange_) {
+      if (stopped()) break;
+      if (chunk.type == RecordingChunk::connect) {
+        close_fd();
+        continue;
+      }
+      if (fd == -1 && (fd = next_socket()) == -1) return;
+      if (chunk.type == RecordingChunk::sent) {
+        // When cURL closes the connection we continue on the next one,
+        // because we do not let cURL reuse connections when replaying.
+        while (!receive(fd, chunk.data)) {
+          close_fd();
+          if ((fd = next_socket()) == -1) return;
+        }
+        continue;
+      }
+      if (timed_) {
+        std::unique_lock<std::mutex> lock{mutex_};
+        auto deadline = begin_ + std::chrono::microseconds(chunk.t_us);
+        if (cond_.wait_until(lock, deadline, [this]() { return stopping_; })) {
+          break;
+        }
+      }
+      if (!transmit(fd, chunk.data)) close_fd();
+    }
+    close_fd();
+  }
+
+  std::shared_ptr<const RecordingExchange> exchange_;
+  bool timed_ = false;
+  std::chrono::steady_clock::time_point begin_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  int listener_ = -1;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+#else
+// ReplaySession is not available on Windows, which lacks poll() and
+// MSG_NOSIGNAL.
+class ReplaySession {
+ public:
+  void stop() noexcept {}
+  std::atomic<bool> diverged{false};
+};
+#endif
+
+struct TransferState;
+
+// ClientState contains the state of a Client needed to perform requests,
+// i.e., the cURL handle and the client wide settings.
+struct ClientState {
+  // sockets maps the sockets opened by handle that are still open to their
+  // connection id. It is declared before handle because cURL closes sockets
+  // when we destroy the handle, hence it must outlive the handle.
+  std::map<curl_socket_t, int64_t> sockets;
+  // last_connection_id is the id of the last connection we opened.
+  int64_t last_connection_id = 0;
+  // transfer is the transfer in progress, if any. Like sockets, it must
+  // outlive the handle, for the same reason.
+  TransferState *transfer = nullptr;
+  mkcurl_uptr handle;
+  std::shared_ptr<TrustStore> trust_store;
+  // trust_store_impl is the implementation of trust_store, if set.
+  const TrustStore::Impl *trust_store_impl = nullptr;
+  std::shared_ptr<SessionStore> session_store;
+  // session_store_impl is the implementation of session_store, if set.
+  SessionStore::Impl *session_store_impl = nullptr;
+  std::shared_ptr<CircuitBreaker> circuit_breaker;
+  // circuit_breaker_impl is the implementation of circuit_breaker, if set.
+  CircuitBreaker::Impl *circuit_breaker_impl = nullptr;
+  std::shared_ptr<RateLimiter> rate_limiter;
+  // rate_limiter_impl is the implementation of rate_limiter, if set.
+  RateLimiter::Impl *rate_limiter_impl = nullptr;
+  // metrics_shard is where we record metrics, if any. Its owner (i.e. the
+  // Client or the Engine) keeps the Metrics alive.
+  MetricsShard *metrics_shard = nullptr;
+  // tracer_impl is the Tracer we record spans into, if any. Like for
+  // metrics_shard, its owner keeps it alive.
+  Tracer::Impl *tracer_impl = nullptr;
+  // recording_impl is the Recording we use according to recording_mode,
+  // if any. Like for metrics_shard, its owner keeps it alive.
+  Recording::Impl *recording_impl = nullptr;
+  RecordingMode recording_mode = RecordingMode::record;
+  ConnectionPoolSettings pool;
+  // resolve maps `host:port` to the addresses set with Client::set_resolve.
+  std::map<std::string, std::vector<std::string>> resolve;
+  // resolve_working maps `host:port` to the address that worked last time.
+  std::map<std::string, std::string> resolve_working;
+  // resolve_injected contains the `host:port` keys that we've passed
+  // to CURLOPT_RESOLVE, which cURL keeps in the handle DNS cache.
+  std::set<std::string> resolve_injected;
+#ifndef MKCURL_NO_LOGS
+  // spare_logs contains the log entries of the Responses that the caller
+  // passed us for reuse, whose lines we overwrite rather than allocating.
+  Logs spare_logs;
+#endif
+};
+
+// mkcurl_trace_times is the number of cURL counters we read when tracing.
+constexpr size_t mkcurl_trace_times = 5;
+
+// TraceHop is the state of the redirect hop that is being traced.
+struct TraceHop {
+  bool open = false;
+  std::chrono::steady_clock::time_point begin;
+  // request is when we started sending the request.
+  std::chrono::steady_clock::time_point request;
+  std::chrono::steady_clock::time_point first_byte;
+  std::chrono::steady_clock::time_point last_byte;
+  int64_t bytes_sent = 0;
+  int64_t bytes_recv = 0;
+  // args contains the attributes known when the hop began.
+  std::string args;
+};
+
+// TransferState is the state of a transfer, which is passed to the cURL
+// callbacks that need more than the Response.
+struct TransferState {
+  ClientState *client = nullptr;
+  const Request *req = nullptr;
+  Response *res = nullptr;
+  // socket is the socket used by this transfer, if known.
+  curl_socket_t socket = CURL_SOCKET_BAD;
+  // begin is when the transfer began.
+  std::chrono::steady_clock::time_point begin;
+  // next_sample_us is when we should take the next progress sample.
+  int64_t next_sample_us = 0;
+  // last is the last progress reported by cURL.
+  ProgressSample last;
+  // header_bytes is the size of the response headers received so far.
+  int64_t header_bytes = 0;
+  // headers_too_large indicates that we stopped because of header_bytes.
+  bool headers_too_large = false;
+  // limiter is the RateLimiter of the client, if any.
+  RateLimiter::Impl *limiter = nullptr;
+  // pausable indicates that, when over budget, we should pause the
+  // transfer rather than waiting (i.e. when using a multi handle).
+  bool pausable = false;
+  // paused indicates that we have paused the transfer until resume_at.
+  bool paused = false;
+  std::chrono::steady_clock::time_point resume_at;
+  // bytes_up is the number of body bytes sent so far.
+  int64_t bytes_up = 0;
+  // retries is the number of times we retried the transfer.
+  int64_t retries = 0;
+  // tracer is the Tracer of the client, if any. The following fields
+  // are only used when tracing.
+  Tracer::Impl *tracer = nullptr;
+  std::vector<TraceSpan> spans;
+  std::chrono::steady_clock::time_point attempt_begin;
+  int64_t attempts = 0;
+  // hops is the number of hops of the current attempt.
+  int64_t hops = 0;
+  TraceHop hop;
+  // trace_times contains the cURL counters when the current hop began.
+  double trace_times[mkcurl_trace_times] = {};
+  // recording is where we record the exchange of this transfer, if any.
+  Recording::Impl *recording = nullptr;
+  // exchange is the exchange of this transfer, when recording.
+  RecordingExchange exchange;
+  // replay serves the exchange of this transfer, when replaying.
+  std::unique_ptr<ReplaySession> replay;
+  // headers contains the request headers.
+  mkcurl_slist headers;
+  // connect_to_settings contains the CURLOPT_CONNECT_TO settings.
+  mkcurl_slist connect_to_settings;
+  // resolve_settings contains the CURLOPT_RESOLVE settings.
+  mkcurl_slist resolve_settings;
+};
+
+// mkcurl_progress_sample appends @p sample to @p transfer's response and
+// passes it to the user callback, if any.
+static void mkcurl_progress_sample(
+    TransferState &transfer, const ProgressSample &sample) noexcept {
+  transfer.res->progress.push_back(sample);
+  if (transfer.req->on_progress) {
+    transfer.req->on_progress(sample);
+  }
+}
+
+// mkcurl_trace_read reads into @p times the cURL counters used for tracing,
+// i.e. the name lookup, connect, TLS and pretransfer times and the number
+// of connections. When following redirects, cURL adds the times of each hop
+// to these counters, so we compute the times of a hop as differences.
+static void mkcurl_trace_read(
+    CURL *handle, double (&times)[mkcurl_trace_times]) noexcept {
+  // Implementation note: tracing is best effort, hence we do not treat
+  // getinfo failures as errors and just consider the values as zero.
+  static const CURLINFO infos[] = {
+      CURLINFO_NAMELOOKUP_TIME, CURLINFO_CONNECT_TIME,
+      CURLINFO_APPCONNECT_TIME, CURLINFO_PRETRANSFER_TIME};
+  for (size_t i = 0; i < 4; ++i) {
+    times[i] = 0.0;
+    (void)curl_easy_getinfo(handle, infos[i], &times[i]);
+  }
+  long connects = 0L;
+  (void)curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+  times[4] = (double)connects;
+}
+
+// mkcurl_trace_span adds a span to @p transfer.
+static void mkcurl_trace_span(
+    TransferState &transfer, const char *name,
+    std::chrono::steady_clock::time_point begin,
+    std::chrono::steady_clock::time_point end, std::string args = "") {
+  if (end < begin) end = begin;
+  transfer.spans.push_back(TraceSpan{name, begin, end, std::move(args)});
+}
+
+// mkcurl_trace_seconds converts @p seconds into a steady clock duration.
+static std::chrono::steady_clock::duration mkcurl_trace_seconds(
+    double seconds) noexcept {
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>{std::max(seconds, 0.0)});
+}
+
+// mkcurl_trace_hop_end ends the current hop of @p transfer at @p end.
+static void mkcurl_trace_hop_end(
+    TransferState &transfer,
+    std::chrono::steady_clock::time_point end) noexcept {
+  auto &hop = transfer.hop;
+  if (!hop.open) return;
+  hop.open = false;
+  bool responded = hop.first_byte != std::chrono::steady_clock::time_point{};
+  mkcurl_trace_span(transfer, "request", hop.request,
+                    responded ? hop.first_byte : end);
+  if (responded) mkcurl_trace_span(transfer, "response", hop.first_byte, end);
+  std::stringstream ss;
+  ss << hop.args << ",\"bytes_sent\":" << hop.bytes_sent
+     << ",\"bytes_recv\":" << hop.bytes_recv;
+  mkcurl_trace_span(transfer, "hop", hop.begin, end, ss.str());
+}
+
+// mkcurl_trace_connection adds to @p transfer the dns, connect and tls
+// spans of a hop that began at @p begin and whose times, relative to
+// @p begin, are @p delta.
+static void mkcurl_trace_connection(
+    TransferState &transfer, std::chrono::steady_clock::time_point begin,
+    const double (&delta)[mkcurl_trace_times]) noexcept {
+  auto dns = begin + mkcurl_trace_seconds(delta[0]);
+  auto connect = begin + mkcurl_trace_seconds(delta[1]);
+  mkcurl_trace_span(transfer, "dns", begin, dns);
+  mkcurl_trace_span(transfer, "connect", dns, connect);
+  if (delta[2] > delta[1]) {
+    mkcurl_trace_span(transfer, "tls", connect,
+                      begin + mkcurl_trace_seconds(delta[2]));
+  }
+}
+
+// mkcurl_trace_hop_begin begins a new hop of @p transfer, which is about to
+// send the request using @p handle, ending the previous one, if any.
+static void mkcurl_trace_hop_begin(
+    TransferState &transfer, CURL *handle) noexcept {
+  auto &hop = transfer.hop;
+  mkcurl_trace_hop_end(transfer, hop.last_byte);
+  double times[mkcurl_trace_times];
+  mkcurl_trace_read(handle, times);
+  double delta[mkcurl_trace_times];
+  for (size_t i = 0; i < mkcurl_trace_times; ++i) {
+    delta[i] = times[i] - transfer.trace_times[i];
+    transfer.trace_times[i] = times[i];
+  }
+  auto now = std::chrono::steady_clock::now();
+  hop = TraceHop{};
+  hop.open = true;
+  // Note: cURL may set the pretransfer time after sending the headers, so
+  // we use the latest of the times we know.
+  double setup = std::max(std::max(delta[0], delta[1]),
+                          std::max(delta[2], delta[3]));
+  hop.begin = std::max(now - mkcurl_trace_seconds(setup),
+                       transfer.attempt_begin);
+  hop.request = now;
+  bool reused = delta[4] < 1.0;
+  if (!reused) mkcurl_trace_connection(transfer, hop.begin, delta);
+  char *url = nullptr;
+  (void)curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+  long local_port = 0L;
+  (void)curl_easy_getinfo(handle, CURLINFO_LOCAL_PORT, &local_port);
+  std::stringstream ss;
+  ss << "\"url\":" << mkcurl_json_quote((url != nullptr) ? url : "")
+     << ",\"reused\":" << (reused ? "true" : "false");
+#if LIBCURL_VERSION_NUM >= 0x080200
+  curl_off_t conn_id = -1;
+  (void)curl_easy_getinfo(handle, CURLINFO_CONN_ID, &conn_id);
+  ss << ",\"connection\":" << (int64_t)conn_id;
+#endif
+  ss << ",\"local_port\":" << local_port;
+  hop.args = ss.str();
+}
+
+// mkcurl_trace_attempt_begin begins a new attempt of @p transfer.
+static void mkcurl_trace_attempt_begin(TransferState &transfer) noexcept {
+  transfer.attempt_begin = std::chrono::steady_clock::now();
+  transfer.attempts += 1;
+  transfer.hops = 0;
+  transfer.hop = TraceHop{};
+  for (auto &t : transfer.trace_times) t = 0.0;
+}
+
+// mkcurl_trace_attempt_end ends the current attempt of @p transfer, which
+// was performed using @p handle and ended with @p rv.
+static void mkcurl_trace_attempt_end(
+    TransferState &transfer, CURL *handle, CURLcode rv) noexcept {
+  auto now = std::chrono::steady_clock::now();
+  if (transfer.hops <= 0) {
+    // We did not manage to send the request, hence the attempt failed while
+    // resolving, connecting or handshaking, and the last phase ends now.
+    double times[mkcurl_trace_times];
+    mkcurl_trace_read(handle, times);
+    auto at = [&](double seconds) {
+      return (seconds > 0.0) ? transfer.attempt_begin +
+                                   mkcurl_trace_seconds(seconds)
+                             : now;
+    };
+    mkcurl_trace_span(transfer, "dns", transfer.attempt_begin, at(times[0]));
+    if (times[0] > 0.0) {
+      mkcurl_trace_span(transfer, "connect", at(times[0]), at(times[1]));
+    }
+    if (times[1] > 0.0 &&
+        mkcurl_tolower(transfer.req->url).find("https://") == 0) {
+      mkcurl_trace_span(transfer, "tls", at(times[1]), at(times[2]));
+    }
+  }
+  mkcurl_trace_hop_end(transfer, now);
+  std::stringstream ss;
+  ss << "\"attempt\":" << transfer.attempts << ",\"error\":" << (int64_t)rv;
+  mkcurl_trace_span(transfer, "attempt", transfer.attempt_begin, now,
+                    ss.str());
+}
+
+// mkcurl_trace_debug updates the trace of @p transfer, which uses @p handle,
+// when the debug callback receives @p size bytes of type @p type.
+static void mkcurl_trace_debug(TransferState &transfer, CURL *handle,
+                               curl_infotype type, size_t size) noexcept {
+  auto &hop = transfer.hop;
+  switch (type) {
+    case CURLINFO_HEADER_OUT:
+      // A new request begins when we have not sent anything yet or when we
+      // have received the response to the previous one (i.e. a redirect).
+      if (!hop.open ||
+          hop.first_byte != std::chrono::steady_clock::time_point{}) {
+        mkcurl_trace_hop_begin(transfer, handle);
+        transfer.hops += 1;
+      }
+      hop.bytes_sent += (int64_t)size;
+      break;
+    case CURLINFO_DATA_OUT:
+      hop.bytes_sent += (int64_t)size;
+      break;
+    case CURLINFO_HEADER_IN:
+    case CURLINFO_DATA_IN:
+      if (!hop.open) break;
+      hop.last_byte = std::chrono::steady_clock::now();
+      if (hop.first_byte == std::chrono::steady_clock::time_point{}) {
+        hop.first_byte = hop.last_byte;
+      }
+      hop.bytes_recv += (int64_t)size;
+      break;
+    default:
+      break;
+  }
+}
+
+// mkcurl_record records into @p transfer's exchange the chunk of type @p type
+// contained in @p data. We merge consecutive chunks of the same type that are
+// less than one millisecond apart, such that the recording stays compact.
+static void mkcurl_record(TransferState &transfer, RecordingChunk::Type type,
+                          const char *data, size_t size) noexcept {
+  auto t_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - transfer.begin).count();
+  auto &exchange = transfer.exchange;
+  if (type != RecordingChunk::connect && !exchange.empty() &&
+      exchange.back().type == type && t_us - exchange.back().t_us < 1000) {
+    exchange.back().data.append(data, size);
+    return;
+  }
+  RecordingChunk chunk;
+  chunk.type = type;
+  chunk.t_us = (int64_t)t_us;
+  if (size > 0) chunk.data.assign(data, size);
+  exchange.push_back(std::move(chunk));
+}
+
+// mkcurl_trace_flush adds to the tracer the spans of @p transfer, which
+// performed @p req, and a span covering the whole transfer.
+static void mkcurl_trace_flush(
+    TransferState &transfer, const Request &req, const Response &res) {
+  std::stringstream ss;
+  ss << "\"url\":" << mkcurl_json_quote(req.url)
+     << ",\"error\":" << res.error << ",\"status_code\":" << res.status_code
+     << ",\"retries\":" << transfer.retries;
+  mkcurl_trace_span(transfer, (req.method + " " + req.url).c_str(),
+                    transfer.begin, std::chrono::steady_clock::now(),
+                    ss.str());
+  // Chrome wants parent spans before their children when they begin at the
+  // same time, and we add them after, so reverse.
+  std::reverse(transfer.spans.begin(), transfer.spans.end());
+  transfer.tracer->add(transfer.spans);
+  transfer.spans.clear();
+}
+
+// mkcurl_rate_wait waits until @p until, unless @p req is cancelled.
+static void mkcurl_rate_wait(
+    const Request &req, std::chrono::steady_clock::time_point until) noexcept {
+  // Sleep in short steps, such that we notice cancellation.
+  constexpr std::chrono::milliseconds step{100};
+  for (;;) {
+    if (req.cancellation && req.cancellation->cancelled()) return;
+    auto now = std::chrono::steady_clock::now();
+    if (now >= until) return;
+    std::this_thread::sleep_for(std::min(
+        std::chrono::duration_cast<std::chrono::milliseconds>(until - now) +
+            std::chrono::milliseconds{1},
+        step));
+  }
+}
+
+// mkcurl_rate_account accounts @p amount in @p dir against the RateLimiter
+// of @p transfer. When over budget, we wait or, if the transfer is pausable,
+// we set the time at which the transfer should resume.
+static void mkcurl_rate_account(
+    TransferState &transfer, RateDirection dir, int64_t amount) noexcept {
+  auto now = std::chrono::steady_clock::now();
+  auto until = transfer.limiter->take(*transfer.req, dir, amount, now);
+  if (until <= now) return;
+  transfer.res->throttled_us +=
+      std::chrono::duration_cast<std::chrono::microseconds>(until - now)
+          .count();
+  if (transfer.pausable) {
+    transfer.resume_at = until;
+    return;
+  }
+  mkcurl_rate_wait(*transfer.req, until);
+}
+
+// mkcurl_tcp_info reads the TCP_INFO of @p sock into @p info.
+static void mkcurl_tcp_info(curl_socket_t sock, TCPInfo &info) noexcept {
+  info = TCPInfo{};
+#ifdef __linux__
+  struct tcp_info ti {};
+  socklen_t len = sizeof(ti);
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0) {
+    return;
+  }
+  info.valid = true;
+  info.rtt_us = (int64_t)ti.tcpi_rtt;
+  info.rttvar_us = (int64_t)ti.tcpi_rttvar;
+  info.total_retrans = (int64_t)ti.tcpi_total_retrans;
+  info.snd_cwnd = (int64_t)ti.tcpi_snd_cwnd;
+  info.delivery_rate = (int64_t)ti.tcpi_delivery_rate;
+  info.bytes_acked = (int64_t)ti.tcpi_bytes_acked;
+#else
+  (void)sock;
+#endif
+}
+
+// mkcurl_local_port returns the local port of @p sock, or zero on error.
+static int64_t mkcurl_local_port(curl_socket_t sock) noexcept {
+  sockaddr_storage ss{};
+  socklen_t len = sizeof(ss);
+  if (getsockname(sock, (sockaddr *)&ss, &len) != 0) {
+    return 0;
+  }
+  if (ss.ss_family == AF_INET) {
+    return ntohs(((sockaddr_in *)&ss)->sin_port);
+  }
+  if (ss.ss_family == AF_INET6) {
+    return ntohs(((sockaddr_in6 *)&ss)->sin6_port);
+  }
+  return 0;
+}
+
+// mkcurl_resolve_entries returns the CURLOPT_RESOLVE entries for @p req. The
+// entries of Request::resolve take precedence over the client ones, which take
+// precedence over the SessionStore. We move the address that worked last time
+// first and we remove from cURL's DNS cache the entries that we've injected
+// before but that do not apply to @p req anymore.
+static std::vector<std::string> mkcurl_resolve_entries(
+    ClientState &client, const Request &req) {
+  auto overrides = client.resolve;
+  for (auto &e : req.resolve) {
+    overrides[mkcurl_resolve_key(e.host, e.port)] = e.addresses;
+  }
+  std::vector<std::string> entries;
+  std::set<std::string> injected;
+  for (auto &pair : overrides) {
+    auto addresses = pair.second;
+    if (addresses.empty()) continue;
+    auto working = client.resolve_working.find(pair.first);
+    if (working != client.resolve_working.end()) {
+      auto it = std::find(addresses.begin(), addresses.end(), working->second);
+      if (it != addresses.end()) std::rotate(addresses.begin(), it, it + 1);
+    }
+    entries.push_back(mkcurl_resolve_format(pair.first, addresses));
+    injected.insert(pair.first);
+  }
+  std::string host;
+  int64_t port = 0;
+  if (client.session_store_impl != nullptr && req.proxy_url.empty() &&
+      mkcurl_url_host_port(req.url, host, port)) {
+    auto key = mkcurl_resolve_key(host, port);
+    std::string address;
+    if (injected.count(key) == 0 &&
+        client.session_store_impl->lookup(key, address)) {
+      entries.push_back(mkcurl_resolve_format(key, {address}));
+      injected.insert(key);
+    }
+  }
+  for (auto &key : client.resolve_injected) {
+    if (injected.count(key) == 0) entries.push_back("-" + key);
+  }
+  std::swap(client.resolve_injected, injected);
+  return entries;
+}
+
+// mkcurl_primary_endpoint returns in @p key the `host:port` of the last URL
+// fetched by @p handle, provided that we connected to the port in such URL,
+// as indicated by @p res. @return false if this is not the case.
+static bool mkcurl_primary_endpoint(
+    CURL *handle, const Response &res, std::string &key) {
+  char *url = nullptr;
+  if (res.primary_ip.empty() ||
+      curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK ||
+      url == nullptr) {
+    return false;
+  }
+  std::string host;
+  int64_t port = 0;
+  if (!mkcurl_url_host_port(url, host, port) || port != res.primary_port) {
+    return false;
+  }
+  key = mkcurl_resolve_key(host, port);
+  return true;
+}
+
+// Client::Impl contains the implementation of a client.
+class Client::Impl : public ClientState {
+ public:
+  std::shared_ptr<Cache> cache;
+  // metrics is the Metrics owning metrics_shard, if any.
+  std::shared_ptr<Metrics> metrics;
+  // tracer is the Tracer owning tracer_impl, if any.
+  std::shared_ptr<Tracer> tracer;
+  // recording is the Recording owning recording_impl, if any.
+  std::shared_ptr<Recording> recording;
+  // hedge_client is the state used by a Hedger for the second attempts.
+  std::unique_ptr<ClientState> hedge_client;
+  // hedge_multi is the multi handle used by a Hedger. We keep it, rather
+  // than creating one for each request, because it owns the connections
+  // of the transfers it performed, which we want to reuse.
+  mkcurl_multi_uptr hedge_multi;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+Client::Impl::~Impl() noexcept {
+  // The connections owned by hedge_multi refer to this state as well as to
+  // hedge_client, hence we must close them while both are still alive.
+  hedge_multi.reset();
+  if (session_store_impl != nullptr && handle != nullptr) {
+    session_store_impl->export_tickets(handle.get());
+  }
+  if (metrics_shard != nullptr) {
+    metrics->impl_->release(metrics_shard);
+  }
+}
+
+}  // inline namespace MKCURL_INLINE_NAMESPACE
+}  // namespace curl
+}  // namespace mk
+
+extern "C" {
+
+// The following functions count the allocations of libcurl, and forward
+// them to the Allocator passed to global_init.
+
+static void *mkcurl_malloc_cb_(size_t size) {
+  mk::curl::mkcurl_memory.allocations += 1;
+  mk::curl::mkcurl_memory.bytes += (int64_t)size;
+  return mk::curl::mkcurl_allocator.malloc_fn(size);
+}
+
+static void mkcurl_free_cb_(void *ptr) {
+  mk::curl::mkcurl_allocator.free_fn(ptr);
+}
+
+static void *mkcurl_realloc_cb_(void *ptr, size_t size) {
+  mk::curl::mkcurl_memory.allocations += 1;
+  mk::curl::mkcurl_memory.bytes += (int64_t)size;
+  return mk::curl::mkcurl_allocator.realloc_fn(ptr, size);
+}
+
+static char *mkcurl_strdup_cb_(const char *str) {
+  if (str == nullptr) {
+    MKCURL_ABORT();
+  }
+  mk::curl::mkcurl_memory.allocations += 1;
+  mk::curl::mkcurl_memory.bytes += (int64_t)strlen(str) + 1;
+  return mk::curl::mkcurl_allocator.strdup_fn(str);
+}
+
+static void *mkcurl_calloc_cb_(size_t count, size_t size) {
+  mk::curl::mkcurl_memory.allocations += 1;
+  mk::curl::mkcurl_memory.bytes += (int64_t)(count * size);
+  return mk::curl::mkcurl_allocator.calloc_fn(count, size);
+}
+
+#ifdef MKCURL_OPENSSL
+// mkcurl_ssl_ctx_cb_ makes the SSL_CTX @p sslctx use the X509_STORE @p
+// userptr, which contains the certificates parsed by a TrustStore.
+static CURLcode mkcurl_ssl_ctx_cb_(CURL *, void *sslctx, void *userptr) {
+  if (sslctx == nullptr || userptr == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto store = static_cast<X509_STORE *>(userptr);
+  if (!X509_STORE_up_ref(store)) return CURLE_OUT_OF_MEMORY;
+  SSL_CTX_set_cert_store(static_cast<SSL_CTX *>(sslctx), store);
+  return CURLE_OK;
+}
+#endif
+
+static size_t mkcurl_body_cb_(
+    char *ptr, size_t size, size_t nmemb, void *userdata) {
+  if (nmemb <= 0) {
     return 0;  // This means "no body"
   }
-  if (size > SIZE_MAX / nmemb) {
-    // If size is zero we end up into this branch.
-    return 0;
+  if (size > SIZE_MAX / nmemb) {
+    // If size is zero we end up into this branch.
+    return 0;
+  }
+  if (ptr == nullptr || userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto realsiz = size * nmemb;  // Overflow or zero not possible (see above)
+  auto transfer = static_cast<mk::curl::TransferState *>(userdata);
+  if (transfer->pausable &&
+      transfer->resume_at > std::chrono::steady_clock::now()) {
+    // cURL will pass us the same data again when the Engine resumes us.
+    transfer->paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+  if (transfer->limiter != nullptr) {
+    mk::curl::mkcurl_rate_account(
+        *transfer, mk::curl::RateDirection::down, (int64_t)realsiz);
+  }
+  auto res = transfer->res;
+  auto max = transfer->req->max_body_size;
+  if (max > 0 && realsiz > (uint64_t)max - res->body.size()) {
+    // Note: returning a value different from nmemb stops the transfer. We
+    // map the resulting error after curl_easy_perform returns.
+    if (transfer->req->keep_truncated_body) {
+      res->body.append(ptr, (size_t)max - res->body.size());
+    }
+    res->body_truncated = true;
+    return 0;
+  }
+  res->body.append(ptr, realsiz);
+  // From fwrite(3): "[the return value] equals the number of bytes
+  // written _only_ when `size` equals `1`". See also
+  // https://sourceware.org/git/?p=glibc.git;a=blob;f=libio/iofwrite.c;h=800341b7da546e5b7fd2005c5536f4c90037f50d;hb=HEAD#l29
+  return nmemb;
+}
+
+static size_t mkcurl_header_cb_(
+    char *ptr, size_t size, size_t nmemb, void *userdata) {
+  if (ptr == nullptr || userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto realsiz = size * nmemb;  // cURL guarantees that size is one
+  auto transfer = static_cast<mk::curl::TransferState *>(userdata);
+  transfer->header_bytes += (int64_t)realsiz;
+  auto max_header_bytes = transfer->req->max_header_bytes;
+  if (max_header_bytes > 0 && transfer->header_bytes > max_header_bytes) {
+    transfer->headers_too_large = true;
+    return 0;  // Stop the transfer
+  }
+  // cURL passes us one complete line at a time, so we can index it now.
+  auto res = transfer->res;
+  auto begin = res->response_headers.size();
+  res->response_headers.append(ptr, realsiz);
+  mk::curl::mkcurl_header_index_line(
+      *res, begin, res->response_headers.size());
+  return nmemb;
+}
+
+static int mkcurl_debug_cb_(CURL *handle,
+                            curl_infotype type,
+                            char *data,
+                            size_t size,
+                            void *userptr) {
+  if (data == nullptr || userptr == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto transfer = static_cast<mk::curl::TransferState *>(userptr);
+  auto res = transfer->res;
+
+  if (type == CURLINFO_HEADER_OUT) {
+    res->request_headers.append(data, size);
+  }
+
+#ifndef MKCURL_NO_LOGS
+  // Implementation note: we split lines by hand, rather than using a
+  // std::stringstream, such that we allocate only the lines themselves, and
+  // not even them when we can overwrite the spare lines of the client.
+  auto spare = (transfer->client != nullptr)
+                   ? &transfer->client->spare_logs : nullptr;
+  auto log_many_lines = [&](const char *prefix, const char *base,
+                            size_t count) {
+    size_t prefix_len = strlen(prefix);
+    while (count > 0) {
+      auto newline = (const char *)memchr(base, '\n', count);
+      size_t len = (newline != nullptr) ? (size_t)(newline - base) : count;
+      std::string line;
+      if (spare != nullptr && !spare->empty()) {
+        std::swap(line, spare->back().line);
+        spare->pop_back();
+        line.clear();
+      }
+      line.reserve(prefix_len + 1 + len);
+      if (prefix_len > 0) {
+        line.append(prefix, prefix_len);
+        line += " ";
+      }
+      line.append(base, len);
+      mkcurl_log(res->logs, std::move(line));
+      if (newline == nullptr) break;
+      base += len + 1;
+      count -= len + 1;
+    }
+  };
+  auto log_size = [&](const char *prefix) {
+    std::string s = std::to_string(size);
+    log_many_lines(prefix, s.data(), s.size());
+  };
+
+  switch (type) {
+    case CURLINFO_TEXT:
+      log_many_lines("", data, size);
+      break;
+    case CURLINFO_HEADER_IN:
+      log_many_lines("<", data, size);
+      break;
+    case CURLINFO_DATA_IN:
+      log_size("<data:");
+      break;
+    case CURLINFO_SSL_DATA_IN:
+      log_size("<tls_data:");
+      break;
+    case CURLINFO_HEADER_OUT:
+      log_many_lines(">", data, size);
+      break;
+    case CURLINFO_DATA_OUT:
+      log_size(">data:");
+      break;
+    case CURLINFO_SSL_DATA_OUT:
+      log_size(">tls_data:");
+      break;
+    case CURLINFO_END:
+      /* NOTHING */
+      break;
+  }
+#endif
+
+#ifndef MKCURL_NO_BYTE_COUNTING
+  // Note regarding counting TLS data
+  // ````````````````````````````````
+  //
+  // I am using the technique recommended by Stenberg on Stack Overflow [1]. It
+  // was initially not clear to me whether cURL using OpenSSL counted the data
+  // twice, once encrypted and once in clear text. However, using cURL using
+  // OpenSSL on Linux and reading the source code [2] helped me to clarify that
+  // it does indeed the right thing [3]. When using other TLS backends, it may
+  // be that TLS data is not counted, but that's okay since we tell to users
+  // that this is an estimate of the amount of used data.
+  //
+  // Notes
+  // `````
+  //
+  // .. [1] https://stackoverflow.com/a/26905099
+  //
+  // .. [2] https://github.com/curl/curl/blob/6684653b/lib/vtls/openssl.c#L2295
+  //
+  // .. [3] the SSL function used is SSL_CTX_set_msg_callback which "[is] never
+  //        [called for] application_data(23) because the callback will only be
+  //        called for protocol messages" [4].
+  //
+  // .. [4] https://www.openssl.org/docs/man1.1.0/ssl/SSL_CTX_set_msg_callback.html
+  switch (type) {
+    case CURLINFO_HEADER_IN:
+    case CURLINFO_DATA_IN:
+    case CURLINFO_SSL_DATA_IN:
+      // Implementation note: overflow is unlikely, so we don't care.
+      res->bytes_recv += size;
+      break;
+    case CURLINFO_HEADER_OUT:
+    case CURLINFO_DATA_OUT:
+    case CURLINFO_SSL_DATA_OUT:
+      // Implementation note: overflow is unlikely, so we don't care.
+      res->bytes_sent += size;
+      break;
+    case CURLINFO_TEXT:
+    case CURLINFO_END:
+      /* NOTHING */
+      break;
+  }
+#endif
+
+  if (transfer->tracer != nullptr) {
+    mk::curl::mkcurl_trace_debug(*transfer, handle, type, size);
+  }
+  // We record what's after TLS, i.e. the plaintext HTTP/1.1 exchange.
+  if (transfer->recording != nullptr) {
+    if (type == CURLINFO_HEADER_OUT || type == CURLINFO_DATA_OUT) {
+      mk::curl::mkcurl_record(
+          *transfer, mk::curl::RecordingChunk::sent, data, size);
+    } else if (type == CURLINFO_HEADER_IN || type == CURLINFO_DATA_IN) {
+      mk::curl::mkcurl_record(
+          *transfer, mk::curl::RecordingChunk::received, data, size);
+    }
+  }
+  return 0;
+}
+
+static curl_socket_t mkcurl_opensocket_cb_(
+    void *userdata, curlsocktype purpose, struct curl_sockaddr *address) {
+  if (userdata == nullptr || address == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto transfer = static_cast<mk::curl::TransferState *>(userdata);
+  if (purpose == CURLSOCKTYPE_IPCXN && address->family == AF_INET) {
+    transfer->res->ipv4_connects += 1;
+  } else if (purpose == CURLSOCKTYPE_IPCXN && address->family == AF_INET6) {
+    transfer->res->ipv6_connects += 1;
+  }
+  if (purpose == CURLSOCKTYPE_IPCXN && transfer->recording != nullptr) {
+    mk::curl::mkcurl_record(
+        *transfer, mk::curl::RecordingChunk::connect, nullptr, 0);
+  }
+  // This is what cURL would do if we had not set this callback.
+  curl_socket_t sock = socket(
+      address->family, address->socktype, address->protocol);
+  if (sock != CURL_SOCKET_BAD) {
+    auto client = transfer->client;
+    client->sockets[sock] = ++client->last_connection_id;
+  }
+  return sock;
+}
+
+static int mkcurl_closesocket_cb_(void *userdata, curl_socket_t sock) {
+  if (userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  // Note: cURL stores this callback and its user data into the connection,
+  // hence they are used also after the transfer is over. This is why the
+  // user data is the ClientState, which lives as long as the handle.
+  auto client = static_cast<mk::curl::ClientState *>(userdata);
+  client->sockets.erase(sock);
+  auto transfer = client->transfer;
+  if (transfer != nullptr && transfer->socket == sock) {
+    mk::curl::mkcurl_tcp_info(sock, transfer->res->tcp_info_end);
+    transfer->socket = CURL_SOCKET_BAD;
+  }
+#ifdef _WIN32
+  return closesocket(sock);
+#else
+  return close(sock);
+#endif
+}
+
+static int mkcurl_sockopt_cb_(
+    void *userdata, curl_socket_t sock, curlsocktype purpose) {
+  if (userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  if (purpose != CURLSOCKTYPE_IPCXN) {
+    return CURL_SOCKOPT_OK;
+  }
+  auto transfer = static_cast<mk::curl::TransferState *>(userdata);
+  auto set = [&](int level, int name, int64_t value, const char *what) {
+    if (value <= 0) {
+      return true;
+    }
+    if (value > INT_MAX) value = INT_MAX;
+    int v = (int)value;
+    if (setsockopt(sock, level, name, (const char *)&v, sizeof(v)) != 0) {
+      mk::curl::mkcurl_log(transfer->res->logs,
+                           std::string{"setsockopt() failed: "} + what);
+      return false;
+    }
+    return true;
+  };
+  bool ok = set(SOL_SOCKET, SO_RCVBUF, transfer->req->so_rcvbuf,
+                "SO_RCVBUF") &&
+            set(SOL_SOCKET, SO_SNDBUF, transfer->req->so_sndbuf,
+                "SO_SNDBUF");
+#ifdef TCP_NOTSENT_LOWAT
+  ok = ok && set(IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                 transfer->req->tcp_notsent_lowat, "TCP_NOTSENT_LOWAT");
+#endif
+  return ok ? CURL_SOCKOPT_OK : CURL_SOCKOPT_ERROR;
+}
+
+static int mkcurl_xferinfo_cb_(void *userdata, curl_off_t, curl_off_t dlnow,
+                               curl_off_t, curl_off_t ulnow) {
+  if (userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto transfer = static_cast<mk::curl::TransferState *>(userdata);
+  if (transfer->req->cancellation && transfer->req->cancellation->cancelled()) {
+    return 1;  // Abort the transfer
+  }
+  // We account the uploaded bytes here because cURL sends the body
+  // directly from memory, without calling us.
+  if (transfer->limiter != nullptr && (int64_t)ulnow > transfer->bytes_up) {
+    mk::curl::mkcurl_rate_account(*transfer, mk::curl::RateDirection::up,
+                                  (int64_t)ulnow - transfer->bytes_up);
+    transfer->bytes_up = (int64_t)ulnow;
+    if (transfer->pausable && !transfer->paused &&
+        transfer->resume_at > std::chrono::steady_clock::now()) {
+      transfer->paused = true;
+      (void)curl_easy_pause(transfer->client->handle.get(), CURLPAUSE_SEND);
+    }
+  }
+  if (transfer->req->progress_interval_ms <= 0) {
+    return 0;
+  }
+  auto elapsed = std::chrono::steady_clock::now() - transfer->begin;
+  transfer->last.elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  transfer->last.bytes_down = (int64_t)dlnow;
+  transfer->last.bytes_up = (int64_t)ulnow;
+  if (transfer->last.elapsed_us >= transfer->next_sample_us) {
+    mk::curl::mkcurl_progress_sample(*transfer, transfer->last);
+    transfer->next_sample_us =
+        transfer->last.elapsed_us + transfer->req->progress_interval_ms * 1000;
+  }
+  return 0;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x075000
+static int mkcurl_prereq_cb_(void *userdata, char *, char *, int,
+                             int local_port) {
+  if (userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  // We cannot use CURLINFO_ACTIVESOCKET here, because cURL only knows the
+  // active socket at the end of the transfer, so we search the socket.
+  auto transfer = static_cast<mk::curl::TransferState *>(userdata);
+  for (auto &pair : transfer->client->sockets) {
+    if (mk::curl::mkcurl_local_port(pair.first) == local_port) {
+      transfer->socket = pair.first;
+      mk::curl::mkcurl_tcp_info(pair.first, transfer->res->tcp_info_connect);
+      break;
+    }
+  }
+  return CURL_PREREQFUNC_OK;
+}
+#endif
+
+}  // extern "C"
+
+namespace mk {
+namespace curl {
+inline namespace MKCURL_INLINE_NAMESPACE {
+
+// HTTPVersionString returns a string representation of the cURL HTTP
+// version string in @p httpv. If @p httpv has an unknown value, the
+// return value is the empty string.
+static const char *HTTPVersionString(long httpv) noexcept {
+  switch (httpv) {
+    case CURL_HTTP_VERSION_1_0:
+      return "HTTP/1.0";
+    case CURL_HTTP_VERSION_1_1:
+      return "HTTP/1.1";
+    case CURL_HTTP_VERSION_2_0:
+      return "HTTP/2";
+  }
+  return "";
+}
+
+// perform_and_retry performs the request implied by @p handle for
+// @p retries times. A request is only retried if (a) it failed and (b)
+// the reason for failure is either DNS or connect error and (c) the
+// request of @p transfer has not been cancelled. We count the retries
+// and trace the attempts using @p transfer.
+static CURLcode perform_and_retry(
+    CURL *handlep, size_t retries, TransferState &transfer) noexcept {
+  const CancellationToken *token = transfer.req->cancellation.get();
+  Logs &logs = transfer.res->logs;
+  CURLcode rv{};
+  bool retriable{};
+  for (;;) {
+    if (transfer.tracer != nullptr) mkcurl_trace_attempt_begin(transfer);
+    rv = curl_easy_perform(handlep);
+    MKCURL_HOOK(curl_easy_perform, rv);
+    if (transfer.tracer != nullptr) {
+      mkcurl_trace_attempt_end(transfer, handlep, rv);
+    }
+    retriable = retries-- > 0 && (rv == CURLE_COULDNT_CONNECT ||
+                                  rv == CURLE_COULDNT_RESOLVE_HOST) &&
+                (token == nullptr || !token->cancelled());
+    if (!retriable) {
+      break;
+    }
+    mkcurl_log(logs, "Transient failure; let's try one more time");
+    transfer.retries += 1;
+  }
+  return rv;
+}
+
+// mkcurl_response_reset resets @p res to its default state. Unlike assigning
+// a default constructed Response, this keeps the memory already allocated by
+// strings and vectors, so that we can reuse it for the next response.
+static void mkcurl_response_reset(Response &res) noexcept {
+  res.error = 0;
+  res.redirect_url.clear();
+  res.status_code = 0;
+  res.body.clear();
+  res.bytes_sent = 0;
+  res.bytes_recv = 0;
+  res.logs.clear();
+  res.request_headers.clear();
+  res.response_headers.clear();
+  res.header_fields.clear();
+  res.header_hops.clear();
+#ifndef MKCURL_NO_CERT_CAPTURE
+  res.certs.clear();
+  res.cert_chain.clear();
+#endif
+  res.content_type.clear();
+  res.http_version.clear();
+  res.cache_status.clear();
+  res.primary_ip.clear();
+  res.primary_port = 0;
+  res.local_ip.clear();
+  res.local_port = 0;
+  res.ip_family.clear();
+  res.ipv4_connects = 0;
+  res.ipv6_connects = 0;
+  res.connection_reused = false;
+  res.connection_id = 0;
+  res.family_fallback = false;
+  res.tcp_info_connect = TCPInfo{};
+  res.tcp_info_end = TCPInfo{};
+  res.progress.clear();
+  res.body_truncated = false;
+  res.queue_wait_us = 0;
+  res.hedged = false;
+  res.hedge_winner = 0;
+  res.throttled_us = 0;
+  res.memory = MemoryStats{};
+}
+
+// mkcurl_response_bytes returns the heap memory reserved by @p res.
+static int64_t mkcurl_response_bytes(const Response &res) noexcept {
+  // Short strings are stored inline, so they do not use the heap.
+  static const size_t inline_capacity = std::string{}.capacity();
+  auto str = [](const std::string &s) -> size_t {
+    return (s.capacity() > inline_capacity) ? s.capacity() + 1 : 0;
+  };
+  size_t total = str(res.redirect_url) + str(res.body) +
+                 str(res.request_headers) + str(res.response_headers) +
+                 str(res.content_type) + str(res.http_version) +
+                 str(res.cache_status) + str(res.primary_ip) +
+                 str(res.local_ip) + str(res.ip_family);
+#ifndef MKCURL_NO_LOGS
+  total += res.logs.capacity() * sizeof(Log);
+  for (auto &log : res.logs) total += str(log.line);
+#endif
+#ifndef MKCURL_NO_CERT_CAPTURE
+  total += str(res.certs) + res.cert_chain.capacity() * sizeof(Certificate);
+  for (auto &cert : res.cert_chain) total += str(cert.der) + str(cert.sha256);
+#endif
+  total += res.header_fields.capacity() * sizeof(HeaderField);
+  total += res.header_hops.capacity() * sizeof(size_t);
+  total += res.progress.capacity() * sizeof(ProgressSample);
+  return (int64_t)total;
+}
+
+// mkcurl_transfer_setup configures @p client's handle, which we create if
+// needed, to perform @p req, writing the response into @p res. We reset the
+// handle options first, but we keep existing connections etc. The state of
+// the transfer is stored into @p transfer, which must outlive the transfer.
+// @return false on failure, in which case res.error is set.
+static bool mkcurl_transfer_setup(ClientState &client, const Request &req,
+                                  Response &res,
+                                  TransferState &transfer) noexcept {
+  transfer.client = &client;
+  transfer.req = &req;
+  transfer.res = &res;
+  mkcurl_uptr &handle = client.handle;
+  if (!handle) {
+    CURL *handlep = curl_easy_init();
+    MKCURL_HOOK_ALLOC(curl_easy_init, handlep, curl_easy_cleanup);
+    handle.reset(handlep);
+    if (!handle) {
+      res.error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log(res.logs, "curl_easy_init() failed");
+      return false;
+    }
+    if (client.session_store_impl != nullptr) {
+      client.session_store_impl->import_tickets(handle.get());
+    }
+    // FALLTHROUGH
+  }
+  /*
+   * From <https://curl.haxx.se/libcurl/c/curl_easy_reset.html>:
+   *
+   *   Re-initializes all options previously set on a specified CURL handle to
+   *   the default values. This puts back the handle to the same state as it was
+   *   in when it was just created with curl_easy_init.
+   *
+   *   It does not change the following information kept in the handle: live
+   *   connections, the Session ID cache, the DNS cache, the cookies and shares.
+   *
+   * So, this allows us to reuse the existing connections with a completely
+   * new request whose options can be set from scratch below.
+   */
+  curl_easy_reset(handle.get());
+  uint16_t replay_port = 0;
+  if (client.recording_impl != nullptr &&
+      client.recording_mode == RecordingMode::record) {
+    transfer.recording = client.recording_impl;
+  } else if (client.recording_impl != nullptr) {
+#ifdef _WIN32
+    res.error = CURLE_NOT_BUILT_IN;
+    mkcurl_log(res.logs, "Replaying is not supported on Windows");
+    return false;
+#else
+    auto exchange = client.recording_impl->replay();
+    if (exchange == nullptr) {
+      res.error = error_replay_exhausted;
+      mkcurl_log(res.logs, "There are no more exchanges to replay");
+      return false;
+    }
+    transfer.replay.reset(new ReplaySession{
+        std::move(exchange),
+        client.recording_mode == RecordingMode::replay_timed});
+    replay_port = transfer.replay->start();
+    if (replay_port == 0) {
+      res.error = CURLE_COULDNT_CONNECT;
+      mkcurl_log(res.logs, "Cannot listen for replaying the exchange");
+      return false;
+    }
+#endif
+  }
+  for (auto &s : req.headers) {
+    curl_slist *slistp = curl_slist_append(transfer.headers.p, s.c_str());
+    MKCURL_HOOK_ALLOC(curl_slist_append_headers, slistp, curl_slist_free_all);
+    if ((transfer.headers.p = slistp) == nullptr) {
+      res.error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log(res.logs, "curl_slist_append() failed");
+      return false;
+    }
+  }
+  // When replaying, we connect to the ReplaySession, so that cURL does not
+  // resolve the host nor use the network.
+  std::string connect_to = req.connect_to;
+  if (transfer.replay != nullptr) {
+    connect_to = "::127.0.0.1:" + std::to_string((unsigned)replay_port);
+  }
+  if (!connect_to.empty()) {
+    curl_slist *slistp = curl_slist_append(
+        transfer.connect_to_settings.p, connect_to.c_str());
+    MKCURL_HOOK_ALLOC(
+        curl_slist_append_connect_to, slistp, curl_slist_free_all);
+    if ((transfer.connect_to_settings.p = slistp) == nullptr) {
+      res.error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log(res.logs, "curl_slist_append() failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CONNECT_TO,
+                                 transfer.connect_to_settings.p);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CONNECT_TO, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CONNECT_TO) failed");
+      return false;
+    }
+  }
+  for (auto &entry : mkcurl_resolve_entries(client, req)) {
+    curl_slist *slistp = curl_slist_append(
+        transfer.resolve_settings.p, entry.c_str());
+    MKCURL_HOOK_ALLOC(curl_slist_append_resolve, slistp, curl_slist_free_all);
+    if ((transfer.resolve_settings.p = slistp) == nullptr) {
+      res.error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log(res.logs, "curl_slist_append() failed");
+      return false;
+    }
+  }
+  if (transfer.resolve_settings.p != nullptr) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_RESOLVE,
+                                 transfer.resolve_settings.p);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_RESOLVE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_RESOLVE) failed");
+      return false;
+    }
+  }
+  if (req.ip_version != IPVersion::any) {
+    long ipresolve = (req.ip_version == IPVersion::v4) ? CURL_IPRESOLVE_V4
+                                                       : CURL_IPRESOLVE_V6;
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_IPRESOLVE, ipresolve);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_IPRESOLVE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_IPRESOLVE) failed");
+      return false;
+    }
+  }
+  if (req.happy_eyeballs_timeout_ms > 0) {
+    res.error = curl_easy_setopt(
+        handle.get(), CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+        (long)req.happy_eyeballs_timeout_ms);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs,
+          "curl_easy_setopt(CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS) failed");
+      return false;
+    }
+  }
+  if (!req.unix_socket_path.empty() && transfer.replay == nullptr) {
+    if (req.abstract_unix_socket) {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_ABSTRACT_UNIX_SOCKET,
+                                   req.unix_socket_path.c_str());
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_ABSTRACT_UNIX_SOCKET, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log(res.logs,
+            "curl_easy_setopt(CURLOPT_ABSTRACT_UNIX_SOCKET) failed");
+        return false;
+      }
+    } else {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_UNIX_SOCKET_PATH,
+                                   req.unix_socket_path.c_str());
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_UNIX_SOCKET_PATH, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log(res.logs,
+            "curl_easy_setopt(CURLOPT_UNIX_SOCKET_PATH) failed");
+        return false;
+      }
+    }
+  }
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_OPENSOCKETFUNCTION,
+                                 mkcurl_opensocket_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_OPENSOCKETFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs,
+          "curl_easy_setopt(CURLOPT_OPENSOCKETFUNCTION) failed");
+      return false;
+    }
+  }
+  {
+    res.error = curl_easy_setopt(
+        handle.get(), CURLOPT_OPENSOCKETDATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_OPENSOCKETDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_OPENSOCKETDATA) failed");
+      return false;
+    }
+  }
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CLOSESOCKETFUNCTION,
+                                 mkcurl_closesocket_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CLOSESOCKETFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs,
+          "curl_easy_setopt(CURLOPT_CLOSESOCKETFUNCTION) failed");
+      return false;
+    }
+  }
+  {
+    res.error = curl_easy_setopt(
+        handle.get(), CURLOPT_CLOSESOCKETDATA, &client);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CLOSESOCKETDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CLOSESOCKETDATA) failed");
+      return false;
+    }
+  }
+  if (req.so_rcvbuf > 0 || req.so_sndbuf > 0 || req.tcp_notsent_lowat > 0) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_SOCKOPTFUNCTION,
+                                 mkcurl_sockopt_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_SOCKOPTFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_SOCKOPTFUNCTION) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_SOCKOPTDATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_SOCKOPTDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_SOCKOPTDATA) failed");
+      return false;
+    }
+  }
+  if (req.enable_tcp_info) {
+#if LIBCURL_VERSION_NUM >= 0x075000
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_PREREQFUNCTION,
+                                 mkcurl_prereq_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_PREREQFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_PREREQFUNCTION) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_PREREQDATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_PREREQDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_PREREQDATA) failed");
+      return false;
+    }
+#else
+    // Without CURLOPT_PREREQFUNCTION we cannot find out the socket used
+    // by the transfer, hence TCP_INFO won't be available.
+    mkcurl_log(res.logs, "TCP_INFO requires cURL >= 7.80.0");
+#endif
+  }
+  transfer.limiter = client.rate_limiter_impl;
+  transfer.tracer = client.tracer_impl;
+  // The transfer info callback samples the progress, checks whether the
+  // request has been cancelled and accounts the uploaded bytes.
+  if (req.progress_interval_ms > 0 || req.cancellation ||
+      transfer.limiter != nullptr) {
+    if (req.progress_interval_ms > 0) {
+      // Reserving means that we don't need to allocate while sampling
+      // unless the transfer is longer than the timeout (or one minute).
+      int64_t duration_ms = (req.timeout > 0 ? req.timeout : 60) * 1000;
+      res.progress.reserve(
+          (size_t)std::min(duration_ms / req.progress_interval_ms + 2,
+                           (int64_t)4096));
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION,
+                                 mkcurl_xferinfo_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_XFERINFOFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_XFERINFOFUNCTION) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_XFERINFODATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_XFERINFODATA) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_NOPROGRESS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_NOPROGRESS) failed");
+      return false;
+    }
+  }
+  if (req.enable_fastopen) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_TCP_FASTOPEN, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TCP_FASTOPEN, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_TCP_FASTOPEN) failed");
+      return false;
+    }
+  }
+  if (!req.ca_path.empty()) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CAINFO,
+                                 req.ca_path.c_str());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAINFO, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAINFO) failed");
+      return false;
+    }
+#ifdef MKCURL_OPENSSL
+  } else if (client.trust_store_impl != nullptr &&
+             client.trust_store_impl->store != nullptr) {
+    // Tell cURL not to load any CA, and give each new SSL_CTX the parsed
+    // certificates from mkcurl_ssl_ctx_cb_.
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CAINFO, nullptr);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAINFO, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAINFO) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CAPATH, nullptr);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAPATH, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAPATH) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_SSL_CTX_FUNCTION,
+                                 mkcurl_ssl_ctx_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_SSL_CTX_FUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs,
+                 "curl_easy_setopt(CURLOPT_SSL_CTX_FUNCTION) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_SSL_CTX_DATA,
+                                 client.trust_store_impl->store);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_SSL_CTX_DATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_SSL_CTX_DATA) failed");
+      return false;
+    }
+#endif
+  } else if (client.trust_store_impl != nullptr) {
+#if LIBCURL_VERSION_NUM >= 0x074d00
+    // Note: the TrustStore outlives the transfer, so we don't need cURL to
+    // copy the bundle, which could be hundreds of kilobytes.
+    curl_blob blob{};
+    blob.data = (void *)client.trust_store_impl->bundle.data();
+    blob.len = client.trust_store_impl->bundle.size();
+    blob.flags = CURL_BLOB_NOCOPY;
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CAINFO_BLOB, &blob);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAINFO_BLOB, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAINFO_BLOB) failed");
+      return false;
+    }
+#else
+    // Without CURLOPT_CAINFO_BLOB, we can only tell cURL to read the file.
+    if (client.trust_store_impl->path.empty()) {
+      res.error = CURLE_NOT_BUILT_IN;
+      mkcurl_log(res.logs, "cURL does not support in-memory CA bundles");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CAINFO,
+                                 client.trust_store_impl->path.c_str());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAINFO, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAINFO) failed");
+      return false;
+    }
+#endif
+  }
+  if (req.enable_http2 && client.recording_impl != nullptr) {
+    mkcurl_log(res.logs, "We only record and replay HTTP/1.1");
+  } else if (req.enable_http2) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_HTTP_VERSION,
+                                 CURL_HTTP_VERSION_2_0);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HTTP_VERSION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HTTP_VERSION) failed");
+      return false;
+    }
+  }
+  if (req.method == "POST" || req.method == "PUT") {
+    // Disable sending `Expect: 100 continue`. There are actually good
+    // arguments against NOT sending this specific HTTP header by default
+    // with P{OS,U}T <https://curl.haxx.se/mail/lib-2017-07/0013.html>.
+    {
+      curl_slist *slistp = curl_slist_append(transfer.headers.p, "Expect:");
+      MKCURL_HOOK_ALLOC(
+          curl_slist_append_Expect_header, slistp, curl_slist_free_all);
+      if ((transfer.headers.p = slistp) == nullptr) {
+        res.error = CURLE_OUT_OF_MEMORY;
+        mkcurl_log(res.logs, "curl_slist_append() failed");
+        return false;
+      }
+    }
+    {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_POST, 1L);
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POST, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_POST) failed");
+        return false;
+      }
+    }
+    {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDS,
+                                   req.body.c_str());
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
+        return false;
+      }
+    }
+    // The following is very important to allow us to upload any kind of
+    // binary file, otherwise CURL will use strlen(). We do not need to
+    // send more than 2 GiB of data, hence we can safely limit ourself to
+    // using CURLOPT_POSTFIELDSIZE that takes a `long` argument.
+    {
+      bool body_size_overflow = (req.body.size() > LONG_MAX);
+      MKCURL_HOOK(body_size_overflow_inject, body_size_overflow);
+      if (body_size_overflow) {
+        mkcurl_log(res.logs, "Body larger than LONG_MAX");
+        res.error = CURLE_FILESIZE_EXCEEDED;
+        return false;
+      }
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDSIZE,
+                                   (long)req.body.size());
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log(res.logs, "curl_easy_setopt(MKCURLOPT_POSTFIELDSIZE) failed");
+        return false;
+      }
+    }
+    if (req.method == "PUT") {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_CUSTOMREQUEST, "PUT");
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_CUSTOMREQUEST, res.error);
+      if (res.error) {
+        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CUSTOMREQUEST) failed");
+        return false;
+      }
+    }
+  } else if (req.method != "GET") {
+    res.error = CURLE_BAD_FUNCTION_ARGUMENT;
+    mkcurl_log(res.logs, "unsupported request method");
+    return false;
+  }
+  if (transfer.headers.p != nullptr) {
+    res.error = curl_easy_setopt(
+        handle.get(), CURLOPT_HTTPHEADER, transfer.headers.p);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HTTPHEADER, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
+      return false;
+    }
+  }
+  {
+    // When replaying, the exchange is in plaintext, even if it was over TLS.
+    std::string plaintext_url;
+    const char *url = req.url.c_str();
+    if (transfer.replay != nullptr &&
+        mkcurl_tolower(req.url.substr(0, 8)) == "https://") {
+      plaintext_url = "http://" + req.url.substr(8);
+      url = plaintext_url.c_str();
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_URL, url);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_URL, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_URL) failed");
+      return false;
+    }
+  }
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION,
+                                 mkcurl_body_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_WRITEFUNCTION) failed");
+      return false;
+    }
+  }
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_WRITEDATA) failed");
+      return false;
+    }
+  }
+  if (req.max_body_size > 0 && !req.keep_truncated_body) {
+    // This allows cURL to reject a large Content-Length early.
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAXFILESIZE_LARGE,
+                                 (curl_off_t)req.max_body_size);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAXFILESIZE_LARGE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs,
+          "curl_easy_setopt(CURLOPT_MAXFILESIZE_LARGE) failed");
+      return false;
+    }
+  }
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_HEADERFUNCTION,
+                                 mkcurl_header_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HEADERFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HEADERFUNCTION) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_HEADERDATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HEADERDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HEADERDATA) failed");
+      return false;
+    }
+  }
+  // CURL uses MSG_NOSIGNAL where available (i.e. Linux) and SO_NOSIGPIPE
+  // where available (i.e. BSD). This covers all the UNIX operating systems
+  // that we care about (Android, Linux, iOS, macOS). We additionally need
+  // to avoid signals because we are acting as a library that is integrated
+  // into several different languages, so stealing the signal handler from
+  // the language MAY have a negative impact. However, disabling signal
+  // handlers will also make the getaddrinfo() resolver in cURL block until
+  // getaddrinfo() returns, unless we're using the threaded or the c-ares
+  // DNS backend. Since the threaded resolver should now be used in most
+  // Unix distros, we need mainly to remember to enable it when we're cross
+  // compiling cURL in measurement-kit/script-build-unix.
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_NOSIGNAL) failed");
+      return false;
+    }
+  }
+  {
+    long t = 0L; // Note: `0L` means "infinite" for CURLOPT_TIMEOUT.
+    if (req.timeout >= 0 && req.timeout < LONG_MAX) t = (long)req.timeout;
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_TIMEOUT, t);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TIMEOUT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_TIMEOUT) failed");
+      return false;
+    }
+  }
+  bool debug = true;
+#if defined(MKCURL_NO_LOGS) && defined(MKCURL_NO_BYTE_COUNTING)
+  // We only need debug data for tracing and recording. Otherwise, we also
+  // save cURL the cost of formatting its verbose messages.
+  debug = transfer.tracer != nullptr || transfer.recording != nullptr;
+#endif
+  if (debug) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_DEBUGFUNCTION,
+                                 mkcurl_debug_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_DEBUGFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_DEBUGFUNCTION) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_DEBUGDATA, &transfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_DEBUGDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_DEBUGDATA) failed");
+      return false;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_VERBOSE, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_VERBOSE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_VERBOSE) failed");
+      return false;
+    }
+  }
+  if (!req.proxy_url.empty() && transfer.replay == nullptr) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_PROXY,
+                                 req.proxy_url.c_str());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_PROXY, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_PROXY) failed");
+      return false;
+    }
+  }
+  if (req.follow_redir) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_FOLLOWLOCATION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_FOLLOWLOCATION) failed");
+      return false;
+    }
+  }
+  if (req.cert_capture != CertCapture::none) {
+#ifndef MKCURL_NO_CERT_CAPTURE
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CERTINFO, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CERTINFO) failed");
+      return false;
+    }
+#else
+    res.error = CURLE_NOT_BUILT_IN;
+    mkcurl_log(res.logs, "Compiled with MKCURL_NO_CERT_CAPTURE");
+    return false;
+#endif
   }
-  if (ptr == nullptr || userdata == nullptr) {
-    MKCURL_ABORT();
+  if (transfer.replay != nullptr) {
+    // Each connection is served by the ReplaySession of this request, which
+    // the next request cannot use, so we must not reuse it.
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_FORBID_REUSE, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_FORBID_REUSE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_FORBID_REUSE) failed");
+      return false;
+    }
   }
-  auto realsiz = size * nmemb;  // Overflow or zero not possible (see above)
-  auto res = static_cast<mk::curl::Response *>(userdata);
-  res->body += std::string{ptr, realsiz};
-  // From fwrite(3): "[the return value] equals the number of bytes
-  // written _only_ when `size` equals `1`". See also
-  // https://sourceware.org/git/?p=glibc.git;a=blob;f=libio/iofwrite.c;h=800341b7da546e5b7fd2005c5536f4c90037f50d;hb=HEAD#l29
-  return nmemb;
+  if (client.pool.max_connections > 0) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAXCONNECTS,
+                                 (long)client.pool.max_connections);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAXCONNECTS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_MAXCONNECTS) failed");
+      return false;
+    }
+  }
+  if (client.pool.max_idle_seconds > 0) {
+#if LIBCURL_VERSION_NUM >= 0x074100
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAXAGE_CONN,
+                                 (long)client.pool.max_idle_seconds);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAXAGE_CONN, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_MAXAGE_CONN) failed");
+      return false;
+    }
+#else
+    res.error = CURLE_NOT_BUILT_IN;
+    mkcurl_log(res.logs, "The maximum idle time requires cURL >= 7.65.0");
+    return false;
+#endif
+  }
+  if (client.pool.max_age_seconds > 0) {
+#if LIBCURL_VERSION_NUM >= 0x075000
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAXLIFETIME_CONN,
+                                 (long)client.pool.max_age_seconds);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAXLIFETIME_CONN, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs,
+                 "curl_easy_setopt(CURLOPT_MAXLIFETIME_CONN) failed");
+      return false;
+    }
+#else
+    res.error = CURLE_NOT_BUILT_IN;
+    mkcurl_log(res.logs, "The maximum connection age requires cURL >= 7.80.0");
+    return false;
+#endif
+  }
+  return true;
 }
 
-static int mkcurl_debug_cb_(CURL *handle,
-                            curl_infotype type,
-                            char *data,
-                            size_t size,
-                            void *userptr) {
-  (void)handle;
-  if (data == nullptr || userptr == nullptr) {
-    MKCURL_ABORT();
+#ifndef MKCURL_NO_CERT_CAPTURE
+// Sha256 computes a SHA-256 digest (see FIPS 180-4) incrementally, so that
+// we can hash certificates while decoding them. With MKCURL_OPENSSL we use
+// the much faster OpenSSL implementation, and otherwise our own, which
+// processes whole 64-byte blocks whenever possible.
+class Sha256 {
+ public:
+  Sha256() noexcept {
+#ifdef MKCURL_OPENSSL
+    ctx_ = EVP_MD_CTX_new();
+    if (ctx_ != nullptr &&
+        EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr) != 1) {
+      EVP_MD_CTX_free(ctx_);
+      ctx_ = nullptr;  // Fall back to our own implementation
+    }
+#endif
   }
-  auto res = static_cast<mk::curl::Response *>(userptr);
 
-  auto log_many_lines = [&](std::string prefix, const std::string &str) {
-    std::stringstream ss;
-    ss << str;
-    std::string line;
-    while (std::getline(ss, line, '\n')) {
-      std::stringstream logline;
-      if (!prefix.empty()) {
-        logline << prefix << " ";
+  Sha256(const Sha256 &) noexcept = delete;
+  Sha256 &operator=(const Sha256 &) noexcept = delete;
+  Sha256(Sha256 &&) noexcept = delete;
+  Sha256 &operator=(Sha256 &&) noexcept = delete;
+
+  ~Sha256() noexcept {
+#ifdef MKCURL_OPENSSL
+    EVP_MD_CTX_free(ctx_);
+#endif
+  }
+
+  // update adds the @p count bytes starting at @p data to the digest.
+  void update(const uint8_t *data, size_t count) noexcept {
+    if (count <= 0) return;
+#ifdef MKCURL_OPENSSL
+    if (ctx_ != nullptr) {
+      if (EVP_DigestUpdate(ctx_, data, count) != 1) failed_ = true;
+      return;
+    }
+#endif
+    length_ += (uint64_t)count * 8;
+    if (used_ > 0) {
+      size_t n = std::min(count, sizeof(block_) - used_);
+      memcpy(block_ + used_, data, n);
+      used_ += n;
+      data += n;
+      count -= n;
+      if (used_ < sizeof(block_)) return;
+      compress(block_);
+      used_ = 0;
+    }
+    for (; count >= sizeof(block_); count -= sizeof(block_)) {
+      compress(data);
+      data += sizeof(block_);
+    }
+    if (count > 0) memcpy(block_, data, count);
+    used_ = count;
+  }
+
+  // hexdigest finalizes the digest and returns it in hexadecimal notation,
+  // or an empty string if OpenSSL failed.
+  std::string hexdigest() noexcept {
+    uint8_t digest[32];
+#ifdef MKCURL_OPENSSL
+    if (ctx_ != nullptr) {
+      unsigned int size = 0;
+      if (failed_ || EVP_DigestFinal_ex(ctx_, digest, &size) != 1 ||
+          size != sizeof(digest)) {
+        return "";
       }
-      logline << line;
-      mkcurl_log(res->logs, logline.str());
+      return hex(digest);
+    }
+#endif
+    uint64_t length = length_;
+    static const uint8_t padding[64] = {0x80};
+    update(padding, ((used_ < 56) ? 56 : 120) - used_);
+    uint8_t trailer[8];
+    for (size_t i = 0; i < 8; ++i) {
+      trailer[i] = (uint8_t)(length >> (56 - 8 * i));
+    }
+    update(trailer, sizeof(trailer));
+    for (size_t i = 0; i < 32; ++i) {
+      digest[i] = (uint8_t)(state_[i / 4] >> (24 - 8 * (i % 4)));
+    }
+    return hex(digest);
+  }
+
+ private:
+  static std::string hex(const uint8_t (&digest)[32]) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(2 * sizeof(digest));
+    for (auto byte : digest) {
+      out += digits[byte >> 4];
+      out += digits[byte & 0xf];
+    }
+    return out;
+  }
+
+  static uint32_t rotr(uint32_t x, int n) noexcept {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  // compress processes the 64-byte @p block.
+  void compress(const uint8_t *block) noexcept {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+        0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+        0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+        0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+        0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+        0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+        0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+        0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (size_t i = 0; i < 16; ++i) {
+      w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+             (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (size_t i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    std::copy(std::begin(state_), std::end(state_), std::begin(v));
+    for (size_t i = 0; i < 64; ++i) {
+      uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+      uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+      uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+      uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+      uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+      std::copy_backward(v, v + 7, v + 8);
+      v[4] += t1;
+      v[0] = t1 + s0 + maj;
     }
+    for (size_t i = 0; i < 8; ++i) state_[i] += v[i];
+  }
+
+#ifdef MKCURL_OPENSSL
+  // ctx_ is the OpenSSL digest context, if we could create it.
+  EVP_MD_CTX *ctx_ = nullptr;
+  // failed_ indicates that updating ctx_ failed.
+  bool failed_ = false;
+#endif
+
+  uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  uint8_t block_[64] = {};
+  size_t used_ = 0;
+  uint64_t length_ = 0;
+};
+
+// mkcurl_base64_value returns the value of the base64 digit @p c or -1.
+static int mkcurl_base64_value(char c) noexcept {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+// mkcurl_cert_decode decodes the PEM certificate @p pem into @p cert. We
+// decode and hash in a single pass, through a small buffer such that we hash
+// whole blocks, and we only keep the DER encoding if @p capture requires it,
+// so fingerprints do not need any copy.
+static bool mkcurl_cert_decode(
+    const char *pem, CertCapture capture, Certificate &cert) noexcept {
+  const char *p = strstr(pem, "-----BEGIN");
+  if (p == nullptr || (p = strchr(p, '\n')) == nullptr) return false;
+  bool keep_der = capture == CertCapture::chain || capture == CertCapture::pem;
+  if (keep_der) cert.der.reserve(strlen(p) / 4 * 3);
+  Sha256 sha256;
+  uint8_t chunk[512];
+  size_t used = 0;
+  auto flush = [&]() {
+    sha256.update(chunk, used);
+    if (keep_der) cert.der.append((const char *)chunk, used);
+    used = 0;
   };
+  uint32_t bits = 0;
+  int nbits = 0;
+  for (++p; *p != '\0' && *p != '=' && *p != '-'; ++p) {
+    int value = mkcurl_base64_value(*p);
+    if (value < 0) {
+      if (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t') continue;
+      return false;
+    }
+    bits = (bits << 6 | (uint32_t)value) & 0xffffff;
+    if ((nbits += 6) >= 8) {
+      nbits -= 8;
+      chunk[used++] = (uint8_t)(bits >> nbits);
+      if (used == sizeof(chunk)) flush();
+    }
+  }
+  flush();
+  cert.sha256 = sha256.hexdigest();
+  return !cert.sha256.empty();
+}
+#endif
 
-  switch (type) {
-    case CURLINFO_TEXT:
-      log_many_lines("", std::string{(const char *)data, size});
-      break;
-    case CURLINFO_HEADER_IN:
-      {
-        std::string s{(const char *)data, size};
-        log_many_lines("<", s);
-        res->response_headers += s;
-      }
-      break;
-    case CURLINFO_DATA_IN:
-      log_many_lines("<data:", std::to_string(size));
-      break;
-    case CURLINFO_SSL_DATA_IN:
-      log_many_lines("<tls_data:", std::to_string(size));
-      break;
-    case CURLINFO_HEADER_OUT:
-      {
-        std::string s{(const char *)data, size};
-        log_many_lines(">", s);
-        res->request_headers += s;
+// mkcurl_transfer_finish completes @p res after the transfer configured by
+// mkcurl_transfer_setup is over and res.error contains its result.
+static void mkcurl_transfer_finish_response(
+    ClientState &client, const Request &req, Response &res,
+    TransferState &transfer) noexcept {
+  mkcurl_uptr &handle = client.handle;
+  if (req.progress_interval_ms > 0 &&
+      (res.progress.empty() ||
+       res.progress.back().elapsed_us != transfer.last.elapsed_us)) {
+    mkcurl_progress_sample(transfer, transfer.last);
+  }
+  if (req.enable_tcp_info && transfer.socket != CURL_SOCKET_BAD) {
+    // The connection is still open, because otherwise we would have
+    // read its TCP_INFO when cURL closed it (see mkcurl_closesocket_cb_).
+    mkcurl_tcp_info(transfer.socket, res.tcp_info_end);
+  }
+  if (res.error == CURLE_WRITE_ERROR && res.body_truncated &&
+      req.keep_truncated_body) {
+    mkcurl_log(res.logs, "The body has been truncated");
+    res.error = CURLE_OK;
+  }
+  if (res.error != CURLE_OK) {
+    std::stringstream ss;
+    ss << "curl_easy_perform: " << curl_easy_strerror((CURLcode)res.error);
+    mkcurl_log(res.logs, ss.str());
+    if (req.cancellation && req.cancellation->cancelled()) {
+      res.error = error_cancelled;
+      mkcurl_log(res.logs, "The request has been cancelled");
+    } else if (res.error == CURLE_WRITE_ERROR && res.body_truncated) {
+      res.error = CURLE_FILESIZE_EXCEEDED;
+      mkcurl_log(res.logs, "The body is larger than max_body_size");
+    } else if (res.error == CURLE_WRITE_ERROR && transfer.headers_too_large) {
+      res.error = error_headers_too_large;
+      mkcurl_log(res.logs, "The headers are larger than max_header_bytes");
+    }
+    return;
+  }
+  {
+    long status_code = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_RESPONSE_CODE, &status_code);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_RESPONSE_CODE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_RESPONSE_CODE) failed");
+      return;
+    }
+    res.status_code = (int64_t)status_code;
+  }
+  {
+    char *url = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_REDIRECT_URL, &url);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_URL, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_REDIRECT_URL) failed");
+      return;
+    }
+    if (url != nullptr) res.redirect_url = url;
+  }
+#ifndef MKCURL_NO_CERT_CAPTURE
+  if (req.cert_capture != CertCapture::none) {
+    curl_certinfo *certinfo = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_CERTINFO, &certinfo);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_CERTINFO) failed");
+      return;
+    }
+    if (certinfo != nullptr && certinfo->num_of_certs > 0) {
+      for (int i = 0; i < certinfo->num_of_certs; i++) {
+        for (auto slist = certinfo->certinfo[i]; slist; slist = slist->next) {
+          // Just process the certificates and ignore the rest.
+          if (slist->data == nullptr || strncmp(slist->data, "Cert:", 5) != 0) {
+            continue;
+          }
+          const char *pem = slist->data + 5;
+          Certificate cert;
+          if (!mkcurl_cert_decode(pem, req.cert_capture, cert)) {
+            mkcurl_log(res.logs, "Cannot decode a certificate");
+            continue;
+          }
+          res.cert_chain.push_back(std::move(cert));
+          if (req.cert_capture == CertCapture::pem) {
+            res.certs += pem;
+            res.certs += "\n";
+          }
+        }
       }
-      break;
-    case CURLINFO_DATA_OUT:
-      log_many_lines(">data:", std::to_string(size));
-      break;
-    case CURLINFO_SSL_DATA_OUT:
-      log_many_lines(">tls_data:", std::to_string(size));
-      break;
-    case CURLINFO_END:
-      /* NOTHING */
-      break;
+    }
+  }
+#endif
+  {
+    char *ct = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_CONTENT_TYPE, &ct);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CONTENT_TYPE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_CONTENT_TYPE) failed");
+      return;
+    }
+    if (ct != nullptr) res.content_type = ct;
+  }
+  {
+    long httpv = 0L;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_HTTP_VERSION, &httpv);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_HTTP_VERSION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_HTTP_VERSION) failed");
+      return;
+    }
+    res.http_version = HTTPVersionString(httpv);
   }
+  {
+    char *ip = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_PRIMARY_IP, &ip);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_IP, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_PRIMARY_IP) failed");
+      return;
+    }
+    if (ip != nullptr) res.primary_ip = ip;
+  }
+  {
+    long port = 0L;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_PRIMARY_PORT, &port);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_PORT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_PRIMARY_PORT) failed");
+      return;
+    }
+    res.primary_port = (int64_t)port;
+  }
+  {
+    char *ip = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_LOCAL_IP, &ip);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_IP, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_LOCAL_IP) failed");
+      return;
+    }
+    if (ip != nullptr) res.local_ip = ip;
+  }
+  {
+    long port = 0L;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_LOCAL_PORT, &port);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_PORT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_LOCAL_PORT) failed");
+      return;
+    }
+    res.local_port = (int64_t)port;
+  }
+  {
+    long connects = 0L;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_NUM_CONNECTS,
+                                  &connects);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_NUM_CONNECTS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_NUM_CONNECTS) failed");
+      return;
+    }
+    res.connection_reused = connects == 0L;
+  }
+  {
+    curl_socket_t sock = CURL_SOCKET_BAD;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_ACTIVESOCKET, &sock);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_ACTIVESOCKET, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_ACTIVESOCKET) failed");
+      return;
+    }
+    auto it = client.sockets.find(sock);
+    if (it != client.sockets.end()) res.connection_id = it->second;
+  }
+  if (!req.unix_socket_path.empty()) {
+    res.ip_family = "unix";
+  } else if (!res.primary_ip.empty()) {
+    res.ip_family = (res.primary_ip.find(':') != std::string::npos) ? "ipv6"
+                                                                    : "ipv4";
+  }
+  res.family_fallback = res.ipv4_connects > 0 && res.ipv6_connects > 0;
+  // When using connect_to, a proxy or a Unix domain socket, the address we
+  // connected to is not necessarily an address of the host, so we must not
+  // record it.
+  std::string key;
+  if ((!client.resolve_injected.empty() ||
+       client.session_store_impl != nullptr) &&
+      req.connect_to.empty() && req.proxy_url.empty() &&
+      req.unix_socket_path.empty() &&
+      mkcurl_primary_endpoint(handle.get(), res, key)) {
+    if (client.resolve_injected.count(key) != 0) {
+      client.resolve_working[key] = res.primary_ip;
+    }
+    if (client.session_store_impl != nullptr) {
+      client.session_store_impl->record(key, res.primary_ip);
+    }
+  }
+}
 
-  // Note regarding counting TLS data
-  // ````````````````````````````````
-  //
-  // I am using the technique recommended by Stenberg on Stack Overflow [1]. It
-  // was initially not clear to me whether cURL using OpenSSL counted the data
-  // twice, once encrypted and once in clear text. However, using cURL using
-  // OpenSSL on Linux and reading the source code [2] helped me to clarify that
-  // it does indeed the right thing [3]. When using other TLS backends, it may
-  // be that TLS data is not counted, but that's okay since we tell to users
-  // that this is an estimate of the amount of used data.
-  //
-  // Notes
-  // `````
-  //
-  // .. [1] https://stackoverflow.com/a/26905099
-  //
-  // .. [2] https://github.com/curl/curl/blob/6684653b/lib/vtls/openssl.c#L2295
-  //
-  // .. [3] the SSL function used is SSL_CTX_set_msg_callback which "[is] never
-  //        [called for] application_data(23) because the callback will only be
-  //        called for protocol messages" [4].
-  //
-  // .. [4] https://www.openssl.org/docs/man1.1.0/ssl/SSL_CTX_set_msg_callback.html
-  switch (type) {
-    case CURLINFO_HEADER_IN:
-    case CURLINFO_DATA_IN:
-    case CURLINFO_SSL_DATA_IN:
-      // Implementation note: overflow is unlikely, so we don't care.
-      res->bytes_recv += size;
-      break;
-    case CURLINFO_HEADER_OUT:
-    case CURLINFO_DATA_OUT:
-    case CURLINFO_SSL_DATA_OUT:
-      // Implementation note: overflow is unlikely, so we don't care.
-      res->bytes_sent += size;
-      break;
-    case CURLINFO_TEXT:
-    case CURLINFO_END:
-      /* NOTHING */
-      break;
+// mkcurl_circuit_outcome returns the outcome of the transfer performed by
+// @p handle that ended with @p rv, as seen by a CircuitBreaker.
+static CircuitOutcome mkcurl_circuit_outcome(
+    CURL *handle, CURLcode rv, Logs &logs) noexcept {
+  if (rv == CURLE_COULDNT_RESOLVE_HOST || rv == CURLE_COULDNT_CONNECT) {
+    return CircuitOutcome::failed;
+  }
+  if (rv != CURLE_OPERATION_TIMEDOUT) {
+    return CircuitOutcome::connected;
+  }
+  // A timeout is a connect failure only if we never connected.
+  double connect_time = 0.0;
+  auto err = curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &connect_time);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CONNECT_TIME, err);
+  if (err != CURLE_OK) {
+    mkcurl_log(logs, "curl_easy_getinfo(CURLINFO_CONNECT_TIME) failed");
+    return CircuitOutcome::unknown;
+  }
+  return (connect_time > 0.0) ? CircuitOutcome::connected
+                              : CircuitOutcome::failed;
+}
+
+// mkcurl_metrics_record records the metrics of the transfer performed by
+// @p handle, which produced @p res, into @p shard.
+static void mkcurl_metrics_record(
+    CURL *handle, const Response &res, const TransferState &transfer,
+    MetricsShard &shard) noexcept {
+  mkcurl_metrics_add(shard.requests, 1);
+  mkcurl_metrics_add(shard.retries, transfer.retries);
+  mkcurl_metrics_add(shard.bytes_sent, res.bytes_sent);
+  mkcurl_metrics_add(shard.bytes_recv, res.bytes_recv);
+  if (res.error != 0) {
+    int64_t index = res.error + mkcurl_metrics_errors_offset;
+    if (index < 0 || index >= mkcurl_metrics_errors) {
+      index = CURL_LAST + mkcurl_metrics_errors_offset;
+    }
+    mkcurl_metrics_add(shard.errors[index], 1);
+  }
+  if (res.status_code > 0) {
+    mkcurl_metrics_add(shard.statuses[(res.status_code <
+                                       mkcurl_metrics_statuses)
+                                          ? res.status_code
+                                          : 0],
+                       1);
   }
+  // Note: these cURL times are in seconds since the start of the transfer
+  // and they are zero for the phases that did not happen.
+  double total = 0.0, first_byte = 0.0, connect = 0.0, tls = 0.0;
+  long connects = 0L;
+  CURLcode rv = curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_NUM_CONNECTS, rv);
+  if (rv != CURLE_OK) return;
+  mkcurl_metrics_add(shard.connections_opened, (int64_t)connects);
+  if (connects == 0L && res.error == 0) {
+    mkcurl_metrics_add(shard.connections_reused, 1);
+  }
+  rv = curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &total);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_TOTAL_TIME, rv);
+  if (rv != CURLE_OK) return;
+  shard.total.record((int64_t)(total * 1e06));
+  rv = curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_STARTTRANSFER_TIME, rv);
+  if (rv != CURLE_OK) return;
+  if (first_byte > 0.0) shard.first_byte.record((int64_t)(first_byte * 1e06));
+  if (connects == 0L) return;
+  rv = curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &connect);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CONNECT_TIME, rv);
+  if (rv != CURLE_OK) return;
+  if (connect > 0.0) shard.connect.record((int64_t)(connect * 1e06));
+  rv = curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME, &tls);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_APPCONNECT_TIME, rv);
+  if (rv != CURLE_OK) return;
+  if (tls > connect) shard.tls.record((int64_t)((tls - connect) * 1e06));
+}
 
-  return 0;
+// mkcurl_transfer_finish maps the result of the transfer and fills @p res
+// using @p client's handle, then records the metrics, the trace and the
+// exchange, if needed.
+static void mkcurl_transfer_finish(ClientState &client, const Request &req,
+                                   Response &res,
+                                   TransferState &transfer) noexcept {
+  if (transfer.replay != nullptr) {
+    transfer.replay->stop();
+    if (transfer.replay->diverged) {
+      mkcurl_log(res.logs, "The request differs from the recorded one");
+    }
+  }
+  mkcurl_transfer_finish_response(client, req, res, transfer);
+  if (client.metrics_shard != nullptr) {
+    mkcurl_metrics_record(
+        client.handle.get(), res, transfer, *client.metrics_shard);
+  }
+  if (transfer.tracer != nullptr) {
+    mkcurl_trace_flush(transfer, req, res);
+  }
+  if (transfer.recording != nullptr) {
+    transfer.recording->add(std::move(transfer.exchange));
+  }
+}
+
+// perform2 will use @p client's handle to perform @p req. If the handle is not
+// set we will initialise it. Otherwise the handle options are
+// reset to allow constructing a fresh HTTP request. Still, in such case, we'll
+// reuse existing connections etc. The response is written into @p res, which
+// we reset first, while keeping the memory it has already allocated.
+// mkcurl_circuit_key returns the `host:port` of the circuit of the
+// CircuitBreaker of @p client that @p req belongs to, or an empty string
+// if @p client has no CircuitBreaker.
+static std::string mkcurl_circuit_key(
+    const ClientState &client, const Request &req) {
+  std::string host;
+  int64_t port = 0;
+  if (client.circuit_breaker_impl == nullptr ||
+      !mkcurl_url_host_port(req.url, host, port)) {
+    return "";
+  }
+  return mkcurl_resolve_key(host, port);
+}
+
+static void perform2(
+    ClientState &client, const Request &req, Response &res) noexcept {
+#ifndef MKCURL_NO_LOGS
+  mkcurl_logs_recycle(res.logs, client.spare_logs);
+#endif
+  mkcurl_response_reset(res);
+  CircuitBreaker::Impl *breaker = client.circuit_breaker_impl;
+  std::string circuit = mkcurl_circuit_key(client, req);
+  if (!circuit.empty() && !breaker->allow(circuit)) {
+    res.error = error_circuit_open;
+    mkcurl_log(res.logs, "The circuit of " + circuit + " is open");
+    return;
+  }
+  TransferState transfer;
+  CircuitOutcome outcome = CircuitOutcome::unknown;
+  if (mkcurl_transfer_setup(client, req, res, transfer)) {
+    if (req.cancellation && req.cancellation->cancelled()) {
+      res.error = error_cancelled;
+      mkcurl_log(res.logs, "The request has been cancelled");
+    } else {
+      if (transfer.limiter != nullptr) {
+        mkcurl_rate_account(transfer, RateDirection::requests, 1);
+      }
+      client.transfer = &transfer;
+      transfer.begin = std::chrono::steady_clock::now();
+      auto rv = perform_and_retry(client.handle.get(), req.retries, transfer);
+      client.transfer = nullptr;
+      res.error = rv;
+      if (!circuit.empty() &&
+          (req.cancellation == nullptr || !req.cancellation->cancelled())) {
+        outcome = mkcurl_circuit_outcome(client.handle.get(), rv, res.logs);
+      }
+      mkcurl_transfer_finish(client, req, res, transfer);
+    }
+  }
+  if (!circuit.empty()) breaker->report(circuit, outcome);
 }
 
-}  // extern "C"
-
-namespace mk {
-namespace curl {
-inline namespace MKCURL_INLINE_NAMESPACE {
+// CacheEntry is a response saved into the Cache.
+struct CacheEntry {
+  // key is the key identifying the entry.
+  std::string key;
+  // status_code is the status code of the cached response.
+  int64_t status_code = 0;
+  // expires is the UNIX time after which the entry must be revalidated.
+  int64_t expires = 0;
+  // etag is the entity tag we should use in If-None-Match.
+  std::string etag;
+  // last_modified is the date we should use in If-Modified-Since.
+  std::string last_modified;
+  // content_type is the cached response content type.
+  std::string content_type;
+  // http_version is the cached response HTTP version.
+  std::string http_version;
+  // response_headers contains the cached response headers.
+  std::string response_headers;
+  // body is the cached response body.
+  std::string body;
+};
 
-// HTTPVersionString returns a string representation of the cURL HTTP
-// version string in @p httpv. If @p httpv has an unknown value, the
-// return value is the empty string.
-static const char *HTTPVersionString(long httpv) noexcept {
-  switch (httpv) {
-    case CURL_HTTP_VERSION_1_0:
-      return "HTTP/1.0";
-    case CURL_HTTP_VERSION_1_1:
-      return "HTTP/1.1";
-    case CURL_HTTP_VERSION_2_0:
-      return "HTTP/2";
+// mkcurl_request_key writes into @p ss the fields of @p req that may change
+// the Response, such that identical requests produce the same output. The
+// fields are separated by a zero byte, which cannot appear inside any of
+// them except the body, hence we prefix the body, as well as the lists,
+// with their size.
+static void mkcurl_request_key(std::ostream &ss, const Request &req) {
+  ss << req.url << '\0' << req.method << '\0' << req.connect_to << '\0'
+     << req.proxy_url << '\0' << req.ca_path << '\0' << req.enable_http2
+     << req.follow_redir << req.enable_fastopen << '\0' << req.timeout
+     << '\0' << req.retries << '\0' << (int)req.cert_capture << '\0'
+     << req.unix_socket_path << req.abstract_unix_socket << '\0'
+     << (int)req.ip_version << '\0' << req.happy_eyeballs_timeout_ms << '\0'
+     << req.enable_tcp_info << '\0' << req.so_rcvbuf << '\0' << req.so_sndbuf
+     << '\0' << req.tcp_notsent_lowat << '\0' << req.progress_interval_ms
+     << '\0' << req.max_body_size << '\0' << req.keep_truncated_body << '\0'
+     << req.max_header_bytes << '\0' << req.body.size() << '\0' << req.body;
+  ss << '\0' << req.resolve.size();
+  for (auto &entry : req.resolve) {
+    ss << '\0' << entry.host << '\0' << entry.port << '\0'
+       << entry.addresses.size();
+    for (auto &address : entry.addresses) ss << '\0' << address;
   }
-  return "";
+  for (auto &h : req.headers) ss << '\0' << h;
 }
 
-// perform_and_retry performs the request implied by @p handle for
-// @p retries times. A request is only retried if (a) it failed and (b)
-// the reason for failure is either DNS or connect error.
-static CURLcode perform_and_retry(
-    CURL *handlep, size_t retries, std::vector<Log> &logs) noexcept {
-  CURLcode rv{};
-  bool retriable{};
-  for (;;) {
-    rv = curl_easy_perform(handlep);
-    MKCURL_HOOK(curl_easy_perform, rv);
-    retriable = retries-- > 0 && (rv == CURLE_COULDNT_CONNECT ||
-                                  rv == CURLE_COULDNT_RESOLVE_HOST);
-    if (!retriable) {
-      break;
-    }
-    mkcurl_log(logs, "Transient failure; let's try one more time");
+// mkcurl_client_key writes into @p ss the settings of @p client that may
+// change the Response. Since cache entries survive on disk, we only use
+// values that are stable across runs, i.e., the digest of the TrustStore
+// bundle rather than its address.
+static void mkcurl_client_key(std::ostream &ss, const ClientState &client) {
+  ss << '\0' << client.resolve.size();
+  for (auto &pair : client.resolve) {
+    ss << '\0' << pair.first << '\0' << pair.second.size();
+    for (auto &address : pair.second) ss << '\0' << address;
+  }
+  ss << '\0';
+  if (client.trust_store_impl != nullptr) {
+    ss << client.trust_store_impl->digest;
   }
-  return rv;
 }
 
-// perform2 will use @p handle to perform @p req. If @p handle is not set
-// we will initialise it. Otherwise the @p handle argument options are
-// reset to allow constructing a fresh HTTP request. Still, in such case, we'll
-// reuse existing connections etc. @return the response.
-static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
-  Response res;
-  if (!handle) {
-    CURL *handlep = curl_easy_init();
-    MKCURL_HOOK_ALLOC(curl_easy_init, handlep, curl_easy_cleanup);
-    handle.reset(handlep);
-    if (!handle) {
-      res.error = CURLE_OUT_OF_MEMORY;
-      mkcurl_log(res.logs, "curl_easy_init() failed");
-      return res;
+// mkcurl_cache_key returns the key identifying @p req, performed using
+// @p client, in the cache.
+static std::string mkcurl_cache_key(
+    const ClientState &client, const Request &req) {
+  std::stringstream ss;
+  mkcurl_request_key(ss, req);
+  mkcurl_client_key(ss, client);
+  return ss.str();
+}
+
+// mkcurl_cache_freshness fills @p entry's freshness information using the
+// headers of the final response in @p res. If they contain no freshness
+// information, we leave entry.expires unchanged, which for a new entry
+// means that we need to revalidate. If @p ignore_age, we ignore the Age
+// header, e.g. because the server has just validated the response. @return
+// false if the response must not be stored.
+static bool mkcurl_cache_freshness(const Response &res, int64_t now,
+                                   CacheEntry &entry,
+                                   bool ignore_age = false) {
+  auto etag = header_value(res, "etag");
+  if (!etag.empty()) entry.etag = etag;
+  auto last_modified = header_value(res, "last-modified");
+  if (!last_modified.empty()) entry.last_modified = last_modified;
+  int64_t expires = now;
+  bool have_freshness = false;
+  bool no_cache = false;
+  {
+    std::stringstream ss{
+        mkcurl_tolower(header_value(res, "cache-control"))};
+    std::string directive;
+    while (std::getline(ss, directive, ',')) {
+      directive = mkcurl_trim(directive);
+      if (directive == "no-store") {
+        return false;
+      }
+      if (directive == "no-cache") {
+        no_cache = true;
+      } else if (directive.find("max-age=") == 0) {
+        int64_t max_age = atoll(directive.substr(8).c_str());
+        int64_t age =
+            ignore_age ? 0 : atoll(header_value(res, "age").c_str());
+        expires = now + std::max(max_age - age, (int64_t)0);
+        have_freshness = true;
+      }
     }
-    // FALLTHROUGH
   }
-  /*
-   * From <https://curl.haxx.se/libcurl/c/curl_easy_reset.html>:
-   *
-   *   Re-initializes all options previously set on a specified CURL handle to
-   *   the default values. This puts back the handle to the same state as it was
-   *   in when it was just created with curl_easy_init.
-   *
-   *   It does not change the following information kept in the handle: live
-   *   connections, the Session ID cache, the DNS cache, the cookies and shares.
-   *
-   * So, this allows us to reuse the existing connections with a completely
-   * new request whose options can be set from scratch below.
-   */
-  curl_easy_reset(handle.get());
-  mkcurl_slist headers;  // This must have function scope
-  for (auto &s : req.headers) {
-    curl_slist *slistp = curl_slist_append(headers.p, s.c_str());
-    MKCURL_HOOK_ALLOC(curl_slist_append_headers, slistp, curl_slist_free_all);
-    if ((headers.p = slistp) == nullptr) {
-      res.error = CURLE_OUT_OF_MEMORY;
-      mkcurl_log(res.logs, "curl_slist_append() failed");
-      return res;
-    }
+  if (no_cache) {
+    expires = now;  // We must always revalidate
+    have_freshness = true;
   }
-  mkcurl_slist connect_to_settings;  // This must have function scope
-  if (!req.connect_to.empty()) {
-    curl_slist *slistp = curl_slist_append(
-        connect_to_settings.p, req.connect_to.c_str());
-    MKCURL_HOOK_ALLOC(
-        curl_slist_append_connect_to, slistp, curl_slist_free_all);
-    if ((connect_to_settings.p = slistp) == nullptr) {
-      res.error = CURLE_OUT_OF_MEMORY;
-      mkcurl_log(res.logs, "curl_slist_append() failed");
-      return res;
-    }
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_CONNECT_TO,
-                                 connect_to_settings.p);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CONNECT_TO, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CONNECT_TO) failed");
-      return res;
+  if (!have_freshness) {
+    auto value = header_value(res, "expires");
+    if (!value.empty()) {
+      auto t = (int64_t)curl_getdate(value.c_str(), nullptr);
+      if (t > 0) expires = t;
+      have_freshness = true;
     }
   }
-  if (req.enable_fastopen) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_TCP_FASTOPEN, 1L);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TCP_FASTOPEN, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_TCP_FASTOPEN) failed");
-      return res;
-    }
+  if (have_freshness) entry.expires = expires;
+  // Storing makes sense only when we can either serve the response
+  // without contacting the server or revalidate it.
+  return have_freshness || !entry.etag.empty() || !entry.last_modified.empty();
+}
+
+// mkcurl_cache_fnv1a returns the FNV-1a hash of @p s. We use it rather
+// than std::hash because the result must be stable across runs.
+static uint64_t mkcurl_cache_fnv1a(const std::string &s) noexcept {
+  uint64_t hash = 14695981039346656037ULL;
+  for (auto c : s) {
+    hash ^= (uint64_t)(unsigned char)c;
+    hash *= 1099511628211ULL;
   }
-  if (!req.ca_path.empty()) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_CAINFO,
-                                 req.ca_path.c_str());
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAINFO, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAINFO) failed");
-      return res;
+  return hash;
+}
+
+// mkcurl_cache_write_string writes @p s into @p out prefixed by its length.
+static void mkcurl_cache_write_string(
+    std::ostream &out, const std::string &s) {
+  out << s.size() << "\n" << s << "\n";
+}
+
+// mkcurl_cache_read_string reads into @p s a string written by
+// mkcurl_cache_write_string. @return false on failure, including when the
+// size is larger than the rest of the stream, which happens when the file
+// is truncated or corrupted, such that we never allocate based on it.
+static bool mkcurl_cache_read_string(std::istream &in, std::string &s) {
+  size_t size = 0;
+  if (!(in >> size) || in.get() != '\n') return false;
+  auto pos = in.tellg();
+  if (pos < 0 || !in.seekg(0, std::ios::end)) return false;
+  auto end = in.tellg();
+  if (end < pos || !in.seekg(pos)) return false;
+  if (size > (uint64_t)(end - pos)) return false;
+  s.resize(size);
+  if (size > 0 && !in.read(&s[0], (std::streamsize)size)) return false;
+  return in.get() == '\n';
+}
+
+// Cache::Impl contains the implementation of a cache.
+class Cache::Impl {
+ public:
+  std::string disk_path;
+  size_t max_entries = 0;
+  std::list<std::shared_ptr<const CacheEntry>> lru;
+  std::unordered_map<std::string,
+                     std::list<std::shared_ptr<const CacheEntry>>::iterator>
+      index;
+  std::mutex mutex;
+
+  // disk_file returns the path of the file where to save @p key.
+  std::string disk_file(const std::string &key) const {
+    std::stringstream ss;
+    ss << disk_path << "/" << std::hex << mkcurl_cache_fnv1a(key)
+       << ".mkcurl-cache";
+    return ss.str();
+  }
+
+  // insert_locked inserts @p entry in memory evicting the LRU entries.
+  void insert_locked(std::shared_ptr<const CacheEntry> entry) {
+    auto it = index.find(entry->key);
+    if (it != index.end()) {
+      lru.erase(it->second);
+      index.erase(it);
+    }
+    lru.push_front(entry);
+    index[entry->key] = lru.begin();
+    while (lru.size() > max_entries && !lru.empty()) {
+      index.erase(lru.back()->key);
+      lru.pop_back();
     }
   }
-  if (req.enable_http2) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_HTTP_VERSION,
-                                 CURL_HTTP_VERSION_2_0);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HTTP_VERSION, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HTTP_VERSION) failed");
-      return res;
+
+  // load loads the entry for @p key from disk, if possible.
+  std::shared_ptr<const CacheEntry> load(const std::string &key) const {
+    if (disk_path.empty()) return nullptr;
+    std::ifstream in{disk_file(key), std::ios::binary};
+    std::shared_ptr<CacheEntry> entry{new CacheEntry};
+    std::string header;
+    if (!std::getline(in, header) || header != "mkcurl-cache-v1" ||
+        !mkcurl_cache_read_string(in, entry->key) || entry->key != key ||
+        !(in >> entry->status_code >> entry->expires) || in.get() != '\n' ||
+        !mkcurl_cache_read_string(in, entry->etag) ||
+        !mkcurl_cache_read_string(in, entry->last_modified) ||
+        !mkcurl_cache_read_string(in, entry->content_type) ||
+        !mkcurl_cache_read_string(in, entry->http_version) ||
+        !mkcurl_cache_read_string(in, entry->response_headers) ||
+        !mkcurl_cache_read_string(in, entry->body)) {
+      return nullptr;
     }
+    return entry;
   }
-  if (req.method == "POST" || req.method == "PUT") {
-    // Disable sending `Expect: 100 continue`. There are actually good
-    // arguments against NOT sending this specific HTTP header by default
-    // with P{OS,U}T <https://curl.haxx.se/mail/lib-2017-07/0013.html>.
+
+  // save saves @p entry on disk, if possible. We write a temporary file
+  // and rename it, so readers never see a partially written entry.
+  void save(const CacheEntry &entry) const {
+    if (disk_path.empty()) return;
+    auto path = disk_file(entry.key);
+    auto temp = path + ".tmp";
     {
-      curl_slist *slistp = curl_slist_append(headers.p, "Expect:");
-      MKCURL_HOOK_ALLOC(
-          curl_slist_append_Expect_header, slistp, curl_slist_free_all);
-      if ((headers.p = slistp) == nullptr) {
-        res.error = CURLE_OUT_OF_MEMORY;
-        mkcurl_log(res.logs, "curl_slist_append() failed");
-        return res;
+      std::ofstream out{temp, std::ios::binary | std::ios::trunc};
+      out << "mkcurl-cache-v1\n";
+      mkcurl_cache_write_string(out, entry.key);
+      out << entry.status_code << " " << entry.expires << "\n";
+      mkcurl_cache_write_string(out, entry.etag);
+      mkcurl_cache_write_string(out, entry.last_modified);
+      mkcurl_cache_write_string(out, entry.content_type);
+      mkcurl_cache_write_string(out, entry.http_version);
+      mkcurl_cache_write_string(out, entry.response_headers);
+      mkcurl_cache_write_string(out, entry.body);
+      if (!out.flush()) {
+        (void)std::remove(temp.c_str());
+        return;
       }
     }
-    {
-      res.error = curl_easy_setopt(handle.get(), CURLOPT_POST, 1L);
-      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POST, res.error);
-      if (res.error != CURLE_OK) {
-        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_POST) failed");
-        return res;
-      }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+      (void)std::remove(temp.c_str());
     }
+  }
+
+  // get returns the entry for @p key, or nullptr.
+  std::shared_ptr<const CacheEntry> get(const std::string &key) {
     {
-      res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDS,
-                                   req.body.c_str());
-      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, res.error);
-      if (res.error != CURLE_OK) {
-        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
-        return res;
+      std::unique_lock<std::mutex> _{mutex};
+      auto it = index.find(key);
+      if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return *it->second;
       }
     }
-    // The following is very important to allow us to upload any kind of
-    // binary file, otherwise CURL will use strlen(). We do not need to
-    // send more than 2 GiB of data, hence we can safely limit ourself to
-    // using CURLOPT_POSTFIELDSIZE that takes a `long` argument.
-    {
-      bool body_size_overflow = (req.body.size() > LONG_MAX);
-      MKCURL_HOOK(body_size_overflow_inject, body_size_overflow);
-      if (body_size_overflow) {
-        mkcurl_log(res.logs, "Body larger than LONG_MAX");
-        res.error = CURLE_FILESIZE_EXCEEDED;
-        return res;
-      }
-      res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDSIZE,
-                                   (long)req.body.size());
-      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE, res.error);
-      if (res.error != CURLE_OK) {
-        mkcurl_log(res.logs, "curl_easy_setopt(MKCURLOPT_POSTFIELDSIZE) failed");
-        return res;
-      }
+    auto entry = load(key);  // Do not hold the lock during I/O
+    if (entry != nullptr) {
+      std::unique_lock<std::mutex> _{mutex};
+      insert_locked(entry);
     }
-    if (req.method == "PUT") {
-      res.error = curl_easy_setopt(handle.get(), CURLOPT_CUSTOMREQUEST, "PUT");
-      MKCURL_HOOK(curl_easy_setopt_CURLOPT_CUSTOMREQUEST, res.error);
-      if (res.error) {
-        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CUSTOMREQUEST) failed");
-        return res;
-      }
+    return entry;
+  }
+
+  // put stores @p entry into the cache.
+  void put(std::shared_ptr<const CacheEntry> entry) {
+    {
+      std::unique_lock<std::mutex> _{mutex};
+      insert_locked(entry);
     }
-  } else if (req.method != "GET") {
-    res.error = CURLE_BAD_FUNCTION_ARGUMENT;
-    mkcurl_log(res.logs, "unsupported request method");
-    return res;
+    save(*entry);  // Do not hold the lock during I/O
   }
-  if (headers.p != nullptr) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_HTTPHEADER, headers.p);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HTTPHEADER, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
-      return res;
+
+  // store stores @p res, obtained by performing the request identified by
+  // @p key, if the response is cacheable.
+  void store(const std::string &key, const Response &res) {
+    if (res.error != CURLE_OK || res.status_code != 200 ||
+        res.body_truncated) {
+      return;
     }
+    std::shared_ptr<CacheEntry> entry{new CacheEntry};
+    if (!mkcurl_cache_freshness(res, mkcurl_now(), *entry)) return;
+    entry->key = key;
+    entry->status_code = res.status_code;
+    entry->content_type = res.content_type;
+    entry->http_version = res.http_version;
+    entry->response_headers = res.response_headers;
+    entry->body = res.body;
+    put(entry);
   }
-  {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_URL, req.url.c_str());
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_URL, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_URL) failed");
-      return res;
+
+  // perform is like perform2 except that it uses the cache to avoid
+  // sending @p req or to revalidate a previously cached response. If @p
+  // owned is not null, it points to a Request identical to @p req that we
+  // can modify, rather than copy, to add the conditional headers.
+  void perform(ClientState &client, const Request &req, Request *owned,
+               Response &res) noexcept {
+    auto key = mkcurl_cache_key(client, req);
+    auto cached = get(key);
+    if (cached != nullptr && mkcurl_now() < cached->expires) {
+      mkcurl_response_reset(res);
+      res.status_code = cached->status_code;
+      res.body = cached->body;
+      res.response_headers = cached->response_headers;
+      mkcurl_header_index(res);
+      res.content_type = cached->content_type;
+      res.http_version = cached->http_version;
+      res.cache_status = "hit";
+      mkcurl_log(res.logs, "Serving the response from the cache");
+      return;
     }
+    if (cached == nullptr ||
+        (cached->etag.empty() && cached->last_modified.empty())) {
+      perform2(client, req, res);
+      res.cache_status = "miss";
+      store(key, res);
+      return;
+    }
+    Request copy;
+    if (owned == nullptr) {
+      copy = req;
+      owned = &copy;
+    }
+    auto num_headers = owned->headers.size();
+    if (!cached->etag.empty()) {
+      owned->headers.push_back("If-None-Match: " + cached->etag);
+    }
+    if (!cached->last_modified.empty()) {
+      owned->headers.push_back(
+          "If-Modified-Since: " + cached->last_modified);
+    }
+    perform2(client, *owned, res);
+    owned->headers.resize(num_headers);  // Make it identical to `req` again
+    if (res.error != CURLE_OK || res.status_code != 304) {
+      res.cache_status = "miss";
+      store(key, res);
+      return;
+    }
+    mkcurl_log(res.logs, "The cached response is still valid");
+    auto now = mkcurl_now();
+    std::shared_ptr<CacheEntry> entry{new CacheEntry(*cached)};
+    {
+      // The freshness of the stored response applies again from now,
+      // unless the 304 response overrides it. We ignore the stored Age,
+      // because the server has just validated the response.
+      Response stored;
+      stored.response_headers = cached->response_headers;
+      mkcurl_header_index(stored);
+      (void)mkcurl_cache_freshness(stored, now, *entry, true);
+    }
+    if (mkcurl_cache_freshness(res, now, *entry)) put(entry);
+    res.status_code = cached->status_code;
+    res.body = cached->body;
+    res.response_headers = cached->response_headers;
+    mkcurl_header_index(res);
+    if (res.content_type.empty()) res.content_type = cached->content_type;
+    res.cache_status = "revalidated";
+  }
+};
+
+Cache::Cache(size_t max_entries, std::string disk_path) noexcept {
+  impl_.reset(new Cache::Impl);
+  impl_->max_entries = max_entries;
+  std::swap(impl_->disk_path, disk_path);
+}
+Cache::~Cache() noexcept = default;
+
+// mkcurl_memory_stats fills the memory stats of @p res, given the counters
+// of this thread when we started performing the request, @p begin.
+static void mkcurl_memory_stats(
+    const MemoryCounters &begin, Response &res) noexcept {
+  res.memory.curl_allocations = mkcurl_memory.allocations - begin.allocations;
+  res.memory.curl_bytes = mkcurl_memory.bytes - begin.bytes;
+  res.memory.response_bytes = mkcurl_response_bytes(res);
+}
+
+Client::Client() noexcept { impl_.reset(new Client::Impl); }
+Client::Client(Client &&) noexcept = default;
+Client &Client::operator=(Client &&) noexcept = default;
+Client::~Client() noexcept = default;
+Response Client::perform(const Request &req) noexcept {
+  Response res;
+  perform(req, res);
+  return res;
+}
+Response Client::perform(Request &&req) noexcept {
+  Response res;
+  MemoryCounters begin = mkcurl_memory;
+  if (impl_->cache != nullptr && req.method == "GET") {
+    impl_->cache->impl_->perform(*impl_, req, &req, res);
+  } else {
+    perform2(*impl_, req, res);
+  }
+  mkcurl_memory_stats(begin, res);
+  return res;
+}
+void Client::perform(const Request &req, Response &res) noexcept {
+  MemoryCounters begin = mkcurl_memory;
+  if (impl_->cache != nullptr && req.method == "GET") {
+    impl_->cache->impl_->perform(*impl_, req, nullptr, res);
+  } else {
+    perform2(*impl_, req, res);
+  }
+  mkcurl_memory_stats(begin, res);
+}
+void Client::set_cache(std::shared_ptr<Cache> cache) noexcept {
+  std::swap(impl_->cache, cache);
+}
+void Client::set_trust_store(
+    std::shared_ptr<TrustStore> trust_store) noexcept {
+  impl_->trust_store_impl =
+      (trust_store != nullptr) ? trust_store->impl_.get() : nullptr;
+  std::swap(impl_->trust_store, trust_store);
+}
+
+void Client::set_session_store(
+    std::shared_ptr<SessionStore> store) noexcept {
+  if (impl_->session_store_impl != nullptr && impl_->handle != nullptr) {
+    impl_->session_store_impl->export_tickets(impl_->handle.get());
+  }
+  impl_->session_store_impl = (store != nullptr) ? store->impl_.get() : nullptr;
+  std::swap(impl_->session_store, store);
+  if (impl_->session_store_impl != nullptr && impl_->handle != nullptr) {
+    impl_->session_store_impl->import_tickets(impl_->handle.get());
+  }
+}
+
+void Client::set_resolve(std::vector<ResolveEntry> entries) noexcept {
+  impl_->resolve.clear();
+  for (auto &e : entries) {
+    std::swap(impl_->resolve[mkcurl_resolve_key(e.host, e.port)],
+              e.addresses);
+  }
+}
+
+void Client::set_circuit_breaker(
+    std::shared_ptr<CircuitBreaker> breaker) noexcept {
+  impl_->circuit_breaker_impl =
+      (breaker != nullptr) ? breaker->impl_.get() : nullptr;
+  std::swap(impl_->circuit_breaker, breaker);
+}
+
+void Client::set_rate_limiter(std::shared_ptr<RateLimiter> limiter) noexcept {
+  impl_->rate_limiter_impl =
+      (limiter != nullptr) ? limiter->impl_.get() : nullptr;
+  std::swap(impl_->rate_limiter, limiter);
+}
+
+void Client::set_metrics(std::shared_ptr<Metrics> metrics) noexcept {
+  if (impl_->metrics_shard != nullptr) {
+    impl_->metrics->impl_->release(impl_->metrics_shard);
+  }
+  impl_->metrics_shard =
+      (metrics != nullptr) ? metrics->impl_->acquire() : nullptr;
+  std::swap(impl_->metrics, metrics);
+}
+
+void Client::set_tracer(std::shared_ptr<Tracer> tracer) noexcept {
+  impl_->tracer_impl = (tracer != nullptr) ? tracer->impl_.get() : nullptr;
+  std::swap(impl_->tracer, tracer);
+}
+
+void Client::set_connection_pool(ConnectionPoolSettings settings) noexcept {
+  impl_->pool = settings;
+}
+
+void Client::set_recording(std::shared_ptr<Recording> recording,
+                           RecordingMode mode) noexcept {
+  impl_->recording_impl =
+      (recording != nullptr) ? recording->impl_.get() : nullptr;
+  impl_->recording_mode = mode;
+  std::swap(impl_->recording, recording);
+}
+
+class CancellationToken::Impl {
+ public:
+  std::atomic<bool> cancelled{false};
+};
+
+CancellationToken::CancellationToken() noexcept {
+  impl_.reset(new CancellationToken::Impl);
+}
+
+CancellationToken::~CancellationToken() noexcept = default;
+
+void CancellationToken::cancel() noexcept { impl_->cancelled = true; }
+
+bool CancellationToken::cancelled() const noexcept {
+  return impl_->cancelled;
+}
+
+TrustStore::TrustStore() noexcept { impl_.reset(new TrustStore::Impl); }
+TrustStore::~TrustStore() noexcept = default;
+
+std::shared_ptr<TrustStore> TrustStore::from_file(
+    const std::string &path) noexcept {
+  // Implementation note: the registry holds weak pointers, such that the
+  // bundle is freed when the last Client using it goes away.
+  static std::mutex mutex;
+  static std::unordered_map<std::string, std::weak_ptr<TrustStore>> registry;
+  std::unique_lock<std::mutex> _{mutex};
+  auto store = registry[path].lock();
+  if (store != nullptr) return store;
+  std::ifstream in{path, std::ios::binary};
+  std::stringstream ss;
+  if (!(ss << in.rdbuf())) return nullptr;
+  store.reset(new TrustStore);
+  store->impl_->path = path;
+  store->impl_->bundle = ss.str();
+  store->impl_->digest = mkcurl_cache_fnv1a(store->impl_->bundle);
+#ifdef MKCURL_OPENSSL
+  mkcurl_trust_store_parse(*store->impl_);
+#endif
+  registry[path] = store;
+  return store;
+}
+
+std::shared_ptr<TrustStore> TrustStore::from_memory(
+    std::string bundle) noexcept {
+  std::shared_ptr<TrustStore> store{new TrustStore};
+  std::swap(store->impl_->bundle, bundle);
+  store->impl_->digest = mkcurl_cache_fnv1a(store->impl_->bundle);
+#ifdef MKCURL_OPENSSL
+  mkcurl_trust_store_parse(*store->impl_);
+#endif
+  return store;
+}
+
+size_t TrustStore::size() const noexcept { return impl_->bundle.size(); }
+
+// mkcurl_single_flight_key returns the key used by SingleFlight to decide
+// whether two requests, performed by two Clients, are identical, i.e.,
+// whether they would produce the same Response. Besides the fields written
+// by mkcurl_request_key and mkcurl_client_key, we include the addresses of
+// the CancellationToken, such that cancelling a request only affects the
+// requests sharing its token, and of the objects that may serve or alter
+// the Response: the Recording, the @p cache of @p client, its SessionStore
+// and its TrustStore, because a TrustStore also decides which responses
+// are valid. The leader keeps them alive while the key is in use, so their
+// addresses cannot be reused meanwhile.
+static std::string mkcurl_single_flight_key(
+    const ClientState &client, const Cache *cache, const Request &req) {
+  std::stringstream ss;
+  mkcurl_request_key(ss, req);
+  mkcurl_client_key(ss, client);
+  ss << '\0' << (const void *)req.cancellation.get() << '\0'
+     << (const void *)client.recording_impl << '\0'
+     << (int)client.recording_mode << '\0' << (const void *)cache << '\0'
+     << (const void *)client.session_store_impl << '\0'
+     << (const void *)client.trust_store_impl;
+  return ss.str();
+}
+
+// SingleFlightCall is a transfer shared by identical requests.
+struct SingleFlightCall {
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool done = false;
+  std::shared_ptr<const Response> response;
+};
+
+// SingleFlight::Impl contains the implementation of a SingleFlight.
+class SingleFlight::Impl {
+ public:
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<SingleFlightCall>> calls;
+  std::atomic<int64_t> transfers{0};
+  std::atomic<int64_t> collapsed{0};
+};
+
+SingleFlight::SingleFlight() noexcept { impl_.reset(new SingleFlight::Impl); }
+SingleFlight::~SingleFlight() noexcept = default;
+
+std::shared_ptr<const Response> SingleFlight::perform(
+    Client &client, const Request &req) noexcept {
+  if (req.method != "GET") {
+    impl_->transfers += 1;
+    return std::make_shared<const Response>(client.perform(req));
   }
+  auto key = mkcurl_single_flight_key(
+      *client.impl_, client.impl_->cache.get(), req);
+  std::shared_ptr<SingleFlightCall> call;
   {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION,
-                                 mkcurl_body_cb_);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEFUNCTION, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_WRITEFUNCTION) failed");
-      return res;
+    std::unique_lock<std::mutex> _{impl_->mutex};
+    auto it = impl_->calls.find(key);
+    if (it != impl_->calls.end()) {
+      call = it->second;
+      impl_->collapsed += 1;
+      _.unlock();
+      std::unique_lock<std::mutex> lock{call->mutex};
+      // Stop waiting as soon as our own token is cancelled. Since tokens
+      // have no way to wake us up, we check them periodically.
+      while (!call->cond.wait_for(lock, std::chrono::milliseconds(100),
+                                  [&call]() { return call->done; })) {
+        if (req.cancellation && req.cancellation->cancelled()) {
+          std::shared_ptr<Response> res{new Response};
+          res->error = error_cancelled;
+          mkcurl_log(res->logs, "The request has been cancelled");
+          return res;
+        }
+      }
+      return call->response;
     }
+    call = std::make_shared<SingleFlightCall>();
+    impl_->calls[key] = call;
   }
+  impl_->transfers += 1;
+  auto response = std::make_shared<const Response>(client.perform(req));
   {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &res);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_WRITEDATA) failed");
-      return res;
-    }
+    std::unique_lock<std::mutex> _{impl_->mutex};
+    impl_->calls.erase(key);
   }
-  // CURL uses MSG_NOSIGNAL where available (i.e. Linux) and SO_NOSIGPIPE
-  // where available (i.e. BSD). This covers all the UNIX operating systems
-  // that we care about (Android, Linux, iOS, macOS). We additionally need
-  // to avoid signals because we are acting as a library that is integrated
-  // into several different languages, so stealing the signal handler from
-  // the language MAY have a negative impact. However, disabling signal
-  // handlers will also make the getaddrinfo() resolver in cURL block until
-  // getaddrinfo() returns, unless we're using the threaded or the c-ares
-  // DNS backend. Since the threaded resolver should now be used in most
-  // Unix distros, we need mainly to remember to enable it when we're cross
-  // compiling cURL in measurement-kit/script-build-unix.
   {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1L);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_NOSIGNAL) failed");
-      return res;
-    }
+    std::unique_lock<std::mutex> _{call->mutex};
+    call->response = response;
+    call->done = true;
   }
-  {
-    long t = 0L; // Note: `0L` means "infinite" for CURLOPT_TIMEOUT.
-    if (req.timeout >= 0 && req.timeout < LONG_MAX) t = (long)req.timeout;
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_TIMEOUT, t);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TIMEOUT, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_TIMEOUT) failed");
-      return res;
+  call->cond.notify_all();
+  return response;
+}
+
+SingleFlightStats SingleFlight::stats() const noexcept {
+  SingleFlightStats stats;
+  stats.transfers = impl_->transfers;
+  stats.collapsed = impl_->collapsed;
+  return stats;
+}
+
+// HedgeAttempt is an attempt performed by a Hedger.
+struct HedgeAttempt {
+  ClientState *client = nullptr;
+  Request req;
+  Response res;
+  TransferState transfer;
+  // outcome is the outcome of the attempt as seen by a CircuitBreaker.
+  CircuitOutcome outcome = CircuitOutcome::unknown;
+  bool running = false;
+  bool done = false;
+};
+
+class Hedger::Impl {
+ public:
+  HedgeSettings settings;
+  mutable std::mutex mutex;
+  // samples contains the time to first byte of recent requests (in ms).
+  std::deque<int64_t> samples;
+
+  // delay_ms returns the current hedging delay. Must be called with the
+  // mutex held.
+  int64_t delay_ms() const noexcept {
+    if (settings.percentile <= 0 || samples.empty() ||
+        samples.size() < settings.min_samples) {
+      return settings.delay_ms;
     }
+    std::vector<int64_t> sorted{samples.begin(), samples.end()};
+    auto index = (size_t)(std::min(settings.percentile, (int64_t)100) *
+                          (int64_t)(sorted.size() - 1) / 100);
+    std::nth_element(sorted.begin(), sorted.begin() + (ptrdiff_t)index,
+                     sorted.end());
+    return std::max(sorted[index], settings.min_delay_ms);
   }
-  {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_DEBUGFUNCTION,
-                                 mkcurl_debug_cb_);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_DEBUGFUNCTION, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_DEBUGFUNCTION) failed");
-      return res;
+
+  // record records that the time to first byte of a request was @p ms.
+  void record(int64_t ms) noexcept {
+    std::unique_lock<std::mutex> _{mutex};
+    samples.push_back(ms);
+    while (samples.size() > settings.window) {
+      samples.pop_front();
     }
   }
-  {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_DEBUGDATA, &res);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_DEBUGDATA, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_DEBUGDATA) failed");
-      return res;
-    }
+};
+
+// mkcurl_client_state_copy_settings copies the client wide settings of
+// @p from into @p to, such that @p to behaves like @p from.
+static void mkcurl_client_state_copy_settings(
+    const ClientState &from, ClientState &to) noexcept {
+  to.trust_store = from.trust_store;
+  to.trust_store_impl = from.trust_store_impl;
+  to.session_store = from.session_store;
+  to.session_store_impl = from.session_store_impl;
+  to.resolve = from.resolve;
+  to.rate_limiter = from.rate_limiter;
+  to.rate_limiter_impl = from.rate_limiter_impl;
+  to.pool = from.pool;
+  // Both states are used by the same thread, so they can share the shard.
+  to.metrics_shard = from.metrics_shard;
+  to.tracer_impl = from.tracer_impl;
+}
+
+// mkcurl_first_byte_ms returns the time to first byte of the transfer
+// performed by @p handle, in milliseconds, or zero if we have not
+// received any byte yet.
+static int64_t mkcurl_first_byte_ms(CURL *handle) noexcept {
+  double seconds = 0.0;
+  if (curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &seconds) !=
+      CURLE_OK) {
+    return 0;
+  }
+  return (int64_t)(seconds * 1000.0);
+}
+
+Hedger::Hedger(HedgeSettings settings) noexcept {
+  impl_.reset(new Hedger::Impl);
+  impl_->settings = std::move(settings);
+}
+
+Hedger::~Hedger() noexcept = default;
+
+int64_t Hedger::delay_ms() const noexcept {
+  std::unique_lock<std::mutex> _{impl_->mutex};
+  return impl_->delay_ms();
+}
+
+Response Hedger::perform(Client &client, const Request &req) noexcept {
+  if (req.method != "GET") {
+    return client.perform(req);
   }
+  int64_t delay = 0;
   {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_VERBOSE, 1L);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_VERBOSE, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_VERBOSE) failed");
+    std::unique_lock<std::mutex> _{impl_->mutex};
+    delay = impl_->delay_ms();
+  }
+  Response res;
+  Client::Impl &state = *client.impl_;
+  mkcurl_multi_uptr &multi = state.hedge_multi;
+  if (!multi) {
+    CURLM *multip = curl_multi_init();
+    MKCURL_HOOK_ALLOC(curl_multi_init, multip, curl_multi_cleanup);
+    multi.reset(multip);
+    if (!multi) {
+      res.error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log(res.logs, "curl_multi_init() failed");
       return res;
     }
   }
-  if (!req.proxy_url.empty()) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_PROXY,
-                                 req.proxy_url.c_str());
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_PROXY, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_PROXY) failed");
-      return res;
+  if (!state.hedge_client) {
+    state.hedge_client.reset(new ClientState);
+  }
+  mkcurl_client_state_copy_settings(state, *state.hedge_client);
+  CircuitBreaker::Impl *breaker = state.circuit_breaker_impl;
+  std::string circuit = mkcurl_circuit_key(state, req);
+  if (!circuit.empty() && !breaker->allow(circuit)) {
+    res.error = error_circuit_open;
+    mkcurl_log(res.logs, "The circuit of " + circuit + " is open");
+    return res;
+  }
+  HedgeAttempt attempts[2];
+  attempts[0].client = &state;
+  attempts[0].req = req;
+  attempts[1].client = state.hedge_client.get();
+  attempts[1].req = req;
+  if (!impl_->settings.alternate_connect_to.empty()) {
+    attempts[1].req.connect_to = impl_->settings.alternate_connect_to;
+  }
+  auto start = [&](HedgeAttempt &attempt) {
+    if (!mkcurl_transfer_setup(*attempt.client, attempt.req, attempt.res,
+                               attempt.transfer)) {
+      attempt.done = true;
+      return;
+    }
+    if (attempt.transfer.limiter != nullptr) {
+      mkcurl_rate_account(attempt.transfer, RateDirection::requests, 1);
     }
+    CURLMcode rv = curl_multi_add_handle(
+        multi.get(), attempt.client->handle.get());
+    MKCURL_HOOK(curl_multi_add_handle, rv);
+    if (rv != CURLM_OK) {
+      attempt.res.error = CURLE_FAILED_INIT;
+      mkcurl_log(attempt.res.logs, "curl_multi_add_handle() failed");
+      attempt.done = true;
+      return;
+    }
+    attempt.client->transfer = &attempt.transfer;
+    attempt.transfer.begin = std::chrono::steady_clock::now();
+    if (attempt.transfer.tracer != nullptr) {
+      mkcurl_trace_attempt_begin(attempt.transfer);
+    }
+    attempt.running = true;
+  };
+  auto stop = [&](HedgeAttempt &attempt) {
+    (void)curl_multi_remove_handle(multi.get(), attempt.client->handle.get());
+    attempt.client->transfer = nullptr;
+    attempt.running = false;
+    attempt.done = true;
+  };
+  auto begin = std::chrono::steady_clock::now();
+  start(attempts[0]);
+  bool hedged = false;
+  HedgeAttempt *winner = nullptr;
+  for (;;) {
+    if (attempts[0].running || attempts[1].running) {
+      int still_running = 0;
+      (void)curl_multi_perform(multi.get(), &still_running);
+      CURLMsg *msg = nullptr;
+      int left = 0;
+      while ((msg = curl_multi_info_read(multi.get(), &left)) != nullptr) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        for (auto &attempt : attempts) {
+          if (attempt.running &&
+              attempt.client->handle.get() == msg->easy_handle) {
+            attempt.res.error = msg->data.result;
+            if (!circuit.empty()) {
+              attempt.outcome = mkcurl_circuit_outcome(
+                  msg->easy_handle, msg->data.result, attempt.res.logs);
+            }
+            stop(attempt);
+            if (attempt.transfer.tracer != nullptr) {
+              mkcurl_trace_attempt_end(attempt.transfer, msg->easy_handle,
+                                       msg->data.result);
+            }
+            mkcurl_transfer_finish(*attempt.client, attempt.req, attempt.res,
+                                   attempt.transfer);
+          }
+        }
+      }
+    }
+    for (auto &attempt : attempts) {
+      if (winner == nullptr && attempt.done && attempt.res.error == 0) {
+        winner = &attempt;
+      }
+    }
+    bool any_running = attempts[0].running || attempts[1].running;
+    if (winner != nullptr || (!any_running && hedged)) {
+      break;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    if (!hedged && (attempts[0].done ||
+                    (elapsed >= delay && mkcurl_first_byte_ms(
+                         attempts[0].client->handle.get()) <= 0))) {
+      mkcurl_log(attempts[0].res.logs, "Hedging: starting a second attempt");
+      hedged = true;
+      start(attempts[1]);
+      continue;
+    }
+    int timeout = 1000;
+    if (!hedged) {
+      timeout = (int)std::max(std::min(delay - elapsed, (int64_t)1000),
+                              (int64_t)1);
+    }
+#if LIBCURL_VERSION_NUM >= 0x074400
+    (void)curl_multi_poll(multi.get(), nullptr, 0, timeout, nullptr);
+#else
+    (void)curl_multi_wait(multi.get(), nullptr, 0, timeout, nullptr);
+#endif
   }
-  if (req.follow_redir) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_FOLLOWLOCATION, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_FOLLOWLOCATION) failed");
-      return res;
+  for (auto &attempt : attempts) {
+    if (attempt.running) stop(attempt);  // Cancel the loser
+  }
+  if (winner == nullptr) {
+    winner = &attempts[0];  // Both failed, so report the first error
+  } else {
+    impl_->record(mkcurl_first_byte_ms(winner->client->handle.get()));
+  }
+  if (!circuit.empty()) breaker->report(circuit, winner->outcome);
+  res = std::move(winner->res);
+  res.hedged = hedged;
+  res.hedge_winner = (winner == &attempts[0]) ? 0 : 1;
+  return res;
+}
+
+// EngineJob is a request submitted to an Engine.
+struct EngineJob {
+  Request req;
+  Engine::Callback callback;
+  Response res;
+  // host_key is the `host:port` of req.url.
+  std::string host_key;
+  // submitted is when the request was submitted.
+  std::chrono::steady_clock::time_point submitted;
+  // client is the client performing the request, once started.
+  std::unique_ptr<ClientState> client;
+  // transfer is the state of the transfer, once started.
+  TransferState transfer;
+  // retries is the number of retries left.
+  size_t retries = 0;
+  // delayed indicates that the request waits for the RateLimiter before
+  // being added to the multi handle, at transfer.resume_at.
+  bool delayed = false;
+};
+
+class Engine::Impl {
+ public:
+  EngineSettings settings;
+  // limiter is the implementation of settings.rate_limiter, if set.
+  RateLimiter::Impl *limiter = nullptr;
+  // metrics_shard is where the Engine thread records settings.metrics.
+  MetricsShard *metrics_shard = nullptr;
+  // tracer is the implementation of settings.tracer, if set.
+  Tracer::Impl *tracer = nullptr;
+  // error is the error that occurred when initialising, if any.
+  int64_t error = 0;
+  std::string error_message;
+
+  // The following fields are protected by mutex.
+  std::mutex mutex;
+  std::deque<std::unique_ptr<EngineJob>> queues[mkcurl_priority_classes];
+  bool stopping = false;
+
+  // The following fields are only used by the Engine thread.
+  //
+  // Note: clients must outlive multi, because the connections owned by
+  // multi refer to the client that created them (see ClientState).
+  std::vector<std::unique_ptr<ClientState>> clients;
+  std::map<CURL *, std::unique_ptr<EngineJob>> running;
+  std::map<std::string, int64_t> host_active;
+  // active is the number of started requests.
+  int64_t active = 0;
+  int64_t finish_tags[mkcurl_priority_classes] = {};
+  int64_t virtual_time = 0;
+  mkcurl_multi_uptr multi;
+  std::thread thread;
+
+  // weight returns the weight of the priority class @p klass.
+  int64_t weight(size_t klass) const noexcept {
+    int64_t w = (klass == (size_t)Priority::interactive)
+                    ? settings.interactive_weight
+                    : (klass == (size_t)Priority::normal)
+                          ? settings.normal_weight
+                          : settings.background_weight;
+    return std::max(w, (int64_t)1);
+  }
+
+  // wakeup wakes up the Engine thread.
+  void wakeup() noexcept {
+#if LIBCURL_VERSION_NUM >= 0x074400
+    (void)curl_multi_wakeup(multi.get());
+#endif
+  }
+
+  // next removes from the queues the next request to start, if any, and
+  // moves into @p done the cancelled requests. Must be called with the
+  // mutex held.
+  std::unique_ptr<EngineJob> next(
+      std::vector<std::unique_ptr<EngineJob>> &done) noexcept {
+    if (active >= settings.max_total_connections) {
+      return nullptr;
+    }
+    size_t best_klass = mkcurl_priority_classes;
+    size_t best_index = 0;
+    int64_t best_tag = 0;
+    for (size_t klass = 0; klass < mkcurl_priority_classes; ++klass) {
+      auto &queue = queues[klass];
+      for (size_t index = 0; index < queue.size();) {
+        auto &req = queue[index]->req;
+        if (req.cancellation && req.cancellation->cancelled()) {
+          done.push_back(std::move(queue[index]));
+          queue.erase(queue.begin() + (ptrdiff_t)index);
+          continue;
+        }
+        auto it = host_active.find(queue[index]->host_key);
+        if (it == host_active.end() ||
+            it->second < settings.max_host_connections) {
+          int64_t tag = std::max(finish_tags[klass], virtual_time) +
+                        1000000 / weight(klass);
+          if (best_klass == mkcurl_priority_classes || tag < best_tag) {
+            best_klass = klass;
+            best_index = index;
+            best_tag = tag;
+          }
+          break;
+        }
+        ++index;
+      }
+    }
+    if (best_klass == mkcurl_priority_classes) {
+      return nullptr;
     }
+    auto &queue = queues[best_klass];
+    auto job = std::move(queue[best_index]);
+    queue.erase(queue.begin() + (ptrdiff_t)best_index);
+    virtual_time = std::max(finish_tags[best_klass], virtual_time);
+    finish_tags[best_klass] = best_tag;
+    return job;
   }
-  {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_CERTINFO, 1L);
-    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CERTINFO) failed");
-      return res;
+
+  // start starts @p job. @return false on failure, in which case the
+  // Response of @p job contains the error.
+  bool start(EngineJob &job) noexcept {
+    job.res.queue_wait_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - job.submitted)
+            .count();
+    if (clients.empty()) {
+      clients.push_back(std::unique_ptr<ClientState>{new ClientState});
+    }
+    job.client = std::move(clients.back());
+    clients.pop_back();
+    job.client->rate_limiter_impl = limiter;
+    job.client->metrics_shard = metrics_shard;
+    job.client->tracer_impl = tracer;
+    if (!mkcurl_transfer_setup(*job.client, job.req, job.res, job.transfer)) {
+      return false;
+    }
+    job.retries = job.req.retries;
+    job.transfer.pausable = true;
+    job.transfer.begin = std::chrono::steady_clock::now();
+    if (limiter != nullptr) {
+      mkcurl_rate_account(job.transfer, RateDirection::requests, 1);
+      if (job.transfer.resume_at > job.transfer.begin) {
+        job.delayed = true;
+        return true;
+      }
     }
+    return add(job);
   }
-  {
-    res.error = perform_and_retry(handle.get(), req.retries, res.logs);
-    if (res.error != CURLE_OK) {
-      std::stringstream ss;
-      ss << "curl_easy_perform: " << curl_easy_strerror((CURLcode)res.error);
-      mkcurl_log(res.logs, ss.str());
-      return res;
+
+  // resume adds the delayed requests and resumes the paused transfers whose
+  // time has come. It sets @p timeout to the time until the next one, if
+  // that is shorter. @return whether it resumed any request.
+  bool resume(std::chrono::milliseconds &timeout) noexcept {
+    bool resumed = false;
+    std::vector<CURL *> failed;
+    auto now = std::chrono::steady_clock::now();
+    for (auto &pair : running) {
+      auto &job = *pair.second;
+      if (!job.delayed && !job.transfer.paused) continue;
+      if (job.transfer.resume_at > now) {
+        timeout = std::min(
+            timeout, std::chrono::duration_cast<std::chrono::milliseconds>(
+                         job.transfer.resume_at - now) +
+                         std::chrono::milliseconds{1});
+        continue;
+      }
+      resumed = true;
+      if (job.delayed) {
+        job.delayed = false;
+        if (!add(job)) failed.push_back(pair.first);
+        continue;
+      }
+      job.transfer.paused = false;
+      (void)curl_easy_pause(pair.first, CURLPAUSE_CONT);
+    }
+    for (auto handle : failed) {
+      auto it = running.find(handle);
+      auto owned = std::move(it->second);
+      running.erase(it);
+      release(*owned);
+      complete(std::move(owned));
     }
+    return resumed;
   }
-  {
-    long status_code = 0;
-    res.error = curl_easy_getinfo(
-        handle.get(), CURLINFO_RESPONSE_CODE, &status_code);
-    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_RESPONSE_CODE, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_RESPONSE_CODE) failed");
-      return res;
+
+  // add adds @p job's handle to multi. @return false on failure.
+  bool add(EngineJob &job) noexcept {
+    CURLMcode rv = curl_multi_add_handle(multi.get(), job.client->handle.get());
+    MKCURL_HOOK(curl_multi_add_handle, rv);
+    if (rv != CURLM_OK) {
+      job.res.error = CURLE_FAILED_INIT;
+      mkcurl_log(job.res.logs, "curl_multi_add_handle() failed");
+      return false;
     }
-    res.status_code = (int64_t)status_code;
+    job.client->transfer = &job.transfer;
+    if (job.transfer.tracer != nullptr) {
+      mkcurl_trace_attempt_begin(job.transfer);
+    }
+    return true;
   }
-  {
-    char *url = nullptr;
-    res.error = curl_easy_getinfo(handle.get(), CURLINFO_REDIRECT_URL, &url);
-    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_URL, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_REDIRECT_URL) failed");
-      return res;
+
+  // release releases the slots used by @p job.
+  void release(const EngineJob &job) noexcept {
+    active -= 1;
+    if (--host_active[job.host_key] <= 0) {
+      host_active.erase(job.host_key);
     }
-    if (url != nullptr) res.redirect_url = url;
   }
-  {
-    curl_certinfo *certinfo = nullptr;
-    res.error = curl_easy_getinfo(handle.get(), CURLINFO_CERTINFO, &certinfo);
-    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_CERTINFO) failed");
-      return res;
+
+  // complete returns @p job's client to the pool and calls its callback.
+  void complete(std::unique_ptr<EngineJob> job) noexcept {
+    if (job->client) {
+      job->client->transfer = nullptr;
+      clients.push_back(std::move(job->client));
     }
-    if (certinfo != nullptr && certinfo->num_of_certs > 0) {
-      for (int i = 0; i < certinfo->num_of_certs; i++) {
-        for (auto slist = certinfo->certinfo[i]; slist; slist = slist->next) {
-          if (slist->data != nullptr) {
-            // Just pass in the certificates and ignore the rest.
-            std::string s = slist->data;
-            if (s.find("Cert:") == 0) {
-              res.certs += s.substr(5);
-              res.certs += "\n";
-            }
-          }
+    job->callback(std::move(job->res));
+  }
+
+  // run is the main loop of the Engine thread.
+  void run() noexcept {
+    for (;;) {
+      std::vector<std::unique_ptr<EngineJob>> done;
+      std::vector<std::unique_ptr<EngineJob>> ready;
+      {
+        std::unique_lock<std::mutex> _{mutex};
+        bool empty = running.empty();
+        for (auto &queue : queues) empty = empty && queue.empty();
+        if (stopping && empty) break;
+        for (;;) {
+          auto job = next(done);
+          if (!job) break;
+          host_active[job->host_key] += 1;
+          active += 1;
+          ready.push_back(std::move(job));
         }
       }
+      for (auto &job : done) {
+        job->res.error = error_cancelled;
+        mkcurl_log(job->res.logs, "The request has been cancelled");
+        complete(std::move(job));
+      }
+      for (auto &job : ready) {
+        if (!start(*job)) {
+          release(*job);
+          complete(std::move(job));
+          continue;
+        }
+        CURL *handle = job->client->handle.get();
+        running[handle] = std::move(job);
+      }
+      int still_running = 0;
+      (void)curl_multi_perform(multi.get(), &still_running);
+      CURLMsg *msg = nullptr;
+      int left = 0;
+      bool completed = false;
+      while ((msg = curl_multi_info_read(multi.get(), &left)) != nullptr) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        CURL *handle = msg->easy_handle;
+        CURLcode rv = msg->data.result;
+        (void)curl_multi_remove_handle(multi.get(), handle);
+        auto it = running.find(handle);
+        if (it == running.end()) continue;
+        auto &job = *it->second;
+        const Request &req = job.req;
+        if (job.transfer.tracer != nullptr) {
+          mkcurl_trace_attempt_end(job.transfer, handle, rv);
+        }
+        bool retriable = job.retries-- > 0 &&
+                         (rv == CURLE_COULDNT_CONNECT ||
+                          rv == CURLE_COULDNT_RESOLVE_HOST) &&
+                         (!req.cancellation || !req.cancellation->cancelled());
+        if (retriable) {
+          mkcurl_log(job.res.logs,
+                     "Transient failure; let's try one more time");
+          job.transfer.retries += 1;
+          if (add(job)) continue;
+          rv = (CURLcode)job.res.error;
+        }
+        job.client->transfer = nullptr;
+        job.res.error = rv;
+        mkcurl_transfer_finish(*job.client, req, job.res, job.transfer);
+        release(job);
+        auto owned = std::move(it->second);
+        running.erase(it);
+        complete(std::move(owned));
+        completed = true;
+      }
+      if (completed) {
+        continue;  // We may be able to start queued requests
+      }
+#if LIBCURL_VERSION_NUM >= 0x074400
+      std::chrono::milliseconds timeout{1000};
+#else
+      std::chrono::milliseconds timeout{100};
+#endif
+      if (resume(timeout)) {
+        continue;
+      }
+#if LIBCURL_VERSION_NUM >= 0x074400
+      (void)curl_multi_poll(
+          multi.get(), nullptr, 0, (int)timeout.count(), nullptr);
+#else
+      (void)curl_multi_wait(
+          multi.get(), nullptr, 0, (int)timeout.count(), nullptr);
+#endif
     }
   }
-  {
-    char *ct = nullptr;
-    res.error = curl_easy_getinfo(handle.get(), CURLINFO_CONTENT_TYPE, &ct);
-    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CONTENT_TYPE, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_CONTENT_TYPE) failed");
-      return res;
+};
+
+Engine::Engine(EngineSettings settings) noexcept {
+  impl_.reset(new Engine::Impl);
+  impl_->settings = settings;
+  if (settings.rate_limiter != nullptr) {
+    impl_->limiter = settings.rate_limiter->impl_.get();
+  }
+  if (settings.metrics != nullptr) {
+    impl_->metrics_shard = settings.metrics->impl_->acquire();
+  }
+  if (settings.tracer != nullptr) {
+    impl_->tracer = settings.tracer->impl_.get();
+  }
+  CURLM *multi = curl_multi_init();
+  MKCURL_HOOK_ALLOC(curl_multi_init, multi, curl_multi_cleanup);
+  impl_->multi.reset(multi);
+  if (!impl_->multi) {
+    impl_->error = CURLE_OUT_OF_MEMORY;
+    impl_->error_message = "curl_multi_init() failed";
+    return;
+  }
+  CURLMcode rv = curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                                   (long)settings.max_host_connections);
+  MKCURL_HOOK(curl_multi_setopt_CURLMOPT_MAX_HOST_CONNECTIONS, rv);
+  if (rv != CURLM_OK) {
+    impl_->error = CURLE_FAILED_INIT;
+    impl_->error_message =
+        "curl_multi_setopt(CURLMOPT_MAX_HOST_CONNECTIONS) failed";
+    return;
+  }
+  rv = curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                         (long)settings.max_total_connections);
+  MKCURL_HOOK(curl_multi_setopt_CURLMOPT_MAX_TOTAL_CONNECTIONS, rv);
+  if (rv != CURLM_OK) {
+    impl_->error = CURLE_FAILED_INIT;
+    impl_->error_message =
+        "curl_multi_setopt(CURLMOPT_MAX_TOTAL_CONNECTIONS) failed";
+    return;
+  }
+  Engine::Impl *pimpl = impl_.get();
+  impl_->thread = std::thread{[pimpl]() { pimpl->run(); }};
+}
+
+Engine::~Engine() noexcept {
+  if (impl_->thread.joinable()) {
+    {
+      std::unique_lock<std::mutex> _{impl_->mutex};
+      impl_->stopping = true;
     }
-    if (ct != nullptr) res.content_type = ct;
+    impl_->wakeup();
+    impl_->thread.join();
+  }
+  if (impl_->metrics_shard != nullptr) {
+    impl_->settings.metrics->impl_->release(impl_->metrics_shard);
   }
+}
+
+void Engine::submit(Request req, Callback callback) noexcept {
+  std::unique_ptr<EngineJob> job{new EngineJob};
+  job->req = std::move(req);
+  job->callback = std::move(callback);
+  job->submitted = std::chrono::steady_clock::now();
+  if (impl_->error != 0) {
+    job->res.error = impl_->error;
+    mkcurl_log(job->res.logs, std::string{impl_->error_message});
+    job->callback(std::move(job->res));
+    return;
+  }
+  std::string host;
+  int64_t port = 0;
+  if (mkcurl_url_host_port(job->req.url, host, port)) {
+    job->host_key = mkcurl_resolve_key(host, port);
+  }
+  size_t klass = mkcurl_priority_class(job->req);
   {
-    long httpv = 0L;
-    res.error = curl_easy_getinfo(handle.get(), CURLINFO_HTTP_VERSION, &httpv);
-    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_HTTP_VERSION, res.error);
-    if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_HTTP_VERSION) failed");
-      return res;
-    }
-    res.http_version = HTTPVersionString(httpv);
+    std::unique_lock<std::mutex> _{impl_->mutex};
+    impl_->queues[klass].push_back(std::move(job));
   }
-  return res;
+  impl_->wakeup();
 }
 
-Client::Client() noexcept { impl_.reset(new Client::Impl); }
-Client::Client(Client &&) noexcept = default;
-Client &Client::operator=(Client &&) noexcept = default;
-Client::~Client() noexcept = default;
-Response Client::perform(const Request &req) noexcept {
-  return perform2(impl_->handle, req);
+int64_t global_init(const Allocator &allocator) noexcept {
+  if (allocator.malloc_fn == nullptr || allocator.free_fn == nullptr ||
+      allocator.realloc_fn == nullptr || allocator.strdup_fn == nullptr ||
+      allocator.calloc_fn == nullptr) {
+    return CURLE_BAD_FUNCTION_ARGUMENT;
+  }
+  if (mkcurl_allocator_passed.exchange(true)) {
+    return CURLE_FAILED_INIT;
+  }
+  mkcurl_allocator = allocator;
+  CURLcode rv = curl_global_init_mem(
+      CURL_GLOBAL_DEFAULT, mkcurl_malloc_cb_, mkcurl_free_cb_,
+      mkcurl_realloc_cb_, mkcurl_strdup_cb_, mkcurl_calloc_cb_);
+  MKCURL_HOOK(curl_global_init_mem, rv);
+  if (rv != CURLE_OK) {
+    return rv;
+  }
+  // If libcurl was already initialized, it silently ignores the functions
+  // we passed, so we check whether it uses them by allocating something.
+  auto before = mkcurl_memory.allocations;
+  curl_slist *probe = curl_slist_append(nullptr, "mkcurl");
+  bool ours = mkcurl_memory.allocations > before;
+  curl_slist_free_all(probe);
+  if (!ours) {
+    curl_global_cleanup();  // balances curl_global_init_mem
+    return CURLE_FAILED_INIT;
+  }
+  return CURLE_OK;
 }
 
 Response perform(const Request &req) noexcept {
   return Client{}.perform(req);
 }
 
+Response perform(Request &&req) noexcept {
+  return Client{}.perform(std::move(req));
+}
+
 }  // inline namespace MKCURL_INLINE_NAMESPACE
 }  // namespace curl
 }  // namespace mk
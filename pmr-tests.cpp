@@ -0,0 +1,57 @@
+// This file is compiled as C++17, while the library is compiled as C++11,
+// to check that global_init(std::pmr::memory_resource *) works in such case.
+// It is a separate program because libcurl can only be initialized once.
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory_resource>
+
+#include <curl/curl.h>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include "mkcurl.hpp"
+
+// CountingResource is a memory resource that counts the allocations and
+// the bytes in use, and gets the memory from the default resource.
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  std::atomic<int64_t> allocations{0};
+  std::atomic<int64_t> bytes{0};
+
+ private:
+  void *do_allocate(size_t size, size_t alignment) override {
+    allocations += 1;
+    bytes += (int64_t)size;
+    return std::pmr::get_default_resource()->allocate(size, alignment);
+  }
+
+  void do_deallocate(void *ptr, size_t size, size_t alignment) override {
+    bytes -= (int64_t)size;
+    std::pmr::get_default_resource()->deallocate(ptr, size, alignment);
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+TEST_CASE("libcurl allocates from the memory_resource passed to global_init") {
+  static CountingResource resource;  // Must outlive libcurl
+  REQUIRE(mk::curl::global_init(nullptr) == CURLE_BAD_FUNCTION_ARGUMENT);
+  REQUIRE(mk::curl::global_init(&resource) == CURLE_OK);
+  REQUIRE(mk::curl::global_init(&resource) == CURLE_FAILED_INIT);
+  auto before = resource.allocations.load();
+  mk::curl::Request req;
+  req.url = "http://127.0.0.1:0/";  // Fails without using the network
+  auto res = mk::curl::perform(req);
+  REQUIRE(res.error != 0);
+  REQUIRE(resource.allocations > before);
+  REQUIRE(res.memory.curl_allocations > 0);
+  // We freed all the memory libcurl used for the request, passing to the
+  // resource the same sizes we allocated.
+  REQUIRE(resource.bytes == 0);
+}
@@ -1,6 +1,9 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include <exception>
+#include <fstream>
+#include <iterator>
 #include <mutex>
 
 #include <curl/curl.h>
@@ -28,12 +31,21 @@ MKMOCK_DEFINE_HOOK(curl_slist_append_headers, curl_slist *);
 MKMOCK_DEFINE_HOOK(curl_slist_append_connect_to, curl_slist *);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CONNECT_TO, CURLcode);
 
+MKMOCK_DEFINE_HOOK(curl_slist_append_resolve, curl_slist *);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_RESOLVE, CURLcode);
+
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_URL, CURLcode);
 MKMOCK_DEFINE_HOOK(body_size_overflow_inject, bool);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CUSTOMREQUEST, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HTTPHEADER, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CAINFO, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CAINFO_BLOB, CURLcode);
+#ifdef MKCURL_OPENSSL
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CAPATH, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SSL_CTX_FUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SSL_CTX_DATA, CURLcode);
+#endif
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HTTP_VERSION, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_slist_append_Expect_header, curl_slist *);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_POST, CURLcode);
@@ -48,7 +60,30 @@ MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_VERBOSE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_PROXY, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_FOLLOWLOCATION, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_FORBID_REUSE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAXCONNECTS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAXAGE_CONN, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAXLIFETIME_CONN, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TCP_FASTOPEN, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_IPRESOLVE, CURLcode);
+MKMOCK_DEFINE_HOOK(
+    curl_easy_setopt_CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_ABSTRACT_UNIX_SOCKET, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_UNIX_SOCKET_PATH, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_OPENSOCKETFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_OPENSOCKETDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CLOSESOCKETFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CLOSESOCKETDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SOCKOPTFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SOCKOPTDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_PREREQFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_PREREQDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_XFERINFOFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_XFERINFODATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_NOPROGRESS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAXFILESIZE_LARGE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HEADERFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HEADERDATA, CURLcode);
 
 MKMOCK_DEFINE_HOOK(curl_easy_perform, CURLcode);
 
@@ -57,6 +92,23 @@ MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_RESPONSE_CODE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_URL, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_HTTP_VERSION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_IP, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_PORT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_IP, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_PORT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_CONNECT_TIME, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_NUM_CONNECTS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_ACTIVESOCKET, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_TOTAL_TIME, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_STARTTRANSFER_TIME, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_APPCONNECT_TIME, CURLcode);
+
+MKMOCK_DEFINE_HOOK(curl_multi_init, CURLM *);
+MKMOCK_DEFINE_HOOK(curl_multi_setopt_CURLMOPT_MAX_HOST_CONNECTIONS, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_setopt_CURLMOPT_MAX_TOTAL_CONNECTIONS, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_add_handle, CURLMcode);
+
+MKMOCK_DEFINE_HOOK(curl_global_init_mem, CURLcode);
 
 // Include mkcurl implementation
 // -----------------------------
@@ -160,6 +212,105 @@ CURL_EASY_SETOPT_FAILURE_TEST(
       r.enable_fastopen = true;
     })
 
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_IPRESOLVE,
+    [](mk::curl::Request &r) {
+      r.ip_version = mk::curl::IPVersion::v6;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+    [](mk::curl::Request &r) {
+      r.happy_eyeballs_timeout_ms = 50;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_ABSTRACT_UNIX_SOCKET,
+    [](mk::curl::Request &r) {
+      r.unix_socket_path = "mkcurl-test";
+      r.abstract_unix_socket = true;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_UNIX_SOCKET_PATH,
+    [](mk::curl::Request &r) {
+      r.unix_socket_path = "/tmp/mkcurl-test.sock";
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_OPENSOCKETFUNCTION,
+    [](mk::curl::Request &) {})
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_OPENSOCKETDATA,
+    [](mk::curl::Request &) {})
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_CLOSESOCKETFUNCTION,
+    [](mk::curl::Request &) {})
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_CLOSESOCKETDATA,
+    [](mk::curl::Request &) {})
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_SOCKOPTFUNCTION,
+    [](mk::curl::Request &r) {
+      r.so_rcvbuf = 65536;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_SOCKOPTDATA,
+    [](mk::curl::Request &r) {
+      r.tcp_notsent_lowat = 16384;
+    })
+
+#if LIBCURL_VERSION_NUM >= 0x075000
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_PREREQFUNCTION,
+    [](mk::curl::Request &r) {
+      r.enable_tcp_info = true;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_PREREQDATA,
+    [](mk::curl::Request &r) {
+      r.enable_tcp_info = true;
+    })
+#endif
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_XFERINFOFUNCTION,
+    [](mk::curl::Request &r) {
+      r.progress_interval_ms = 100;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_XFERINFODATA,
+    [](mk::curl::Request &r) {
+      r.progress_interval_ms = 100;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_NOPROGRESS,
+    [](mk::curl::Request &r) {
+      r.progress_interval_ms = 100;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_MAXFILESIZE_LARGE,
+    [](mk::curl::Request &r) {
+      r.max_body_size = 1024;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_HEADERFUNCTION,
+    [](mk::curl::Request &) {})
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_HEADERDATA,
+    [](mk::curl::Request &) {})
+
 CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_CAINFO,
     [](mk::curl::Request &r) {
@@ -261,7 +412,20 @@ CURL_EASY_SETOPT_FAILURE_TEST(
 
 CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_CERTINFO,
-    [](mk::curl::Request &) {})
+    [](mk::curl::Request &r) {
+      r.cert_capture = mk::curl::CertCapture::fingerprints;
+    })
+
+TEST_CASE("We do not set CURLOPT_CERTINFO by default") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, CURL_LAST, {
+      mk::curl::Request req;
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.error == CURLE_OK);
+      REQUIRE(resp.cert_chain.empty());
+    });
+  });
+}
 
 TEST_CASE("When curl_easy_perform() fails") {
   MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURL_LAST, {
@@ -289,8 +453,16 @@ CURL_EASY_GETINFO_FAILURE_TEST(
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_REDIRECT_URL)
 
-CURL_EASY_GETINFO_FAILURE_TEST(
-    curl_easy_getinfo_CURLINFO_CERTINFO)
+TEST_CASE("When curl_easy_getinfo_CURLINFO_CERTINFO fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, CURL_LAST, {
+      mk::curl::Request req;
+      req.cert_capture = mk::curl::CertCapture::chain;
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.error == CURL_LAST);
+    });
+  });
+}
 
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_CONTENT_TYPE)
@@ -298,6 +470,24 @@ CURL_EASY_GETINFO_FAILURE_TEST(
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_HTTP_VERSION)
 
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_PRIMARY_IP)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_PRIMARY_PORT)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_LOCAL_IP)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_LOCAL_PORT)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_NUM_CONNECTS)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_ACTIVESOCKET)
+
 TEST_CASE("When we don't support the request method") {
   mk::curl::Request req;
   req.method = "HEAD";
@@ -313,3 +503,772 @@ TEST_CASE("HTTPVersionString works correctly") {
                      CURL_HTTP_VERSION_LAST),
                  "") == 0);
 }
+
+TEST_CASE("mkcurl_cache_freshness works correctly") {
+  mk::curl::CacheEntry entry;
+  auto freshness = [&](std::string headers, int64_t now) {
+    mk::curl::Response res;
+    std::swap(res.response_headers, headers);
+    mk::curl::mkcurl_header_index(res);
+    return mk::curl::mkcurl_cache_freshness(res, now, entry);
+  };
+  SECTION("with max-age") {
+    std::string headers = "HTTP/1.1 200 Ok\r\n"
+                          "Cache-Control: public, max-age=60\r\n"
+                          "Age: 10\r\n"
+                          "ETag: \"abc\"\r\n\r\n";
+    REQUIRE(freshness(headers, 1000) == true);
+    REQUIRE(entry.expires == 1050);
+    REQUIRE(entry.etag == "\"abc\"");
+  }
+  SECTION("with Expires") {
+    std::string headers = "HTTP/1.1 200 Ok\r\n"
+                          "expires: Thu, 01 Jan 1970 00:16:40 GMT\r\n\r\n";
+    REQUIRE(freshness(headers, 0) == true);
+    REQUIRE(entry.expires == 1000);
+  }
+  SECTION("with no-store") {
+    std::string headers = "HTTP/1.1 200 Ok\r\n"
+                          "Cache-Control: no-store\r\n"
+                          "ETag: \"abc\"\r\n\r\n";
+    REQUIRE(freshness(headers, 0) == false);
+  }
+  SECTION("with no-store after no-cache") {
+    std::string headers = "HTTP/1.1 200 Ok\r\n"
+                          "Cache-Control: no-cache, no-store\r\n"
+                          "ETag: \"abc\"\r\n\r\n";
+    REQUIRE(freshness(headers, 0) == false);
+  }
+  SECTION("with no-cache and max-age") {
+    std::string headers = "HTTP/1.1 200 Ok\r\n"
+                          "Cache-Control: no-cache, max-age=60\r\n"
+                          "ETag: \"abc\"\r\n\r\n";
+    REQUIRE(freshness(headers, 1000) == true);
+    REQUIRE(entry.expires == 1000);
+  }
+  SECTION("with no freshness information") {
+    entry.expires = 1234;
+    std::string headers = "HTTP/1.1 304 Not Modified\r\n"
+                          "ETag: \"abc\"\r\n\r\n";
+    REQUIRE(freshness(headers, 2000) == true);
+    REQUIRE(entry.expires == 1234);
+  }
+  SECTION("with no freshness information and no validators") {
+    std::string headers = "HTTP/1.1 200 Ok\r\n\r\n";
+    REQUIRE(freshness(headers, 0) == false);
+  }
+}
+
+TEST_CASE("mkcurl_cache_freshness can ignore the Age header") {
+  mk::curl::Response res;
+  res.response_headers = "HTTP/1.1 200 Ok\r\n"
+                         "Cache-Control: max-age=60\r\n"
+                         "Age: 100\r\n\r\n";
+  mk::curl::mkcurl_header_index(res);
+  mk::curl::CacheEntry entry;
+  REQUIRE(mk::curl::mkcurl_cache_freshness(res, 1000, entry));
+  REQUIRE(entry.expires == 1000);
+  REQUIRE(mk::curl::mkcurl_cache_freshness(res, 1000, entry, true));
+  REQUIRE(entry.expires == 1060);
+}
+
+TEST_CASE("mkcurl_cache_read_string rejects sizes larger than the file") {
+  std::string s;
+  SECTION("with a valid string") {
+    std::stringstream ss{"3\nabc\n"};
+    REQUIRE(mk::curl::mkcurl_cache_read_string(ss, s));
+    REQUIRE(s == "abc");
+  }
+  SECTION("with a huge size") {
+    std::stringstream ss{"18446744073709551615\nabc\n"};
+    REQUIRE(!mk::curl::mkcurl_cache_read_string(ss, s));
+  }
+  SECTION("with a truncated string") {
+    std::stringstream ss{"1048576\nabc\n"};
+    REQUIRE(!mk::curl::mkcurl_cache_read_string(ss, s));
+  }
+}
+
+TEST_CASE("mkcurl_cache_key distinguishes requests and clients") {
+  mk::curl::ClientState client;
+  mk::curl::Request req;
+  req.url = "https://example.com/";
+  auto key = mk::curl::mkcurl_cache_key(client, req);
+  mk::curl::Request other{req};
+  other.follow_redir = true;
+  REQUIRE(mk::curl::mkcurl_cache_key(client, other) != key);
+  other = req;
+  other.unix_socket_path = "/tmp/sidecar.sock";
+  REQUIRE(mk::curl::mkcurl_cache_key(client, other) != key);
+  other = req;
+  other.connect_to = "::127.0.0.1:";
+  REQUIRE(mk::curl::mkcurl_cache_key(client, other) != key);
+  client.resolve["example.com:443"] = {"127.0.0.1"};
+  REQUIRE(mk::curl::mkcurl_cache_key(client, req) != key);
+}
+
+TEST_CASE("The header index groups headers by redirect hop") {
+  mk::curl::Response res;
+  res.response_headers = "HTTP/1.1 302 Found\r\n"
+                         "Location: /x\r\n"
+                         "Set-Cookie: a=1\r\n\r\n"
+                         "HTTP/1.1 200 Ok\r\n"
+                         "Content-Type:text/plain \r\n"
+                         "set-cookie: b=2\r\n"
+                         "X-Folded: first\r\n"
+                         "  second\r\n"
+                         "SET-COOKIE: c=3\r\n"
+                         "Invalid line\r\n\r\n";
+  mk::curl::mkcurl_header_index(res);
+  REQUIRE(res.header_hops.size() == 2);
+  REQUIRE(res.header_fields.size() == 6);
+  REQUIRE(mk::curl::header_value(res, "location") == "");
+  REQUIRE(mk::curl::header_value(res, "location", 0) == "/x");
+  REQUIRE(mk::curl::header_value(res, "CONTENT-TYPE") == "text/plain");
+  REQUIRE(mk::curl::header_value(res, "x-folded") == "first\r\n  second");
+  REQUIRE(mk::curl::header_values(res, "Set-Cookie") ==
+          std::vector<std::string>{"b=2", "c=3"});
+  REQUIRE(mk::curl::header_values(res, "set-cookie", 0) ==
+          std::vector<std::string>{"a=1"});
+  REQUIRE(mk::curl::header_values(res, "set-cookie", 7) ==
+          std::vector<std::string>{"b=2", "c=3"});
+  REQUIRE(mk::curl::header_values(mk::curl::Response{}, "set-cookie").empty());
+}
+
+TEST_CASE("mkcurl_single_flight_key distinguishes different requests") {
+  mk::curl::ClientState client;
+  auto key = [&](const mk::curl::Request &r) {
+    return mk::curl::mkcurl_single_flight_key(client, nullptr, r);
+  };
+  mk::curl::Request first;
+  first.url = "https://example.com/";
+  mk::curl::Request second{first};
+  REQUIRE(key(first) == key(second));
+  second.connect_to = "::127.0.0.1:";
+  REQUIRE(key(first) != key(second));
+  second = first;
+  second.unix_socket_path = "/tmp/sidecar.sock";
+  REQUIRE(key(first) != key(second));
+  second = first;
+  second.headers.push_back("Accept: */*");
+  REQUIRE(key(first) != key(second));
+  auto differ = [&](std::function<void(mk::curl::Request &)> change) {
+    mk::curl::Request other{first};
+    change(other);
+    return key(first) != key(other);
+  };
+  REQUIRE(differ([](mk::curl::Request &r) { r.max_body_size = 1024; }));
+  REQUIRE(differ([](mk::curl::Request &r) { r.keep_truncated_body = true; }));
+  REQUIRE(differ([](mk::curl::Request &r) { r.max_header_bytes = 1024; }));
+  REQUIRE(differ([](mk::curl::Request &r) {
+    r.resolve.push_back(mk::curl::ResolveEntry{});
+  }));
+  REQUIRE(differ([](mk::curl::Request &r) {
+    r.ip_version = mk::curl::IPVersion::v6;
+  }));
+  REQUIRE(differ([](mk::curl::Request &r) {
+    r.happy_eyeballs_timeout_ms = 50;
+  }));
+  REQUIRE(differ([](mk::curl::Request &r) { r.enable_tcp_info = true; }));
+  REQUIRE(differ([](mk::curl::Request &r) { r.progress_interval_ms = 10; }));
+  REQUIRE(differ([](mk::curl::Request &r) { r.body = "x"; }));
+}
+
+TEST_CASE("mkcurl_single_flight_key distinguishes different clients") {
+  mk::curl::Request req;
+  req.url = "https://example.com/";
+  mk::curl::ClientState first;
+  auto key = mk::curl::mkcurl_single_flight_key(first, nullptr, req);
+  SECTION("with a different TrustStore") {
+    mk::curl::ClientState second;
+    mk::curl::TrustStore::Impl store;
+    second.trust_store_impl = &store;
+    REQUIRE(mk::curl::mkcurl_single_flight_key(second, nullptr, req) != key);
+  }
+  SECTION("with different resolve overrides") {
+    mk::curl::ClientState second;
+    second.resolve["example.com:443"] = {"127.0.0.1"};
+    REQUIRE(mk::curl::mkcurl_single_flight_key(second, nullptr, req) != key);
+  }
+  SECTION("with a different Cache") {
+    mk::curl::Cache cache;
+    REQUIRE(mk::curl::mkcurl_single_flight_key(first, &cache, req) != key);
+  }
+  SECTION("with a different Recording") {
+    mk::curl::ClientState second;
+    mk::curl::Recording::Impl recording;
+    second.recording_impl = &recording;
+    REQUIRE(mk::curl::mkcurl_single_flight_key(second, nullptr, req) != key);
+  }
+}
+
+TEST_CASE("TrustStore::from_file works correctly") {
+  SECTION("when the file does not exist") {
+    REQUIRE(mk::curl::TrustStore::from_file("/nonexistent/ca.pem") == nullptr);
+  }
+  SECTION("when the file exists") {
+    std::string path = "mkcurl-trust-store-test.pem";
+    {
+      std::ofstream out{path};
+      out << "-----BEGIN CERTIFICATE-----\n";
+    }
+    auto first = mk::curl::TrustStore::from_file(path);
+    REQUIRE(first != nullptr);
+    REQUIRE(first->size() == 28);
+    // The bundle must be loaded only once per process.
+    REQUIRE(mk::curl::TrustStore::from_file(path) == first);
+    REQUIRE(remove(path.c_str()) == 0);
+  }
+}
+
+#define TRUST_STORE_SETOPT_FAILURE_TEST(Tag)                \
+  TEST_CASE("When " #Tag " fails") {                        \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, CURL_LAST, {              \
+      mk::curl::Client client;                              \
+      client.set_trust_store(                               \
+          mk::curl::TrustStore::from_memory("-----BEGIN")); \
+      mk::curl::Request req;                                \
+      mk::curl::Response resp = client.perform(req);        \
+      REQUIRE(resp.error == CURL_LAST);                     \
+    });                                                     \
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x074d00
+TRUST_STORE_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_CAINFO_BLOB)
+#endif
+
+#ifdef MKCURL_OPENSSL
+// test_ca is a self-signed certificate that OpenSSL can parse.
+static const char *test_ca =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIIBiTCCAS+gAwIBAgIUVyDh7vMxF3n9FiRhe9vNWdvpupgwCgYIKoZIzj0EAwIw\n"
+    "GTEXMBUGA1UEAwwObWtjdXJsIHRlc3QgQ0EwIBcNMjYxMDE5MDc0ODE4WhgPMjEy\n"
+    "NjA5MjUwNzQ4MThaMBkxFzAVBgNVBAMMDm1rY3VybCB0ZXN0IENBMFkwEwYHKoZI\n"
+    "zj0CAQYIKoZIzj0DAQcDQgAEM5gU5BdEyfL7tyHf0k45of6+kCRPJgHQqL/GovOB\n"
+    "cECkmfMkN1aM5BQ8H19d+dmu5A99wANiDRPEP54NppRjvqNTMFEwHQYDVR0OBBYE\n"
+    "FH2neNWaORuwMhuHy7aoeOlzwTUkMB8GA1UdIwQYMBaAFH2neNWaORuwMhuHy7ao\n"
+    "eOlzwTUkMA8GA1UdEwEB/wQFMAMBAf8wCgYIKoZIzj0EAwIDSAAwRQIgYnJVD7rc\n"
+    "NhEgXTw/DF6HaVarKx4sMBhfXquCmrkNKbICIQDpwJgKdBGv7nQazRhppw4rtICX\n"
+    "wwuaLv+tH9iPECQk5g==\n"
+    "-----END CERTIFICATE-----\n";
+
+#define PARSED_TRUST_STORE_SETOPT_FAILURE_TEST(Tag)                        \
+  TEST_CASE("When " #Tag " fails with a parsed TrustStore") {              \
+    auto store = mk::curl::TrustStore::from_memory(test_ca);               \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, CURL_LAST, {                             \
+      mk::curl::Client client;                                             \
+      client.set_trust_store(store);                                       \
+      mk::curl::Request req;                                               \
+      mk::curl::Response resp = client.perform(req);                       \
+      REQUIRE(resp.error == CURL_LAST);                                    \
+    });                                                                    \
+  }
+
+PARSED_TRUST_STORE_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_CAINFO)
+PARSED_TRUST_STORE_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_CAPATH)
+PARSED_TRUST_STORE_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_SSL_CTX_FUNCTION)
+PARSED_TRUST_STORE_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_SSL_CTX_DATA)
+#endif
+
+TEST_CASE("mkcurl_url_host_port works correctly") {
+  std::string host;
+  int64_t port = 0;
+  SECTION("with the default HTTPS port") {
+    REQUIRE(mk::curl::mkcurl_url_host_port(
+        "https://User@WWW.Example.com/x?y", host, port));
+    REQUIRE(host == "www.example.com");
+    REQUIRE(port == 443);
+  }
+  SECTION("with an explicit port and IPv6") {
+    REQUIRE(mk::curl::mkcurl_url_host_port("http://[::1]:8080", host, port));
+    REQUIRE(host == "::1");
+    REQUIRE(port == 8080);
+  }
+  SECTION("with an unsupported scheme") {
+    REQUIRE(!mk::curl::mkcurl_url_host_port("ftp://x.org/", host, port));
+  }
+  SECTION("with an invalid port") {
+    REQUIRE(!mk::curl::mkcurl_url_host_port("http://x.org:0/", host, port));
+  }
+}
+
+TEST_CASE("mkcurl_hex_decode reverses mkcurl_hex_encode") {
+  std::string binary{"\x00\xff\x10mkcurl", 9};
+  std::string decoded;
+  REQUIRE(mk::curl::mkcurl_hex_encode(binary) == "00ff106d6b6375726c");
+  REQUIRE(mk::curl::mkcurl_hex_decode(
+      mk::curl::mkcurl_hex_encode(binary), decoded));
+  REQUIRE(decoded == binary);
+  REQUIRE(!mk::curl::mkcurl_hex_decode("0", decoded));
+  REQUIRE(!mk::curl::mkcurl_hex_decode("zz", decoded));
+}
+
+// session_store_with_address returns a SessionStore that knows the
+// address of the host used by the session store tests.
+static std::shared_ptr<mk::curl::SessionStore> session_store_with_address() {
+  std::string path = "mkcurl-session-store-test.txt";
+  {
+    std::ofstream out{path};
+    out << "mkcurl-session-store-v1\n"
+        << "dns www.example.com:443 127.0.0.1 " << INT64_MAX << "\n"
+        << "dns expired.example.com:443 127.0.0.1 1\n";
+  }
+  auto store = std::make_shared<mk::curl::SessionStore>();
+  REQUIRE(store->load(path));
+  REQUIRE(remove(path.c_str()) == 0);
+  return store;
+}
+
+#define SESSION_STORE_FAILURE_TEST(Tag, Value, Error)       \
+  TEST_CASE("When " #Tag " fails") {                        \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, Value, {                  \
+      mk::curl::Client client;                              \
+      auto store = session_store_with_address();            \
+      client.set_session_store(store);                      \
+      mk::curl::Request req;                                \
+      req.url = "https://www.example.com/";                 \
+      mk::curl::Response resp = client.perform(req);        \
+      REQUIRE(resp.error == Error);                         \
+    });                                                     \
+  }
+
+SESSION_STORE_FAILURE_TEST(
+    curl_slist_append_resolve, nullptr, CURLE_OUT_OF_MEMORY)
+
+SESSION_STORE_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_RESOLVE, CURL_LAST, CURL_LAST)
+
+TEST_CASE("SessionStore ignores expired addresses") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_RESOLVE, CURL_LAST, {
+    mk::curl::Client client;
+    client.set_session_store(session_store_with_address());
+    mk::curl::Request req;
+    req.url = "https://expired.example.com/";
+    req.retries = 0;
+    mk::curl::Response resp = client.perform(req);
+    REQUIRE(resp.error != CURL_LAST);
+  });
+}
+
+TEST_CASE("mkcurl_resolve_entries works correctly") {
+  mk::curl::ClientState client;
+  client.resolve["www.example.com:443"] = {"2001:db8::1", "192.0.2.1"};
+  client.resolve["www.example.org:80"] = {"192.0.2.2"};
+  mk::curl::Request req;
+  req.url = "https://www.example.com/";
+
+  SECTION("we format the client entries") {
+    auto entries = mk::curl::mkcurl_resolve_entries(client, req);
+    REQUIRE(entries.size() == 2);
+    REQUIRE(entries[0] == "www.example.com:443:[2001:db8::1],192.0.2.1");
+    REQUIRE(entries[1] == "www.example.org:80:192.0.2.2");
+  }
+
+  SECTION("the request entries take precedence") {
+    mk::curl::ResolveEntry entry;
+    entry.host = "WWW.EXAMPLE.COM";
+    entry.addresses = {"192.0.2.3"};
+    req.resolve.push_back(entry);
+    auto entries = mk::curl::mkcurl_resolve_entries(client, req);
+    REQUIRE(entries.size() == 2);
+    REQUIRE(entries[0] == "www.example.com:443:192.0.2.3");
+  }
+
+  SECTION("we try first the address that worked last time") {
+    client.resolve_working["www.example.com:443"] = "192.0.2.1";
+    auto entries = mk::curl::mkcurl_resolve_entries(client, req);
+    REQUIRE(entries[0] == "www.example.com:443:192.0.2.1,[2001:db8::1]");
+  }
+
+  SECTION("we remove the entries that do not apply anymore") {
+    (void)mk::curl::mkcurl_resolve_entries(client, req);
+    client.resolve.erase("www.example.org:80");
+    auto entries = mk::curl::mkcurl_resolve_entries(client, req);
+    REQUIRE(entries.size() == 2);
+    REQUIRE(entries[1] == "-www.example.org:80");
+    entries = mk::curl::mkcurl_resolve_entries(client, req);
+    REQUIRE(entries.size() == 1);
+  }
+}
+
+TEST_CASE("A cancelled request is not performed") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURL_LAST, {
+    mk::curl::Request req;
+    req.cancellation = std::make_shared<mk::curl::CancellationToken>();
+    req.cancellation->cancel();
+    mk::curl::Response resp = mk::curl::perform(req);
+    REQUIRE(resp.error == mk::curl::error_cancelled);
+  });
+}
+
+TEST_CASE("CircuitBreaker opens after consecutive connect failures") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+    mk::curl::CircuitBreakerSettings settings;
+    settings.failure_threshold = 2;
+    auto breaker = std::make_shared<mk::curl::CircuitBreaker>(settings);
+    mk::curl::Client client;
+    client.set_circuit_breaker(breaker);
+    mk::curl::Request req;
+    req.url = "http://127.0.0.1:1/";
+    REQUIRE(client.perform(req).error == CURLE_COULDNT_CONNECT);
+    REQUIRE(breaker->state("127.0.0.1", 1) == mk::curl::CircuitState::closed);
+    REQUIRE(client.perform(req).error == CURLE_COULDNT_CONNECT);
+    REQUIRE(breaker->state("127.0.0.1", 1) == mk::curl::CircuitState::open);
+    REQUIRE(client.perform(req).error == mk::curl::error_circuit_open);
+    REQUIRE(breaker->stats().opened == 1);
+    REQUIRE(breaker->stats().fast_failed == 1);
+  });
+}
+
+TEST_CASE("CircuitBreaker lets a single probe through when half open") {
+  mk::curl::CircuitBreaker::Impl impl;
+  impl.settings.failure_threshold = 1;
+  impl.settings.cooldown_ms = 0;
+  impl.report("a:80", mk::curl::CircuitOutcome::failed);
+  REQUIRE(impl.allow("a:80"));
+  REQUIRE(!impl.allow("a:80"));
+  impl.report("a:80", mk::curl::CircuitOutcome::unknown);
+  REQUIRE(impl.allow("a:80"));
+  impl.report("a:80", mk::curl::CircuitOutcome::connected);
+  REQUIRE(impl.circuits.empty());
+  REQUIRE(impl.stats.opened == 1);
+  REQUIRE(impl.stats.half_opened == 1);
+  REQUIRE(impl.stats.closed == 1);
+  REQUIRE(impl.stats.fast_failed == 1);
+}
+
+TEST_CASE("When curl_easy_getinfo(CURLINFO_CONNECT_TIME) fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OPERATION_TIMEDOUT, {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_getinfo_CURLINFO_CONNECT_TIME, CURL_LAST, {
+          mk::curl::CircuitBreakerSettings settings;
+          settings.failure_threshold = 1;
+          auto breaker = std::make_shared<mk::curl::CircuitBreaker>(settings);
+          mk::curl::Client client;
+          client.set_circuit_breaker(breaker);
+          mk::curl::Request req;
+          req.url = "http://127.0.0.1:1/";
+          auto resp = client.perform(req);
+          REQUIRE(resp.error == CURLE_OPERATION_TIMEDOUT);
+          REQUIRE(breaker->state("127.0.0.1", 1) ==
+                  mk::curl::CircuitState::closed);
+        });
+  });
+}
+
+TEST_CASE("RateLimiter accounts for the total and the class budgets") {
+  mk::curl::RateLimiterSettings settings;
+  settings.total.download_bytes_per_second = 1000;
+  settings.background.download_bytes_per_second = 100;
+  settings.burst_ms = 1000;
+  mk::curl::RateLimiter::Impl impl;
+  impl.configure(0, settings.total, settings.burst_ms);
+  impl.configure(1, settings.background, settings.burst_ms);
+  auto now = std::chrono::steady_clock::now();
+  mk::curl::Request req;
+  // The normal class has no limit of its own, hence only the total matters.
+  REQUIRE(impl.take(req, mk::curl::RateDirection::down, 500, now) == now);
+  auto until = impl.take(req, mk::curl::RateDirection::down, 1000, now);
+  REQUIRE(until - now == std::chrono::milliseconds(500));
+  // The background class has its own limit, which here is stricter.
+  req.priority = mk::curl::Priority::background;
+  until = impl.take(req, mk::curl::RateDirection::down, 200, now);
+  REQUIRE(until - now == std::chrono::seconds(1));
+  // Without limits we never wait.
+  REQUIRE(impl.take(req, mk::curl::RateDirection::up, 1 << 30, now) == now);
+}
+
+TEST_CASE("mkcurl_histogram_index is consistent with the bounds") {
+  for (int64_t us : {0, 1, 3, 4, 5, 7, 8, 9, 1000, 123456, 268435455}) {
+    size_t index = mk::curl::mkcurl_histogram_index(us);
+    REQUIRE(index + 1 < mk::curl::mkcurl_histogram_buckets);
+    REQUIRE(us <= mk::curl::mkcurl_histogram_bound(index));
+    if (index > 0) REQUIRE(us > mk::curl::mkcurl_histogram_bound(index - 1));
+  }
+  REQUIRE(mk::curl::mkcurl_histogram_index(268435456) + 1 ==
+          mk::curl::mkcurl_histogram_buckets);
+}
+
+TEST_CASE("Metrics snapshots are formatted correctly") {
+  mk::curl::MetricsSnapshot snap;
+  snap.requests = 2;
+  snap.errors[CURLE_COULDNT_CONNECT] = 1;
+  snap.status_codes[200] = 1;
+  snap.total.bounds = {1, 2};
+  snap.total.counts = {0, 1, 1};
+  snap.total.count = 2;
+  snap.total.sum_us = 1500002;
+  auto prometheus = mk::curl::metrics_prometheus(snap);
+  REQUIRE(prometheus.find("mkcurl_requests_total 2\n") != std::string::npos);
+  REQUIRE(prometheus.find("mkcurl_errors_total{error=\"7\"} 1\n") !=
+          std::string::npos);
+  REQUIRE(prometheus.find("mkcurl_responses_total{code=\"200\"} 1\n") !=
+          std::string::npos);
+  REQUIRE(prometheus.find("mkcurl_total_seconds_bucket{le=\"0.000002\"} 1\n"
+                          "mkcurl_total_seconds_bucket{le=\"+Inf\"} 2\n"
+                          "mkcurl_total_seconds_sum 1.500002\n"
+                          "mkcurl_total_seconds_count 2\n") !=
+          std::string::npos);
+  auto json = mk::curl::metrics_json(snap);
+  REQUIRE(json.find("\"requests\":2,") != std::string::npos);
+  REQUIRE(json.find("\"errors\":{\"7\":1}") != std::string::npos);
+  REQUIRE(json.find("\"total\":{\"count\":2,\"sum_us\":1500002,"
+                    "\"buckets\":[{\"le_us\":2,\"count\":1},"
+                    "{\"le_us\":null,\"count\":1}]}") != std::string::npos);
+}
+
+TEST_CASE("mkcurl_json_quote escapes the string") {
+  REQUIRE(mk::curl::mkcurl_json_quote("a\"b\\c\n") == "\"a\\\"b\\\\c\\u000a\"");
+}
+
+TEST_CASE("An empty Tracer produces an empty trace") {
+  mk::curl::Tracer tracer;
+  REQUIRE(tracer.json() ==
+          "{\"traceEvents\":[],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+#define METRICS_FAILURE_TEST(Tag, Histograms)                  \
+  TEST_CASE("When " #Tag " fails while recording metrics") {   \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, CURL_LAST, {                 \
+      auto metrics = std::make_shared<mk::curl::Metrics>();    \
+      mk::curl::Client client;                                 \
+      client.set_metrics(metrics);                             \
+      mk::curl::Request req;                                   \
+      req.url = "http://127.0.0.1:1/";                         \
+      req.retries = 0;                                         \
+      REQUIRE(client.perform(req).error != 0);                 \
+      auto snap = metrics->snapshot();                         \
+      REQUIRE(snap.requests == 1);                             \
+      REQUIRE(snap.errors.size() == 1);                        \
+      REQUIRE(snap.total.count == Histograms);                 \
+    });                                                        \
+  }
+
+METRICS_FAILURE_TEST(curl_easy_getinfo_CURLINFO_NUM_CONNECTS, 0)
+METRICS_FAILURE_TEST(curl_easy_getinfo_CURLINFO_TOTAL_TIME, 0)
+METRICS_FAILURE_TEST(curl_easy_getinfo_CURLINFO_STARTTRANSFER_TIME, 1)
+
+TEST_CASE("Sha256 works correctly") {
+  auto digest = [](const std::string &s) {
+    mk::curl::Sha256 sha256;
+    sha256.update((const uint8_t *)s.data(), s.size());
+    return sha256.hexdigest();
+  };
+  REQUIRE(digest("") == "e3b0c44298fc1c149afbf4c8996fb924"
+                        "27ae41e4649b934ca495991b7852b855");
+  REQUIRE(digest("abc") == "ba7816bf8f01cfea414140de5dae2223"
+                           "b00361a396177a9cb410ff61f20015ad");
+  REQUIRE(digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  SECTION("when the input spans several blocks and updates") {
+    std::string a(1000000, 'a');
+    auto million = "cdc76e5c9914fb9281a1c7e284d73e67"
+                   "f1809a48a497200e046d39ccc7112cd0";
+    REQUIRE(digest(a) == million);
+    mk::curl::Sha256 sha256;
+    auto p = (const uint8_t *)a.data();
+    for (size_t off = 0, n = 1; off < a.size(); off += n, n = n * 3 % 200) {
+      n = std::min(n, a.size() - off);
+      sha256.update(p + off, n);
+    }
+    REQUIRE(sha256.hexdigest() == million);
+  }
+}
+
+TEST_CASE("mkcurl_cert_decode works correctly") {
+  std::string pem = "-----BEGIN CERTIFICATE-----\nYWJj\nZA==\n"
+                    "-----END CERTIFICATE-----\n";
+  std::string abcd = "88d4266fd4e6338d13b845fcf289579d"
+                     "209c897823b9217da3e161936f031589";
+  SECTION("when capturing the chain") {
+    mk::curl::Certificate cert;
+    REQUIRE(mk::curl::mkcurl_cert_decode(
+        pem.c_str(), mk::curl::CertCapture::chain, cert));
+    REQUIRE(cert.der == "abcd");
+    REQUIRE(cert.sha256 == abcd);
+  }
+  SECTION("when only capturing fingerprints") {
+    mk::curl::Certificate cert;
+    REQUIRE(mk::curl::mkcurl_cert_decode(
+        pem.c_str(), mk::curl::CertCapture::fingerprints, cert));
+    REQUIRE(cert.der.empty());
+    REQUIRE(cert.sha256 == abcd);
+  }
+  SECTION("when the input is not a PEM certificate") {
+    mk::curl::Certificate cert;
+    REQUIRE(!mk::curl::mkcurl_cert_decode(
+        "YWJj", mk::curl::CertCapture::chain, cert));
+    REQUIRE(!mk::curl::mkcurl_cert_decode(
+        "-----BEGIN CERTIFICATE-----\nYW*j\n", mk::curl::CertCapture::chain,
+        cert));
+  }
+}
+
+TEST_CASE("Recording::load and Recording::save work correctly") {
+  std::string path = "mkcurl-recording-test.txt";
+  auto write = [&](const std::string &s) {
+    std::ofstream out{path, std::ios::trunc | std::ios::binary};
+    out << s;
+  };
+  SECTION("when the file is valid") {
+    std::string data = "mkcurl-recording-v1\n"
+                       "exchange 3\n"
+                       "+ 0 0\n\n"
+                       "> 10 5\nGET \n\n"
+                       "< 200 3\nx\n1\n"
+                       "exchange 0\n";
+    data[data.find("x\n1")] = '\0';  // the data is binary
+    write(data);
+    mk::curl::Recording recording;
+    REQUIRE(recording.load(path));
+    REQUIRE(recording.size() == 2);
+    REQUIRE(recording.save(path + ".copy"));
+    std::ifstream in{path + ".copy", std::ios::binary};
+    std::string copy{std::istreambuf_iterator<char>{in},
+                     std::istreambuf_iterator<char>{}};
+    REQUIRE(copy == data);
+  }
+  SECTION("when the file is not valid") {
+    for (auto data : {"", "mkcurl-recording-v0\n",
+                      "mkcurl-recording-v1\nexchange\n",
+                      "mkcurl-recording-v1\nexchange 1\n",
+                      "mkcurl-recording-v1\nexchange 1\n? 0 0\n\n",
+                      "mkcurl-recording-v1\nexchange 1\n< 0 5\nabc\n"}) {
+      write(data);
+      mk::curl::Recording recording;
+      REQUIRE(!recording.load(path));
+      REQUIRE(recording.size() == 0);
+    }
+  }
+}
+
+TEST_CASE("We fail when there are no more exchanges to replay") {
+  mk::curl::Client client;
+  client.set_recording(std::make_shared<mk::curl::Recording>(),
+                       mk::curl::RecordingMode::replay);
+  mk::curl::Request req;
+  auto res = client.perform(req);
+  REQUIRE(res.error == mk::curl::error_replay_exhausted);
+}
+
+TEST_CASE("When curl_easy_setopt_CURLOPT_FORBID_REUSE fails") {
+  {
+    std::ofstream out{"mkcurl-recording-test.txt", std::ios::trunc};
+    out << "mkcurl-recording-v1\nexchange 0\n";
+  }
+  auto recording = std::make_shared<mk::curl::Recording>();
+  REQUIRE(recording->load("mkcurl-recording-test.txt"));
+  mk::curl::Client client;
+  client.set_recording(recording, mk::curl::RecordingMode::replay);
+  mk::curl::Request req;
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_FORBID_REUSE, CURL_LAST, {
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURL_LAST);
+  });
+}
+
+#define CONNECTION_POOL_SETOPT_FAILURE_TEST(Tag)           \
+  TEST_CASE("When " #Tag " fails") {                       \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, CURL_LAST, {             \
+      mk::curl::ConnectionPoolSettings settings;           \
+      settings.max_connections = 4;                        \
+      settings.max_idle_seconds = 30;                      \
+      settings.max_age_seconds = 60;                       \
+      mk::curl::Client client;                             \
+      client.set_connection_pool(settings);                \
+      mk::curl::Request req;                               \
+      REQUIRE(client.perform(req).error == CURL_LAST);     \
+    });                                                    \
+  }
+
+CONNECTION_POOL_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_MAXCONNECTS)
+
+#if LIBCURL_VERSION_NUM >= 0x074100
+CONNECTION_POOL_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_MAXAGE_CONN)
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x075000
+CONNECTION_POOL_SETOPT_FAILURE_TEST(curl_easy_setopt_CURLOPT_MAXLIFETIME_CONN)
+#endif
+
+#define ENGINE_FAILURE_TEST(Tag, Value, Error)              \
+  TEST_CASE("When " #Tag " fails") {                        \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, Value, {                  \
+      mk::curl::Response resp;                              \
+      {                                                     \
+        mk::curl::Engine engine;                            \
+        mk::curl::Request req;                              \
+        req.url = "http://127.0.0.1:1/";                    \
+        engine.submit(req, [&](mk::curl::Response &&r) {    \
+          resp = std::move(r);                              \
+        });                                                 \
+      }                                                     \
+      REQUIRE(resp.error == Error);                         \
+    });                                                     \
+  }
+
+ENGINE_FAILURE_TEST(curl_multi_init, nullptr, CURLE_OUT_OF_MEMORY)
+
+ENGINE_FAILURE_TEST(
+    curl_multi_setopt_CURLMOPT_MAX_HOST_CONNECTIONS, CURLM_INTERNAL_ERROR,
+    CURLE_FAILED_INIT)
+
+ENGINE_FAILURE_TEST(
+    curl_multi_setopt_CURLMOPT_MAX_TOTAL_CONNECTIONS, CURLM_INTERNAL_ERROR,
+    CURLE_FAILED_INIT)
+
+ENGINE_FAILURE_TEST(
+    curl_multi_add_handle, CURLM_INTERNAL_ERROR, CURLE_FAILED_INIT)
+
+TEST_CASE("Hedger::perform deals with curl_multi_init failures") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_init, nullptr, {
+    mk::curl::Hedger hedger;
+    mk::curl::Client client;
+    mk::curl::Request req;
+    mk::curl::Response resp = hedger.perform(client, req);
+    REQUIRE(resp.error == CURLE_OUT_OF_MEMORY);
+  });
+}
+
+TEST_CASE("Hedger::perform deals with curl_multi_add_handle failures") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_add_handle, CURLM_INTERNAL_ERROR, {
+    mk::curl::Hedger hedger;
+    mk::curl::Client client;
+    mk::curl::Request req;
+    mk::curl::Response resp = hedger.perform(client, req);
+    REQUIRE(resp.error == CURLE_FAILED_INIT);
+    REQUIRE(resp.hedged);
+  });
+}
+
+TEST_CASE("global_init rejects an incomplete Allocator") {
+  mk::curl::Allocator allocator;
+  allocator.malloc_fn = malloc;
+  allocator.free_fn = free;
+  REQUIRE(mk::curl::global_init(allocator) == CURLE_BAD_FUNCTION_ARGUMENT);
+}
+
+TEST_CASE("When curl_global_init_mem fails") {
+  mk::curl::Allocator allocator;
+  allocator.malloc_fn = malloc;
+  allocator.free_fn = free;
+  allocator.realloc_fn = realloc;
+  allocator.strdup_fn = strdup;
+  allocator.calloc_fn = calloc;
+  MKMOCK_WITH_ENABLED_HOOK(curl_global_init_mem, CURL_LAST, {
+    REQUIRE(mk::curl::global_init(allocator) == CURL_LAST);
+  });
+  // Since libcurl may already use the allocator, we cannot pass it again.
+  REQUIRE(mk::curl::global_init(allocator) == CURLE_FAILED_INIT);
+}
+
+TEST_CASE("mkcurl_response_bytes counts the heap memory of a Response") {
+  mk::curl::Response res;
+  REQUIRE(mk::curl::mkcurl_response_bytes(res) == 0);
+  res.body.reserve(4096);
+  REQUIRE(mk::curl::mkcurl_response_bytes(res) >= 4096);
+  res.progress.resize(16);
+  REQUIRE(mk::curl::mkcurl_response_bytes(res) >=
+          4096 + 16 * (int64_t)sizeof(mk::curl::ProgressSample));
+}